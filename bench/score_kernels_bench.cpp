@@ -0,0 +1,108 @@
+// Микробенчмарк ядер накопления оценок: время на posting при разной плотности id
+// и совпадение сумм со скалярным вариантом.
+// Сборка: g++ -std=c++17 -O2 -pthread bench/score_kernels_bench.cpp -o score_kernels_bench
+#define main search_server_demo_main
+#include "../main.cpp"
+#undef main
+
+#include <random>
+
+struct KernelVariant {
+    string name;
+    AccumulateScoresKernel kernel;
+};
+
+vector<KernelVariant> GetKernelVariants() {
+    vector<KernelVariant> variants = {{"scalar"s, AccumulateScoresScalar}};
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        variants.push_back({"avx2"s, AccumulateScoresAvx2});
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        variants.push_back({"avx512"s, AccumulateScoresAvx512});
+    }
+#endif
+    return variants;
+}
+
+void BenchmarkDensity(int id_range, int step) {
+    mt19937 generator(11);
+    vector<int> document_ids;
+    for (int document_id = 0; document_id < id_range; ++document_id) {
+        if (generator() % step == 0) {
+            document_ids.push_back(document_id);
+        }
+    }
+    vector<double> term_freqs(document_ids.size());
+    for (double& term_freq : term_freqs) {
+        term_freq = (generator() % 1000) / 1000.0;
+    }
+
+    constexpr int RUN_COUNT = 20;
+    vector<double> reference;
+    for (const auto& [name, kernel] : GetKernelVariants()) {
+        vector<double> scores(id_range, -0.0);
+        const auto start = chrono::steady_clock::now();
+        for (int run = 0; run < RUN_COUNT; ++run) {
+            for (size_t begin = 0; begin < document_ids.size(); begin += POSTING_BLOCK_SIZE) {
+                kernel(scores.data(), document_ids.data() + begin, term_freqs.data() + begin,
+                       min(POSTING_BLOCK_SIZE, document_ids.size() - begin), 0.37);
+            }
+        }
+        const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+        if (reference.empty()) {
+            reference = scores;
+        }
+        cout << "  "s << name << ": "s << elapsed.count() / RUN_COUNT / document_ids.size() << " ns/posting, "s
+             << (memcmp(reference.data(), scores.data(), scores.size() * sizeof(double)) == 0 ? "same sums"s : "DIFFERENT SUMS"s)
+             << endl;
+    }
+}
+
+void BenchmarkQueries() {
+    mt19937 generator(7);
+    vector<string> vocabulary;
+    for (int i = 0; i < 500; ++i) {
+        vocabulary.push_back("w"s + to_string(i));
+    }
+
+    SearchServer search_server(""s);
+    for (int document_id = 0; document_id < 200000; ++document_id) {
+        string text;
+        for (int i = 0; i < 20; ++i) {
+            text += vocabulary[min(generator() % vocabulary.size(), generator() % vocabulary.size())] + ' ';
+        }
+        (void) search_server.AddDocument(document_id, text, DocumentStatus::ACTUAL, {static_cast<int>(generator() % 10)});
+    }
+
+    vector<string> queries;
+    for (int i = 0; i < 100; ++i) {
+        queries.push_back(vocabulary[generator() % 20] + ' ' + vocabulary[generator() % 100] + ' ' + vocabulary[generator() % 500]);
+    }
+
+    const auto start = chrono::steady_clock::now();
+    for (const string& query : queries) {
+        (void) search_server.FindTopDocuments(query);
+    }
+    const chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+    cout << "FindTopDocuments, 200k documents, dense accumulator: "s << elapsed.count() / queries.size() << " us/query"s << endl;
+}
+
+int main() {
+    for (const auto& [name, kernel] : GetKernelVariants()) {
+        cout << name << " calibration: "s << MeasureAccumulateScoresKernel(kernel) << " ns/posting"s << endl;
+    }
+    for (const auto& [name, kernel] : GetKernelVariants()) {
+        if (kernel == GetAccumulateScoresKernel()) {
+            cout << "selected kernel: "s << name << endl;
+        }
+    }
+
+    for (const int step : {2, 4, 32}) {
+        cout << "1M ids, one posting per "s << step << " ids:"s << endl;
+        BenchmarkDensity(1 << 20, step);
+    }
+
+    BenchmarkQueries();
+}
@@ -0,0 +1,138 @@
+// Бенчмарк TermTree против std::map: точечный поиск, память на слово, упорядоченный обход
+// и перебор по префиксу на 300 тысячах слов.
+// Сборка: g++ -std=c++17 -O2 -pthread bench/term_tree_bench.cpp -o term_tree_bench
+#define main search_server_demo_main
+#include "../main.cpp"
+#undef main
+
+#include <malloc.h>
+#include <random>
+
+// Слова из 1–12 букв: первые две из 26, дальше из 6, чтобы у слов были общие префиксы
+vector<string> GenerateTerms(size_t count, mt19937& generator) {
+    vector<string> terms;
+    set<string> seen;
+    while (terms.size() < count) {
+        const int length = 1 + generator() % 12;
+        string term;
+        for (int i = 0; i < length; ++i) {
+            term += static_cast<char>('a' + generator() % (i < 2 ? 26 : 6));
+        }
+        if (seen.insert(term).second) {
+            terms.push_back(move(term));
+        }
+    }
+    return terms;
+}
+
+size_t GetHeapBytes() {
+    return mallinfo2().uordblks;
+}
+
+template <typename Func>
+double MeasureNanoseconds(Func func, size_t operation_count) {
+    const auto start = chrono::steady_clock::now();
+    func();
+    const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / operation_count;
+}
+
+int main() {
+    mt19937 generator(11);
+    const vector<string> terms = GenerateTerms(300000, generator);
+
+    const size_t heap_before_tree = GetHeapBytes();
+    TermTree tree([&terms](TermId term) {
+        return string_view(terms[term]);
+    });
+    for (TermId term = 0; term < terms.size(); ++term) {
+        (void) tree.Insert(term);
+    }
+    const size_t heap_before_view_map = GetHeapBytes();
+    map<string_view, TermId> view_map;
+    for (TermId term = 0; term < terms.size(); ++term) {
+        view_map.emplace(terms[term], term);
+    }
+    const size_t heap_before_string_map = GetHeapBytes();
+    map<string, TermId> string_map;
+    for (TermId term = 0; term < terms.size(); ++term) {
+        string_map.emplace(terms[term], term);
+    }
+    const size_t heap_after = GetHeapBytes();
+
+    cout << "bytes per term: TermTree "s << double(heap_before_view_map - heap_before_tree) / terms.size()
+         << ", map<string_view> "s << double(heap_before_string_map - heap_before_view_map) / terms.size()
+         << ", map<string> "s << double(heap_after - heap_before_string_map) / terms.size() << endl;
+
+    vector<string> probes;
+    for (int i = 0; i < 2000000; ++i) {
+        probes.push_back(terms[generator() % terms.size()]);
+    }
+
+    size_t tree_sum = 0;
+    size_t view_map_sum = 0;
+    size_t string_map_sum = 0;
+    const double tree_lookup = MeasureNanoseconds([&] {
+        for (const string& probe : probes) {
+            tree_sum += *tree.Find(probe);
+        }
+    }, probes.size());
+    const double view_map_lookup = MeasureNanoseconds([&] {
+        for (const string& probe : probes) {
+            view_map_sum += view_map.find(probe)->second;
+        }
+    }, probes.size());
+    const double string_map_lookup = MeasureNanoseconds([&] {
+        for (const string& probe : probes) {
+            string_map_sum += string_map.find(probe)->second;
+        }
+    }, probes.size());
+    cout << "lookup, ns: TermTree "s << tree_lookup << ", map<string_view> "s << view_map_lookup
+         << ", map<string> "s << string_map_lookup << (tree_sum == view_map_sum && view_map_sum == string_map_sum ? ""s : " (MISMATCH)"s)
+         << endl;
+
+    size_t tree_count = 0;
+    size_t map_count = 0;
+    const double tree_scan = MeasureNanoseconds([&] {
+        tree.ForEach([&tree_count, &terms](TermId term) {
+            tree_count += terms[term].size();
+            return true;
+        });
+    }, terms.size());
+    const double map_scan = MeasureNanoseconds([&] {
+        for (const auto& [term, id] : view_map) {
+            map_count += term.size();
+        }
+    }, terms.size());
+    cout << "ordered scan, ns per term: TermTree "s << tree_scan << ", map<string_view> "s << map_scan
+         << (tree_count == map_count ? ""s : " (MISMATCH)"s) << endl;
+
+    vector<string> prefixes;
+    for (int i = 0; i < 100000; ++i) {
+        const string& term = terms[generator() % terms.size()];
+        prefixes.push_back(term.substr(0, 1 + generator() % min<size_t>(term.size(), 3)));
+    }
+
+    size_t tree_matches = 0;
+    size_t map_matches = 0;
+    const double tree_prefix = MeasureNanoseconds([&] {
+        for (const string& prefix : prefixes) {
+            int left = 10;
+            tree.ForEachWithPrefix(prefix, [&](TermId) {
+                ++tree_matches;
+                return --left > 0;
+            });
+        }
+    }, prefixes.size());
+    const double map_prefix = MeasureNanoseconds([&] {
+        for (const string& prefix : prefixes) {
+            int left = 10;
+            for (auto it = view_map.lower_bound(prefix); it != view_map.end() && it->first.substr(0, prefix.size()) == prefix && left > 0;
+                 ++it, --left) {
+                ++map_matches;
+            }
+        }
+    }, prefixes.size());
+    cout << "first 10 terms with prefix, ns: TermTree "s << tree_prefix << ", map<string_view> "s << map_prefix
+         << (tree_matches == map_matches ? ""s : " (MISMATCH)"s) << endl;
+}
@@ -1,17 +1,62 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <nmmintrin.h>
+#endif
 #include <optional>
 #include <set>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 using namespace std;
 
 const int MAX_RESULT_DOCUMENT_COUNT = 5;
 const double DELTA = 1e-6;
+const size_t REINDEX_BATCH_SIZE = 256;
+const size_t QUERY_LOG_SIZE = 1000;
+const size_t POSTING_BLOCK_SIZE = 64;
+const size_t MAX_SHORT_QUERY_WORDS = 3;
+const size_t REPLICATION_BATCH_SIZE = 4096;
+const size_t SNAPSHOT_SECTION_ITEMS = 16384;
+// Плотный массив оценок выгоднее словаря, когда posting-ов запроса не меньше
+// такой доли диапазона id документов
+const double DENSE_ACCUMULATOR_MIN_DENSITY = 1.0 / 32;
+// При большем диапазоне id плотный массив на поток занял бы больше 128 МБ, и оценки копятся в словаре
+const size_t DENSE_ACCUMULATOR_MAX_IDS = size_t(1) << 24;
 
 string ReadLine() {
     string s;
@@ -46,80 +91,6277 @@ vector<string> SplitIntoWords(const string& text) {
     return words;
 }
 
-struct Document {
-    Document(): id(0), relevance(0.0), rating(0) { }
+// LSD-сортировка пар (ключ, индекс) по возрастанию ключа разрядами по 16 бит.
+// Каждый поток считает гистограмму своей части массива и раскладывает её в свои
+// диапазоны выходного массива; разряды, одинаковые у всех ключей, пропускаются
+void ParallelRadixSort(vector<pair<uint64_t, uint32_t>>& items) {
+    constexpr int DIGIT_BITS = 16;
+    constexpr size_t DIGIT_COUNT = size_t(1) << DIGIT_BITS;
+    constexpr size_t MIN_ITEMS_PER_THREAD = 1 << 16;
+
+    const size_t thread_count = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), items.size() / MIN_ITEMS_PER_THREAD));
+    const size_t part_size = (items.size() + thread_count - 1) / max<size_t>(thread_count, 1);
+    vector<pair<uint64_t, uint32_t>> buffer(items.size());
+    vector<vector<size_t>> histograms(thread_count, vector<size_t>(DIGIT_COUNT));
+
+    const auto run_parts = [thread_count](auto task) {
+        vector<future<void>> futures;
+        for (size_t part = 1; part < thread_count; ++part) {
+            futures.push_back(async(launch::async, task, part));
+        }
+        task(0);
+        for (future<void>& f : futures) {
+            f.get();
+        }
+    };
+
+    for (int shift = 0; shift < 64; shift += DIGIT_BITS) {
+        run_parts([&](size_t part) {
+            vector<size_t>& histogram = histograms[part];
+            fill(histogram.begin(), histogram.end(), 0);
+            const size_t end = min(items.size(), (part + 1) * part_size);
+            for (size_t i = part * part_size; i < end; ++i) {
+                ++histogram[(items[i].first >> shift) & (DIGIT_COUNT - 1)];
+            }
+        });
+
+        size_t offset = 0;
+        bool single_digit = false;
+        for (size_t digit = 0; digit < DIGIT_COUNT; ++digit) {
+            size_t digit_total = 0;
+            for (size_t part = 0; part < thread_count; ++part) {
+                const size_t count = histograms[part][digit];
+                histograms[part][digit] = offset + digit_total;
+                digit_total += count;
+            }
+            single_digit = single_digit || digit_total == items.size();
+            offset += digit_total;
+        }
+
+        if (single_digit) {
+            continue;
+        }
+
+        run_parts([&](size_t part) {
+            vector<size_t>& positions = histograms[part];
+            const size_t end = min(items.size(), (part + 1) * part_size);
+            for (size_t i = part * part_size; i < end; ++i) {
+                buffer[positions[(items[i].first >> shift) & (DIGIT_COUNT - 1)]++] = items[i];
+            }
+        });
+        items.swap(buffer);
+    }
+}
+
+// Выполняет task(i) для всех i из [0, count), раздавая индексы потокам по одному
+template <typename Task>
+void ParallelFor(size_t count, Task task) {
+    const size_t thread_count = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), count));
+    atomic<size_t> next_index = 0;
+    const auto worker = [&] {
+        for (size_t i = next_index++; i < count; i = next_index++) {
+            task(i);
+        }
+    };
+
+    vector<future<void>> futures;
+    for (size_t thread_index = 1; thread_index < thread_count; ++thread_index) {
+        futures.push_back(async(launch::async, worker));
+    }
+    worker();
+    for (future<void>& f : futures) {
+        f.get();
+    }
+}
+
+// Ядра добавления блока posting-ов к плотному массиву оценок: scores[id] += tf * idf.
+// Внутри одного posting-листа id различны, поэтому векторная запись по ним не конфликтует.
+// Умножение и сложение раздельные, без FMA, чтобы все варианты давали одинаковые суммы
+using AccumulateScoresKernel = void (*)(double* scores, const int* document_ids, const double* term_freqs, size_t count,
+                                        double inverse_document_freq);
+
+void AccumulateScoresScalar(double* scores, const int* document_ids, const double* term_freqs, size_t count,
+                            double inverse_document_freq) {
+    for (size_t i = 0; i < count; ++i) {
+        scores[document_ids[i]] += term_freqs[i] * inverse_document_freq;
+    }
+}
+
+#if defined(__x86_64__)
+// В AVX2 есть сбор, но нет разброса, поэтому результаты записываются по одному
+__attribute__((target("avx2")))
+void AccumulateScoresAvx2(double* scores, const int* document_ids, const double* term_freqs, size_t count,
+                          double inverse_document_freq) {
+    const __m256d idf = _mm256_set1_pd(inverse_document_freq);
+    const __m256d all_lanes = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i ids = _mm_loadu_si128(reinterpret_cast<const __m128i*>(document_ids + i));
+        const __m256d current = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), scores, ids, all_lanes, sizeof(double));
+        const __m256d updated = _mm256_add_pd(current, _mm256_mul_pd(_mm256_loadu_pd(term_freqs + i), idf));
+
+        alignas(32) double values[4];
+        _mm256_store_pd(values, updated);
+        for (size_t lane = 0; lane < 4; ++lane) {
+            scores[document_ids[i + lane]] = values[lane];
+        }
+    }
+
+    AccumulateScoresScalar(scores, document_ids + i, term_freqs + i, count - i, inverse_document_freq);
+}
+
+__attribute__((target("avx512f")))
+void AccumulateScoresAvx512(double* scores, const int* document_ids, const double* term_freqs, size_t count,
+                            double inverse_document_freq) {
+    const __m512d idf = _mm512_set1_pd(inverse_document_freq);
+    // Хвост блока обрабатывается той же последовательностью команд под маской
+    for (size_t i = 0; i < count; i += 8) {
+        const __mmask8 mask = count - i >= 8 ? 0xFF : static_cast<__mmask8>((1u << (count - i)) - 1);
+        const __m256i ids = _mm512_maskz_extracti64x4_epi64(0x0F, _mm512_maskz_loadu_epi32(mask, document_ids + i), 0);
+        const __m512d current = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, ids, scores, sizeof(double));
+        // Явное округление не даёт компилятору слить умножение со сложением в FMA
+        const __m512d product = _mm512_maskz_mul_round_pd(mask, _mm512_maskz_loadu_pd(mask, term_freqs + i), idf,
+                                                          _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        const __m512d updated = _mm512_maskz_add_round_pd(mask, current, product, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm512_mask_i32scatter_pd(scores, mask, ids, updated, sizeof(double));
+    }
+}
+#endif
+
+// Время ядра на posting на синтетическом posting-листе: 4096 возрастающих id с шагом
+// от 1 до 32 в массив из 64К оценок, лучший из нескольких прогонов
+double MeasureAccumulateScoresKernel(AccumulateScoresKernel kernel) {
+    constexpr size_t POSTING_COUNT = 4096;
+    constexpr int RUN_COUNT = 16;
+
+    vector<double> scores(POSTING_COUNT * 16, 0.0);
+    vector<int> document_ids(POSTING_COUNT);
+    vector<double> term_freqs(POSTING_COUNT);
+    uint32_t state = 12345;
+    int document_id = 0;
+    for (size_t i = 0; i < POSTING_COUNT; ++i) {
+        state = state * 1103515245 + 12345;
+        document_id += 1 + (state >> 16) % 32;
+        document_ids[i] = min<int>(document_id, scores.size() - POSTING_COUNT + i);
+        term_freqs[i] = 1.0 / (1 + i % 7);
+    }
+
+    double best = numeric_limits<double>::infinity();
+    for (int run = 0; run < RUN_COUNT; ++run) {
+        const auto start = chrono::steady_clock::now();
+        for (size_t offset = 0; offset < POSTING_COUNT; offset += POSTING_BLOCK_SIZE) {
+            kernel(scores.data(), document_ids.data() + offset, term_freqs.data() + offset, POSTING_BLOCK_SIZE, 0.5);
+        }
+        const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count() / POSTING_COUNT);
+    }
+
+    return best;
+}
+
+// Вариант ядра выбирается один раз, при первом вызове, замером: векторный вариант берётся,
+// только если он хотя бы на 10% быстрее скалярного. Сбор по разреженным id на части
+// процессоров медленнее обычного цикла, и одного флага возможностей для выбора мало
+AccumulateScoresKernel GetAccumulateScoresKernel() {
+    static const AccumulateScoresKernel kernel = []() -> AccumulateScoresKernel {
+        AccumulateScoresKernel best_kernel = AccumulateScoresScalar;
+#if defined(__x86_64__)
+        double best_time = MeasureAccumulateScoresKernel(AccumulateScoresScalar) * 0.9;
+        vector<AccumulateScoresKernel> candidates;
+        if (__builtin_cpu_supports("avx512f")) {
+            candidates.push_back(AccumulateScoresAvx512);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            candidates.push_back(AccumulateScoresAvx2);
+        }
+        for (const AccumulateScoresKernel candidate : candidates) {
+            if (const double time = MeasureAccumulateScoresKernel(candidate); time < best_time) {
+                best_kernel = candidate;
+                best_time = time;
+            }
+        }
+#endif
+        return best_kernel;
+    }();
+
+    return kernel;
+}
+
+struct Document {
+    Document(): id(0), relevance(0.0), rating(0) { }
+
+    Document(int doc_id, double doc_relevance, int doc_raiting): id(doc_id), relevance(doc_relevance), rating(doc_raiting) { }
+
+    int id;
+    double relevance;
+    int rating;
+};
+
+// Релевантность квантуется корзинами шириной DELTA вместо сравнения с допуском
+double GetRelevanceBucket(double relevance) {
+    return max(0.0, floor(relevance / DELTA));
+}
+
+// Старшие 32 бита — корзина релевантности, младшие — рейтинг; оба инвертированы,
+// чтобы сортировка по возрастанию ключа давала убывание релевантности и рейтинга.
+// Корзины от UINT32_MAX (релевантность от ~4295) сливаются в одну с нулевыми старшими битами
+uint64_t ComputeRelevanceSortKey(const Document& document) {
+    const uint64_t relevance_bucket = min<double>(GetRelevanceBucket(document.relevance), UINT32_MAX);
+    const uint32_t ordered_rating = static_cast<uint32_t>(document.rating) ^ 0x80000000u;
+
+    return (uint64_t(UINT32_MAX - relevance_bucket) << 32) | (UINT32_MAX - ordered_rating);
+}
+
+// Индексы документов по убыванию корзины релевантности, затем рейтинга; равные — в исходном порядке.
+// Документы из слитой верхней корзины досортировываются сравнением
+vector<uint32_t> OrderByRelevance(const vector<Document>& documents) {
+    vector<pair<uint64_t, uint32_t>> keys;
+    keys.reserve(documents.size());
+    for (uint32_t i = 0; i < documents.size(); ++i) {
+        keys.emplace_back(ComputeRelevanceSortKey(documents[i]), i);
+    }
+
+    ParallelRadixSort(keys);
+
+    const auto clamped_end = find_if(keys.begin(), keys.end(), [](const pair<uint64_t, uint32_t>& key) {
+        return key.first >> 32 != 0;
+    });
+    stable_sort(keys.begin(), clamped_end, [&documents](const pair<uint64_t, uint32_t>& lhs, const pair<uint64_t, uint32_t>& rhs) {
+        const double lhs_bucket = GetRelevanceBucket(documents[lhs.second].relevance);
+        const double rhs_bucket = GetRelevanceBucket(documents[rhs.second].relevance);
+        if (lhs_bucket != rhs_bucket) {
+            return lhs_bucket > rhs_bucket;
+        }
+        return lhs.first < rhs.first;
+    });
+
+    vector<uint32_t> order;
+    order.reserve(keys.size());
+    for (const auto& [_, index] : keys) {
+        order.push_back(index);
+    }
+    return order;
+}
+
+enum class SortMode {
+    RELEVANCE,
+    RATING,
+    ID,
+};
+
+// Затухание релевантности с возрастом документа: вес half_life / (half_life + возраст)
+// вдвое меньше у документа возраста half_life. now и half_life в тех же единицах,
+// что и метки времени документов; half_life должен быть положительным
+struct FreshnessDecay {
+    int64_t now = 0;
+    int64_t half_life = 1;
+
+    double GetWeight(int64_t timestamp) const {
+        return half_life / (half_life + max<double>(0.0, now - timestamp));
+    }
+};
+
+struct PruningPolicy {
+    double min_contribution = 0.0;
+    size_t max_postings_per_word = 0;
+};
+
+struct PruningReport {
+    size_t words_before = 0;
+    size_t postings_before = 0;
+    size_t bytes_before = 0;
+    size_t words_after = 0;
+    size_t postings_after = 0;
+    size_t bytes_after = 0;
+    double average_overlap = 1.0;
+};
+
+struct StopWordPolicy {
+    double max_document_ratio = 1.0;
+    double min_inverse_document_freq = 0.0;
+    bool keep_cold_postings = false;
+};
+
+enum class DocumentStatus {
+    ACTUAL,
+    IRRELEVANT,
+    BANNED,
+    REMOVED,
+};
+
+// Формат индекса, который отображается в память только для чтения:
+// все ссылки внутри файла — смещения от его начала, поэтому файл можно
+// положить в /dev/shm и подключать из нескольких процессов по разным адресам
+struct MappedIndexHeader {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t document_count;
+    uint64_t word_count;
+    uint64_t stop_word_count;
+    uint64_t documents_offset;
+    uint64_t words_offset;
+    uint64_t stop_words_offset;
+    uint64_t postings_offset;
+    uint64_t posting_count;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct MappedString {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct MappedDocument {
+    int32_t id;
+    int32_t rating;
+    int32_t status;
+    int32_t reserved;
+};
+
+struct MappedWord {
+    MappedString text;
+    uint64_t postings_begin;
+    uint64_t postings_count;
+    uint64_t document_count;
+};
+
+struct MappedPosting {
+    uint32_t document_index;
+    uint32_t reserved;
+    double term_freq;
+};
+
+inline constexpr char MAPPED_INDEX_MAGIC[8] = {'S', 'S', 'I', 'N', 'D', 'E', 'X', '1'};
+
+enum class HugePageMode {
+    DISABLED,
+    TRANSPARENT,
+    EXPLICIT,
+};
+
+struct HugePageStats {
+    size_t huge_page_chunks = 0;
+    size_t explicit_fallbacks = 0;
+    size_t pooled_bytes = 0;
+    size_t large_bytes = 0;
+};
+
+// Пул памяти на страницах по 2 МБ для узлов posting-листов и таблицы документов.
+// Posting-листы остаются красно-чёрными деревьями, так что обход по-прежнему идёт по
+// указателям; пул лишь собирает узлы в меньшее число страниц и записей TLB. Сплошные
+// массивы на этих страницах — только плотные массивы оценок запросов.
+// Блоки до 1 МБ нарезаются из общих 2 МБ кусков и переиспользуются через списки
+// свободных блоков, более крупные получают отдельный регион. Куски не возвращаются
+// системе: pooled_bytes в статистике — наибольший объём, нарезанный за время работы.
+// У каждого потока свой кэш свободных блоков, общий мьютекс берётся только при пополнении
+// и сбросе кэша пачкой. Режим влияет лишь на новые выделения: при освобождении путь
+// выбирается по адресу блока, поэтому смена режима не ломает уже выделенное
+class HugePageArena {
+public:
+    static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+    static HugePageArena& Instance() {
+        static HugePageArena arena;
+        return arena;
+    }
+
+    void SetMode(HugePageMode mode) {
+        mode_.store(mode, memory_order_relaxed);
+    }
+
+    HugePageMode GetMode() const {
+        return mode_.load(memory_order_relaxed);
+    }
+
+    HugePageStats GetStats() const {
+        lock_guard lock(mutex_);
+        return stats_;
+    }
+
+    void* Allocate(size_t bytes) {
+        const HugePageMode mode = GetMode();
+        if (mode == HugePageMode::DISABLED) {
+            return ::operator new(bytes);
+        }
+
+        if (bytes > MAX_POOLED_SIZE) {
+            const size_t region_size = RoundUpToHugePage(bytes);
+            lock_guard lock(mutex_);
+            stats_.large_bytes += region_size;
+            return MapHugePages(region_size, mode);
+        }
+
+        const size_t size_class = GetSizeClass(bytes);
+        ThreadCache* cache = GetThreadCache();
+        if (cache == nullptr) {
+            lock_guard lock(mutex_);
+            return TakeBlock(size_class, mode);
+        }
+
+        if (cache->free_lists[size_class] == nullptr) {
+            RefillThreadCache(*cache, size_class, mode);
+        }
+
+        FreeBlock* block = cache->free_lists[size_class];
+        cache->free_lists[size_class] = block->next;
+        --cache->counts[size_class];
+        return block;
+    }
+
+    void Deallocate(void* pointer, size_t bytes) {
+        if (!IsArenaPointer(pointer)) {
+            ::operator delete(pointer);
+            return;
+        }
+
+        if (bytes > MAX_POOLED_SIZE) {
+            const size_t region_size = RoundUpToHugePage(bytes);
+            lock_guard lock(mutex_);
+            stats_.large_bytes -= region_size;
+            // Снимаем отметку до munmap: освободившиеся адреса может занять обычный operator new
+            MarkRegion(pointer, region_size, false);
+            munmap(pointer, region_size);
+            return;
+        }
+
+        const size_t size_class = GetSizeClass(bytes);
+        FreeBlock* block = static_cast<FreeBlock*>(pointer);
+        ThreadCache* cache = GetThreadCache();
+        if (cache == nullptr) {
+            lock_guard lock(mutex_);
+            block->next = free_lists_[size_class];
+            free_lists_[size_class] = block;
+            return;
+        }
+
+        block->next = cache->free_lists[size_class];
+        cache->free_lists[size_class] = block;
+        if (++cache->counts[size_class] > GetCacheLimit(size_class)) {
+            FlushThreadCache(*cache, size_class, GetCacheLimit(size_class) / 2);
+        }
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static constexpr size_t SIZE_CLASS_STEP = 16;
+    static constexpr size_t MAX_SMALL_SIZE = 256;
+    static constexpr size_t MAX_POOLED_SIZE = HUGE_PAGE_SIZE / 2;
+    // Мелкие классы идут с шагом 16 байт, дальше — степени двойки от 512 байт до 1 МБ
+    static constexpr size_t SIZE_CLASS_COUNT = MAX_SMALL_SIZE / SIZE_CLASS_STEP + 12;
+    static constexpr size_t THREAD_CACHE_BYTES = 64 << 10;
+    // Отметки 2 МБ регионов пула: 2^13 листов по 2^13 бит покрывают 47-битное адресное пространство
+    static constexpr size_t REGION_MAP_BITS = 13;
+    static constexpr size_t REGION_MAP_SIZE = size_t{1} << REGION_MAP_BITS;
+
+    struct ThreadCache {
+        FreeBlock* free_lists[SIZE_CLASS_COUNT] = {};
+        size_t counts[SIZE_CLASS_COUNT] = {};
+
+        ~ThreadCache() {
+            HugePageArena& arena = Instance();
+            for (size_t size_class = 0; size_class < SIZE_CLASS_COUNT; ++size_class) {
+                arena.FlushThreadCache(*this, size_class, 0);
+            }
+            thread_cache_released_ = true;
+        }
+    };
+
+    inline static thread_local bool thread_cache_released_ = false;
+
+    using RegionMapLeaf = array<atomic<uint64_t>, REGION_MAP_SIZE / 64>;
+
+    mutable mutex mutex_;
+    atomic<HugePageMode> mode_ = HugePageMode::DISABLED;
+    FreeBlock* free_lists_[SIZE_CLASS_COUNT] = {};
+    char* chunk_ = nullptr;
+    size_t chunk_remaining_ = 0;
+    HugePageStats stats_;
+    array<atomic<RegionMapLeaf*>, REGION_MAP_SIZE> region_map_ = {};
+
+    HugePageArena() = default;
+
+    // Деструкторы других thread_local могут освобождать память уже после кэша потока,
+    // тогда блоки идут напрямую в общий список
+    static ThreadCache* GetThreadCache() {
+        if (thread_cache_released_) {
+            return nullptr;
+        }
+        thread_local ThreadCache cache;
+        return &cache;
+    }
+
+    static size_t GetSizeClass(size_t bytes) {
+        if (bytes <= MAX_SMALL_SIZE) {
+            return (max<size_t>(bytes, sizeof(FreeBlock)) - 1) / SIZE_CLASS_STEP;
+        }
+
+        size_t size_class = MAX_SMALL_SIZE / SIZE_CLASS_STEP;
+        for (size_t block_size = MAX_SMALL_SIZE * 2; block_size < bytes; block_size *= 2) {
+            ++size_class;
+        }
+
+        return size_class;
+    }
+
+    static size_t GetBlockSize(size_t size_class) {
+        if (size_class < MAX_SMALL_SIZE / SIZE_CLASS_STEP) {
+            return (size_class + 1) * SIZE_CLASS_STEP;
+        }
+
+        return MAX_SMALL_SIZE * 2 << (size_class - MAX_SMALL_SIZE / SIZE_CLASS_STEP);
+    }
+
+    static size_t GetCacheLimit(size_t size_class) {
+        return max<size_t>(2, THREAD_CACHE_BYTES / GetBlockSize(size_class));
+    }
+
+    static size_t RoundUpToHugePage(size_t bytes) {
+        return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    // Вызывается под mutex_
+    FreeBlock* TakeBlock(size_t size_class, HugePageMode mode) {
+        if (FreeBlock* block = free_lists_[size_class]) {
+            free_lists_[size_class] = block->next;
+            return block;
+        }
+
+        const size_t block_size = GetBlockSize(size_class);
+        if (chunk_remaining_ < block_size) {
+            chunk_ = static_cast<char*>(MapHugePages(HUGE_PAGE_SIZE, mode));
+            chunk_remaining_ = HUGE_PAGE_SIZE;
+            ++stats_.huge_page_chunks;
+        }
+
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk_);
+        chunk_ += block_size;
+        chunk_remaining_ -= block_size;
+        stats_.pooled_bytes += block_size;
+        return block;
+    }
+
+    // Берёт из общего списка (или нарезает из куска) половину лимита кэша
+    void RefillThreadCache(ThreadCache& cache, size_t size_class, HugePageMode mode) {
+        const size_t batch_size = GetCacheLimit(size_class) / 2;
+
+        lock_guard lock(mutex_);
+        for (size_t i = 0; i < batch_size; ++i) {
+            FreeBlock* block = TakeBlock(size_class, mode);
+            block->next = cache.free_lists[size_class];
+            cache.free_lists[size_class] = block;
+            ++cache.counts[size_class];
+        }
+    }
+
+    // Возвращает в общий список всё сверх keep блоков
+    void FlushThreadCache(ThreadCache& cache, size_t size_class, size_t keep) {
+        if (cache.counts[size_class] <= keep) {
+            return;
+        }
+
+        lock_guard lock(mutex_);
+        while (cache.counts[size_class] > keep) {
+            FreeBlock* block = cache.free_lists[size_class];
+            cache.free_lists[size_class] = block->next;
+            --cache.counts[size_class];
+            block->next = free_lists_[size_class];
+            free_lists_[size_class] = block;
+        }
+    }
+
+    bool IsArenaPointer(const void* pointer) const {
+        const uintptr_t region = reinterpret_cast<uintptr_t>(pointer) / HUGE_PAGE_SIZE;
+        if (region >= REGION_MAP_SIZE * REGION_MAP_SIZE) {
+            return false;
+        }
+
+        const RegionMapLeaf* leaf = region_map_[region >> REGION_MAP_BITS].load(memory_order_acquire);
+        const size_t bit = region & (REGION_MAP_SIZE - 1);
+        return leaf != nullptr && ((*leaf)[bit / 64].load(memory_order_relaxed) >> (bit % 64) & 1) != 0;
+    }
+
+    // Вызывается под mutex_
+    void MarkRegion(const void* begin, size_t size, bool marked) {
+        const uintptr_t first = reinterpret_cast<uintptr_t>(begin) / HUGE_PAGE_SIZE;
+        for (uintptr_t region = first; region < first + size / HUGE_PAGE_SIZE; ++region) {
+            atomic<RegionMapLeaf*>& slot = region_map_[region >> REGION_MAP_BITS];
+            RegionMapLeaf* leaf = slot.load(memory_order_relaxed);
+            if (leaf == nullptr) {
+                leaf = new RegionMapLeaf();
+                slot.store(leaf, memory_order_release);
+            }
+
+            const size_t bit = region & (REGION_MAP_SIZE - 1);
+            if (marked) {
+                (*leaf)[bit / 64].fetch_or(uint64_t{1} << (bit % 64), memory_order_relaxed);
+            } else {
+                (*leaf)[bit / 64].fetch_and(~(uint64_t{1} << (bit % 64)), memory_order_relaxed);
+            }
+        }
+    }
+
+    // Явные страницы hugetlbfs берутся, если они зарезервированы в системе,
+    // иначе регион выравнивается на 2 МБ и помечается для transparent huge pages.
+    // Вызывается под mutex_
+    void* MapHugePages(size_t size, HugePageMode mode) {
+        if (mode == HugePageMode::EXPLICIT) {
+            void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (region != MAP_FAILED) {
+                MarkRegion(region, size, true);
+                return region;
+            }
+            ++stats_.explicit_fallbacks;
+        }
+
+        void* region = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            throw bad_alloc();
+        }
+
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(region);
+        const uintptr_t aligned = (begin + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (aligned > begin) {
+            munmap(region, aligned - begin);
+        }
+        munmap(reinterpret_cast<void*>(aligned + size), begin + HUGE_PAGE_SIZE - aligned);
+
+        madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+        MarkRegion(reinterpret_cast<void*>(aligned), size, true);
+        return reinterpret_cast<void*>(aligned);
+    }
+};
+
+template <typename T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    HugePageAllocator() = default;
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) { }
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(HugePageArena::Instance().Allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        HugePageArena::Instance().Deallocate(pointer, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U>&) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const HugePageAllocator<U>&) const {
+        return false;
+    }
+};
+
+// use_count() читается без синхронизации. Если владелец остался один, забор acquire
+// парный освобождению копии в другом потоке: все чтения снимка через эту копию
+// завершились до того, как мы начнём менять данные на месте
+template <typename T>
+bool IsSoleOwner(const shared_ptr<T>& pointer) {
+    if (pointer.use_count() != 1) {
+        return false;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    return true;
+}
+
+// Словарь с копированием при записи для снимков индекса. Ключи разложены по шардам,
+// значения лежат в отдельных shared_ptr: копия словаря копирует только указатели
+// на шарды, а первая запись после копирования клонирует шард и изменяемое значение.
+// Порядок обхода — по шардам, внутри шарда по возрастанию ключа. Таблица шардов
+// создаётся при первой записи, чтобы пустой словарь занимал несколько байт
+template <typename Key, typename Value>
+class CowMap {
+    static constexpr size_t SHARD_COUNT = 256;
+
+    using Shard = map<Key, shared_ptr<Value>>;
+    using Shards = array<shared_ptr<Shard>, SHARD_COUNT>;
+
+public:
+    CowMap() = default;
+
+    CowMap(const CowMap& other)
+        : shards_(other.shards_ ? make_unique<Shards>(*other.shards_) : nullptr)
+        , size_(other.size_) {
+    }
+
+    CowMap(CowMap&& other) noexcept
+        : shards_(move(other.shards_))
+        , size_(exchange(other.size_, 0)) {
+    }
+
+    CowMap& operator=(const CowMap& other) {
+        if (this != &other) {
+            shards_ = other.shards_ ? make_unique<Shards>(*other.shards_) : nullptr;
+            size_ = other.size_;
+        }
+        return *this;
+    }
+
+    CowMap& operator=(CowMap&& other) noexcept {
+        shards_ = move(other.shards_);
+        size_ = exchange(other.size_, 0);
+        return *this;
+    }
+
+    class Iterator {
+    public:
+        Iterator(const CowMap* owner, size_t shard_index)
+            : owner_(owner)
+            , shard_index_(shard_index) {
+            SkipEmptyShards();
+        }
+
+        pair<const Key&, const Value&> operator*() const {
+            return {it_->first, *it_->second};
+        }
+
+        Iterator& operator++() {
+            ++it_;
+            if (it_ == owner_->GetShard(shard_index_)->end()) {
+                ++shard_index_;
+                SkipEmptyShards();
+            }
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return shard_index_ == other.shard_index_ && (shard_index_ == SHARD_COUNT || it_ == other.it_);
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        const CowMap* owner_;
+        size_t shard_index_;
+        typename Shard::const_iterator it_;
+
+        void SkipEmptyShards() {
+            for (; shard_index_ < SHARD_COUNT; ++shard_index_) {
+                if (const Shard* shard = owner_->GetShard(shard_index_); shard != nullptr && !shard->empty()) {
+                    it_ = shard->begin();
+                    return;
+                }
+            }
+        }
+    };
+
+    Iterator begin() const {
+        return Iterator(this, 0);
+    }
+
+    Iterator end() const {
+        return Iterator(this, SHARD_COUNT);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t count(const Key& key) const {
+        return Find(key) == nullptr ? 0 : 1;
+    }
+
+    const Value* Find(const Key& key) const {
+        const Shard* shard = GetShard(GetShardIndex(key));
+        if (shard == nullptr) {
+            return nullptr;
+        }
+
+        const auto it = shard->find(key);
+        return it == shard->end() ? nullptr : it->second.get();
+    }
+
+    const Value& At(const Key& key) const {
+        const Value* value = Find(key);
+        if (value == nullptr) {
+            throw out_of_range("CowMap::At"s);
+        }
+
+        return *value;
+    }
+
+    Value* FindMutable(const Key& key) {
+        const size_t shard_index = GetShardIndex(key);
+        if (const Shard* shard = GetShard(shard_index); shard == nullptr || shard->count(key) == 0) {
+            return nullptr;
+        }
+
+        return &GetMutableValue(GetMutableShard(shard_index).find(key)->second);
+    }
+
+    Value& operator[](const Key& key) {
+        Shard& shard = GetMutableShard(GetShardIndex(key));
+        auto [it, inserted] = shard.try_emplace(key);
+        if (inserted) {
+            it->second = allocate_shared<Value>(HugePageAllocator<Value>());
+            ++size_;
+            return *it->second;
+        }
+
+        return GetMutableValue(it->second);
+    }
+
+    bool Emplace(const Key& key, Value value) {
+        Shard& shard = GetMutableShard(GetShardIndex(key));
+        if (shard.count(key) > 0) {
+            return false;
+        }
+
+        shard.emplace(key, allocate_shared<Value>(HugePageAllocator<Value>(), move(value)));
+        ++size_;
+        return true;
+    }
+
+    bool Erase(const Key& key) {
+        const size_t shard_index = GetShardIndex(key);
+        if (const Shard* shard = GetShard(shard_index); shard == nullptr || shard->count(key) == 0) {
+            return false;
+        }
+
+        GetMutableShard(shard_index).erase(key);
+        --size_;
+        return true;
+    }
+
+    void Clear() {
+        shards_.reset();
+        size_ = 0;
+    }
+
+private:
+    unique_ptr<Shards> shards_;
+    size_t size_ = 0;
+
+    const Shard* GetShard(size_t shard_index) const {
+        return shards_ ? (*shards_)[shard_index].get() : nullptr;
+    }
+
+    static size_t GetShardIndex(const Key& key) {
+        return hash<Key>()(key) % SHARD_COUNT;
+    }
+
+    Shard& GetMutableShard(size_t shard_index) {
+        if (!shards_) {
+            shards_ = make_unique<Shards>();
+        }
+
+        shared_ptr<Shard>& shard = (*shards_)[shard_index];
+        if (!shard) {
+            shard = make_shared<Shard>();
+        } else if (!IsSoleOwner(shard)) {
+            shard = make_shared<Shard>(*shard);
+        }
+
+        return *shard;
+    }
+
+    static Value& GetMutableValue(shared_ptr<Value>& value) {
+        if (!IsSoleOwner(value)) {
+            value = allocate_shared<Value>(HugePageAllocator<Value>(), *value);
+        }
+
+        return *value;
+    }
+};
+
+// Узлы дерева берутся из пула HugePageArena: меньше промахов TLB, но не меньше переходов по указателям
+using DocumentFreqs = map<int, double, less<int>, HugePageAllocator<pair<const int, double>>>;
+
+using TermId = uint32_t;
+
+// Упорядоченный индекс слов: адаптивное префиксное дерево (ART) со сжатием путей.
+// Узлы бывают на 4, 16, 48 и 256 потомков и растут по мере заполнения. Лист — это
+// номер слова прямо в указателе на потомка с единичным младшим битом, текст слова
+// дерево берёт у владельца ключей; строки должны жить не меньше дерева, потому что
+// сжатые префиксы узлов ссылаются на них. Слово, закончившееся внутри узла,
+// хранится в его поле end и при обходе идёт раньше потомков
+class TermTree {
+public:
+    using KeyLoader = function<string_view(TermId)>;
+
+    explicit TermTree(KeyLoader load_key)
+        : load_key_(move(load_key)) {
+    }
+
+    TermTree(const TermTree&) = delete;
+    TermTree& operator=(const TermTree&) = delete;
+
+    ~TermTree() {
+        Free(root_);
+    }
+
+    // Возвращает false, если слово с таким текстом уже есть
+    bool Insert(TermId term) {
+        const string_view key = load_key_(term);
+        const uintptr_t leaf = MakeLeaf(term);
+        uintptr_t* reference = &root_;
+        size_t depth = 0;
+        while (true) {
+            if (*reference == 0) {
+                *reference = leaf;
+                ++size_;
+                return true;
+            }
+
+            if (IsLeaf(*reference)) {
+                const string_view other_key = load_key_(GetLeafTerm(*reference));
+                if (other_key == key) {
+                    return false;
+                }
+
+                const size_t common = GetCommonPrefixSize(key.substr(depth), other_key.substr(depth));
+                Node4* node = Allocate<Node4>();
+                node->prefix = key.substr(depth, common);
+                Attach(node, other_key, depth + common, *reference);
+                Attach(node, key, depth + common, leaf);
+                *reference = reinterpret_cast<uintptr_t>(node);
+                ++size_;
+                return true;
+            }
+
+            Node* node = reinterpret_cast<Node*>(*reference);
+            const size_t common = GetCommonPrefixSize(node->prefix, key.substr(depth));
+            if (common < node->prefix.size()) {
+                // Ключ расходится со сжатым путём: путь делится новым узлом
+                Node4* parent = Allocate<Node4>();
+                parent->prefix = node->prefix.substr(0, common);
+                const uint8_t node_byte = node->prefix[common];
+                node->prefix.remove_prefix(common + 1);
+                AddChild(parent, node_byte, *reference);
+                Attach(parent, key, depth + common, leaf);
+                *reference = reinterpret_cast<uintptr_t>(parent);
+                ++size_;
+                return true;
+            }
+
+            depth += common;
+            if (depth == key.size()) {
+                if (node->end != 0) {
+                    return false;
+                }
+                node->end = leaf;
+                ++size_;
+                return true;
+            }
+
+            const uint8_t byte = key[depth];
+            uintptr_t* child = FindChild(node, byte);
+            if (child == nullptr) {
+                AddChild(reference, byte, leaf);
+                ++size_;
+                return true;
+            }
+            reference = child;
+            ++depth;
+        }
+    }
+
+    optional<TermId> Find(string_view key) const {
+        uintptr_t reference = root_;
+        size_t depth = 0;
+        while (reference != 0) {
+            if (IsLeaf(reference)) {
+                const TermId term = GetLeafTerm(reference);
+                if (load_key_(term) == key) {
+                    return term;
+                }
+                return nullopt;
+            }
+
+            const Node* node = reinterpret_cast<const Node*>(reference);
+            if (key.substr(depth, node->prefix.size()) != node->prefix) {
+                return nullopt;
+            }
+            depth += node->prefix.size();
+            if (depth == key.size()) {
+                return node->end != 0 ? optional<TermId>(GetLeafTerm(node->end)) : nullopt;
+            }
+
+            const uintptr_t* child = FindChild(node, static_cast<uint8_t>(key[depth]));
+            reference = child != nullptr ? *child : 0;
+            ++depth;
+        }
+
+        return nullopt;
+    }
+
+    // Обходит слова с данным префиксом по возрастанию текста; обход прекращается,
+    // когда callback возвращает false
+    template <typename Callback>
+    bool ForEachWithPrefix(string_view prefix, Callback callback) const {
+        uintptr_t reference = root_;
+        size_t depth = 0;
+        while (reference != 0) {
+            if (IsLeaf(reference)) {
+                if (load_key_(GetLeafTerm(reference)).substr(0, prefix.size()) != prefix) {
+                    return true;
+                }
+                return callback(GetLeafTerm(reference));
+            }
+
+            const Node* node = reinterpret_cast<const Node*>(reference);
+            const string_view rest = prefix.substr(depth);
+            if (rest.size() <= node->prefix.size()) {
+                if (node->prefix.substr(0, rest.size()) != rest) {
+                    return true;
+                }
+                return ForEachInSubtree(reference, callback);
+            }
+            if (rest.substr(0, node->prefix.size()) != node->prefix) {
+                return true;
+            }
+
+            depth += node->prefix.size();
+            const uintptr_t* child = FindChild(node, static_cast<uint8_t>(prefix[depth]));
+            reference = child != nullptr ? *child : 0;
+            ++depth;
+        }
+
+        return true;
+    }
+
+    template <typename Callback>
+    bool ForEach(Callback callback) const {
+        return ForEachInSubtree(root_, callback);
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    // Память под узлы; листья места не занимают
+    size_t GetMemoryUsage() const {
+        return memory_usage_;
+    }
+
+private:
+    enum class NodeType : uint8_t {
+        NODE4,
+        NODE16,
+        NODE48,
+        NODE256,
+    };
+
+    struct Node {
+        explicit Node(NodeType node_type)
+            : type(node_type) {
+        }
+
+        NodeType type;
+        uint16_t child_count = 0;
+        string_view prefix;
+        uintptr_t end = 0;
+    };
+
+    // В узлах на 4 и 16 потомков байты ключей отсортированы
+    struct Node4 : Node {
+        static constexpr NodeType TYPE = NodeType::NODE4;
+        static constexpr size_t CAPACITY = 4;
+
+        Node4()
+            : Node(TYPE) {
+        }
+
+        array<uint8_t, CAPACITY> keys = {};
+        array<uintptr_t, CAPACITY> children = {};
+    };
+
+    struct Node16 : Node {
+        static constexpr NodeType TYPE = NodeType::NODE16;
+        static constexpr size_t CAPACITY = 16;
+
+        Node16()
+            : Node(TYPE) {
+        }
+
+        array<uint8_t, CAPACITY> keys = {};
+        array<uintptr_t, CAPACITY> children = {};
+    };
+
+    // Байт ключа указывает на позицию потомка плюс один; ноль — потомка нет
+    struct Node48 : Node {
+        static constexpr NodeType TYPE = NodeType::NODE48;
+        static constexpr size_t CAPACITY = 48;
+
+        Node48()
+            : Node(TYPE) {
+        }
+
+        array<uint8_t, 256> indexes = {};
+        array<uintptr_t, CAPACITY> children = {};
+    };
+
+    struct Node256 : Node {
+        static constexpr NodeType TYPE = NodeType::NODE256;
+        static constexpr size_t CAPACITY = 256;
+
+        Node256()
+            : Node(TYPE) {
+        }
+
+        array<uintptr_t, CAPACITY> children = {};
+    };
+
+    KeyLoader load_key_;
+    uintptr_t root_ = 0;
+    size_t size_ = 0;
+    size_t memory_usage_ = 0;
+
+    static bool IsLeaf(uintptr_t reference) {
+        return (reference & 1) != 0;
+    }
+
+    static uintptr_t MakeLeaf(TermId term) {
+        return (static_cast<uintptr_t>(term) << 1) | 1;
+    }
+
+    static TermId GetLeafTerm(uintptr_t reference) {
+        return static_cast<TermId>(reference >> 1);
+    }
+
+    static size_t GetCommonPrefixSize(string_view lhs, string_view rhs) {
+        const size_t size = min(lhs.size(), rhs.size());
+        size_t common = 0;
+        while (common < size && lhs[common] == rhs[common]) {
+            ++common;
+        }
+        return common;
+    }
+
+    template <typename NodeT>
+    NodeT* Allocate() {
+        memory_usage_ += sizeof(NodeT);
+        return new NodeT();
+    }
+
+    template <typename NodeT>
+    void Deallocate(NodeT* node) {
+        memory_usage_ -= sizeof(NodeT);
+        delete node;
+    }
+
+    // Лист в узле, путь которого уже совпал с ключом на depth байт
+    void Attach(Node* node, string_view key, size_t depth, uintptr_t leaf) {
+        if (depth == key.size()) {
+            node->end = leaf;
+        } else {
+            AddChild(node, static_cast<uint8_t>(key[depth]), leaf);
+        }
+    }
+
+    static const uintptr_t* FindChild(const Node* node, uint8_t byte) {
+        switch (node->type) {
+        case NodeType::NODE4: {
+            const Node4* node4 = static_cast<const Node4*>(node);
+            for (size_t i = 0; i < node->child_count; ++i) {
+                if (node4->keys[i] == byte) {
+                    return &node4->children[i];
+                }
+            }
+            return nullptr;
+        }
+        case NodeType::NODE16: {
+            const Node16* node16 = static_cast<const Node16*>(node);
+#if defined(__x86_64__)
+            const __m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(byte)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(node16->keys.data())));
+            const unsigned mask = _mm_movemask_epi8(matches) & ((1u << node->child_count) - 1);
+            return mask != 0 ? &node16->children[__builtin_ctz(mask)] : nullptr;
+#else
+            for (size_t i = 0; i < node->child_count; ++i) {
+                if (node16->keys[i] == byte) {
+                    return &node16->children[i];
+                }
+            }
+            return nullptr;
+#endif
+        }
+        case NodeType::NODE48: {
+            const Node48* node48 = static_cast<const Node48*>(node);
+            const uint8_t index = node48->indexes[byte];
+            return index != 0 ? &node48->children[index - 1] : nullptr;
+        }
+        case NodeType::NODE256: {
+            const Node256* node256 = static_cast<const Node256*>(node);
+            return node256->children[byte] != 0 ? &node256->children[byte] : nullptr;
+        }
+        }
+        return nullptr;
+    }
+
+    static uintptr_t* FindChild(Node* node, uint8_t byte) {
+        return const_cast<uintptr_t*>(FindChild(static_cast<const Node*>(node), byte));
+    }
+
+    template <typename NodeT>
+    static void InsertSorted(NodeT* node, uint8_t byte, uintptr_t child) {
+        size_t position = 0;
+        while (position < node->child_count && node->keys[position] < byte) {
+            ++position;
+        }
+        for (size_t i = node->child_count; i > position; --i) {
+            node->keys[i] = node->keys[i - 1];
+            node->children[i] = node->children[i - 1];
+        }
+        node->keys[position] = byte;
+        node->children[position] = child;
+        ++node->child_count;
+    }
+
+    // Узел, в котором точно есть место
+    static void AddChild(Node* node, uint8_t byte, uintptr_t child) {
+        switch (node->type) {
+        case NodeType::NODE4:
+            InsertSorted(static_cast<Node4*>(node), byte, child);
+            break;
+        case NodeType::NODE16:
+            InsertSorted(static_cast<Node16*>(node), byte, child);
+            break;
+        case NodeType::NODE48: {
+            Node48* node48 = static_cast<Node48*>(node);
+            node48->children[node->child_count] = child;
+            node48->indexes[byte] = static_cast<uint8_t>(++node->child_count);
+            break;
+        }
+        case NodeType::NODE256:
+            static_cast<Node256*>(node)->children[byte] = child;
+            ++node->child_count;
+            break;
+        }
+    }
+
+    template <typename FromT, typename ToT>
+    ToT* Grow(FromT* node) {
+        ToT* grown = Allocate<ToT>();
+        grown->prefix = node->prefix;
+        grown->end = node->end;
+        ForEachChild(node, [grown](uint8_t byte, uintptr_t child) {
+            AddChild(grown, byte, child);
+            return true;
+        });
+        Deallocate(node);
+        return grown;
+    }
+
+    // Полный узел перед добавлением заменяется следующим по размеру
+    void AddChild(uintptr_t* reference, uint8_t byte, uintptr_t child) {
+        Node* node = reinterpret_cast<Node*>(*reference);
+        switch (node->type) {
+        case NodeType::NODE4:
+            if (node->child_count == Node4::CAPACITY) {
+                node = Grow<Node4, Node16>(static_cast<Node4*>(node));
+            }
+            break;
+        case NodeType::NODE16:
+            if (node->child_count == Node16::CAPACITY) {
+                node = Grow<Node16, Node48>(static_cast<Node16*>(node));
+            }
+            break;
+        case NodeType::NODE48:
+            if (node->child_count == Node48::CAPACITY) {
+                node = Grow<Node48, Node256>(static_cast<Node48*>(node));
+            }
+            break;
+        case NodeType::NODE256:
+            break;
+        }
+        AddChild(node, byte, child);
+        *reference = reinterpret_cast<uintptr_t>(node);
+    }
+
+    // Потомки узла по возрастанию байта
+    template <typename Callback>
+    static bool ForEachChild(const Node* node, Callback callback) {
+        switch (node->type) {
+        case NodeType::NODE4: {
+            const Node4* node4 = static_cast<const Node4*>(node);
+            for (size_t i = 0; i < node->child_count; ++i) {
+                if (!callback(node4->keys[i], node4->children[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case NodeType::NODE16: {
+            const Node16* node16 = static_cast<const Node16*>(node);
+            for (size_t i = 0; i < node->child_count; ++i) {
+                if (!callback(node16->keys[i], node16->children[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case NodeType::NODE48: {
+            const Node48* node48 = static_cast<const Node48*>(node);
+            for (size_t byte = 0; byte < node48->indexes.size(); ++byte) {
+                const uint8_t index = node48->indexes[byte];
+                if (index != 0 && !callback(static_cast<uint8_t>(byte), node48->children[index - 1])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case NodeType::NODE256: {
+            const Node256* node256 = static_cast<const Node256*>(node);
+            for (size_t byte = 0; byte < node256->children.size(); ++byte) {
+                const uintptr_t child = node256->children[byte];
+                if (child != 0 && !callback(static_cast<uint8_t>(byte), child)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        }
+        return true;
+    }
+
+    template <typename Callback>
+    static bool ForEachInSubtree(uintptr_t reference, Callback& callback) {
+        if (reference == 0) {
+            return true;
+        }
+        if (IsLeaf(reference)) {
+            return callback(GetLeafTerm(reference));
+        }
+
+        const Node* node = reinterpret_cast<const Node*>(reference);
+        if (node->end != 0 && !callback(GetLeafTerm(node->end))) {
+            return false;
+        }
+        return ForEachChild(node, [&callback](uint8_t, uintptr_t child) {
+            return ForEachInSubtree(child, callback);
+        });
+    }
+
+    void Free(uintptr_t reference) {
+        if (reference == 0 || IsLeaf(reference)) {
+            return;
+        }
+
+        Node* node = reinterpret_cast<Node*>(reference);
+        ForEachChild(node, [this](uint8_t, uintptr_t child) {
+            Free(child);
+            return true;
+        });
+        switch (node->type) {
+        case NodeType::NODE4:
+            Deallocate(static_cast<Node4*>(node));
+            break;
+        case NodeType::NODE16:
+            Deallocate(static_cast<Node16*>(node));
+            break;
+        case NodeType::NODE48:
+            Deallocate(static_cast<Node48*>(node));
+            break;
+        case NodeType::NODE256:
+            Deallocate(static_cast<Node256*>(node));
+            break;
+        }
+    }
+};
+
+// Словарь слов, который могут разделять много серверов одного процесса: каждое слово
+// хранится один раз в общем пуле строк и получает постоянный номер, а серверы держат
+// только номера. Слова только добавляются. Поиск идёт без блокировок по открытой
+// хеш-таблице в духе SwissTable, добавления выстраиваются в очередь на мьютексе;
+// таблица после расширения не освобождается, чтобы читатели могли её дочитать
+class TermDictionary {
+public:
+    TermDictionary() {
+        tables_.push_back(make_unique<Table>(INITIAL_CAPACITY));
+        table_.store(tables_.back().get(), memory_order_release);
+    }
+
+    TermDictionary(const TermDictionary&) = delete;
+    TermDictionary& operator=(const TermDictionary&) = delete;
+
+    ~TermDictionary() {
+        for (atomic<string_view*>& chunk : chunks_) {
+            delete[] chunk.load(memory_order_relaxed);
+        }
+    }
+
+    static size_t Hash(string_view term) {
+        return std::hash<string_view>()(term);
+    }
+
+    TermId Intern(string_view term) {
+        const size_t hash = Hash(term);
+        if (const optional<TermId> id = Find(term, hash)) {
+            return id.value();
+        }
+
+        lock_guard lock(mutex_);
+        if (const optional<TermId> id = Find(term, hash)) {
+            return id.value();
+        }
+
+        const TermId id = size_.load(memory_order_relaxed);
+        const auto [chunk_index, offset] = Locate(id);
+        string_view* chunk = chunks_[chunk_index].load(memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new string_view[GetChunkSize(chunk_index)];
+            chunks_[chunk_index].store(chunk, memory_order_release);
+        }
+        chunk[offset] = StoreString(term);
+        {
+            unique_lock ordered_lock(ordered_terms_mutex_);
+            ordered_terms_.Insert(id);
+        }
+
+        Table* table = table_.load(memory_order_relaxed);
+        if ((static_cast<size_t>(id) + 1) * 8 > table->capacity * 7) {
+            tables_.push_back(make_unique<Table>(table->capacity * 2));
+            table = tables_.back().get();
+            for (TermId old_id = 0; old_id < id; ++old_id) {
+                table->Insert(Hash(GetTerm(old_id)), old_id);
+            }
+            table_.store(table, memory_order_release);
+        }
+        table->Insert(hash, id);
+        size_.store(id + 1, memory_order_release);
+
+        return id;
+    }
+
+    optional<TermId> Find(string_view term) const {
+        return Find(term, Hash(term));
+    }
+
+    // Поиск по заранее посчитанному хешу слова
+    optional<TermId> Find(string_view term, size_t hash) const {
+        const Table* table = table_.load(memory_order_acquire);
+        const uint64_t pattern = LOW_BITS * GetH2(hash);
+        const size_t group_mask = table->group_count - 1;
+        for (size_t group = GetH1(hash) & group_mask, step = 1;; group = (group + step++) & group_mask) {
+            const uint64_t control = table->controls[group].load(memory_order_acquire);
+            // Байты, равные H2, обнуляются, и нулевые байты находятся разом для всей группы.
+            // Ложные совпадения бывают только у занятых позиций и отсеиваются сравнением строк
+            const uint64_t difference = control ^ pattern;
+            for (uint64_t matches = (difference - LOW_BITS) & ~difference & HIGH_BITS; matches != 0; matches &= matches - 1) {
+                const size_t position = group * GROUP_SIZE + __builtin_ctzll(matches) / 8;
+                const TermId id = table->slots[position].load(memory_order_relaxed);
+                if (GetTerm(id) == term) {
+                    return id;
+                }
+            }
+
+            if ((control & HIGH_BITS) != 0) {
+                return nullopt;
+            }
+        }
+    }
+
+    string_view GetTerm(TermId id) const {
+        const auto [chunk_index, offset] = Locate(id);
+        return chunks_[chunk_index].load(memory_order_acquire)[offset];
+    }
+
+    size_t GetSize() const {
+        return size_.load(memory_order_acquire);
+    }
+
+    // Номера слов с данным префиксом по возрастанию текста; пустой префикс даёт весь словарь
+    vector<TermId> FindTermsWithPrefix(string_view prefix) const {
+        vector<TermId> result;
+        shared_lock lock(ordered_terms_mutex_);
+        ordered_terms_.ForEachWithPrefix(prefix, [&result](TermId id) {
+            result.push_back(id);
+            return true;
+        });
+        return result;
+    }
+
+    // Одинаковые по составу наборы стоп-слов разных серверов хранятся в одном экземпляре
+    shared_ptr<const set<TermId>> InternStopWords(set<TermId> stop_words) {
+        lock_guard lock(stop_words_mutex_);
+        for (auto it = stop_word_sets_.begin(); it != stop_word_sets_.end();) {
+            it = it->second.expired() ? stop_word_sets_.erase(it) : next(it);
+        }
+
+        weak_ptr<const set<TermId>>& stored = stop_word_sets_[stop_words];
+        if (shared_ptr<const set<TermId>> existing = stored.lock()) {
+            return existing;
+        }
+
+        auto result = make_shared<const set<TermId>>(move(stop_words));
+        stored = result;
+        return result;
+    }
+
+private:
+    static constexpr size_t GROUP_SIZE = 8;
+    static constexpr size_t INITIAL_CAPACITY = 64;
+    static constexpr int FIRST_CHUNK_BITS = 6;
+    static constexpr size_t CHUNK_COUNT = 33 - FIRST_CHUNK_BITS;
+    static constexpr size_t POOL_BLOCK_SIZE = 64 * 1024;
+    static constexpr uint64_t LOW_BITS = 0x0101010101010101;
+    static constexpr uint64_t HIGH_BITS = 0x8080808080808080;
+
+    // Управляющий байт позиции: 0x80 — пусто, иначе младшие 7 бит хеша (H2). Байты
+    // группы из 8 позиций лежат в одном слове и проверяются вместе; номер слова
+    // читается только у позиций с совпавшим H2
+    struct Table {
+        explicit Table(size_t table_capacity)
+            : capacity(table_capacity)
+            , group_count(table_capacity / GROUP_SIZE)
+            , controls(new atomic<uint64_t>[group_count])
+            , slots(new atomic<TermId>[table_capacity]) {
+            for (size_t i = 0; i < group_count; ++i) {
+                controls[i].store(HIGH_BITS, memory_order_relaxed);
+            }
+        }
+
+        void Insert(size_t hash, TermId id) {
+            const size_t group_mask = group_count - 1;
+            for (size_t group = GetH1(hash) & group_mask, step = 1;; group = (group + step++) & group_mask) {
+                uint64_t control = controls[group].load(memory_order_relaxed);
+                if (const uint64_t empty = control & HIGH_BITS; empty != 0) {
+                    const int shift = __builtin_ctzll(empty) - 7;
+                    slots[group * GROUP_SIZE + shift / 8].store(id, memory_order_relaxed);
+                    control = (control & ~(uint64_t(0xFF) << shift)) | (GetH2(hash) << shift);
+                    controls[group].store(control, memory_order_release);
+                    return;
+                }
+            }
+        }
+
+        size_t capacity;
+        size_t group_count;
+        unique_ptr<atomic<uint64_t>[]> controls;
+        unique_ptr<atomic<TermId>[]> slots;
+    };
+
+    atomic<Table*> table_ = nullptr;
+    // Куски растут вдвое, поэтому их адреса умещаются в небольшой массив
+    array<atomic<string_view*>, CHUNK_COUNT> chunks_ = {};
+    atomic<TermId> size_ = 0;
+    mutex mutex_;
+    vector<unique_ptr<Table>> tables_;
+    vector<unique_ptr<char[]>> pool_;
+    size_t pool_used_ = 0;
+    // Точный поиск идёт по хеш-таблице, а дерево нужно для обхода по порядку
+    mutable shared_mutex ordered_terms_mutex_;
+    TermTree ordered_terms_{[this](TermId id) {
+        return GetTerm(id);
+    }};
+    mutex stop_words_mutex_;
+    map<set<TermId>, weak_ptr<const set<TermId>>> stop_word_sets_;
+
+    static size_t GetH1(size_t hash) {
+        return hash >> 7;
+    }
+
+    static uint64_t GetH2(size_t hash) {
+        return hash & 0x7F;
+    }
+
+    static size_t GetChunkSize(size_t chunk_index) {
+        return size_t(1) << (chunk_index + FIRST_CHUNK_BITS);
+    }
+
+    static pair<size_t, size_t> Locate(TermId id) {
+        const uint64_t position = static_cast<uint64_t>(id) + (uint64_t(1) << FIRST_CHUNK_BITS);
+        const int bits = 63 - __builtin_clzll(position);
+        return {bits - FIRST_CHUNK_BITS, position - (uint64_t(1) << bits)};
+    }
+
+    // Строки лежат подряд в блоках пула, которые не перемещаются и не освобождаются
+    string_view StoreString(string_view term) {
+        if (pool_.empty() || pool_used_ + term.size() > POOL_BLOCK_SIZE) {
+            pool_.push_back(make_unique<char[]>(max(POOL_BLOCK_SIZE, term.size())));
+            pool_used_ = 0;
+        }
+
+        char* data = pool_.back().get() + pool_used_;
+        memcpy(data, term.data(), term.size());
+        pool_used_ += term.size();
+        return {data, term.size()};
+    }
+};
+
+struct DocumentMetadata {
+    int32_t rating = 0;
+    uint8_t status = 0;
+    bool present = false;
+
+    DocumentStatus GetStatus() const {
+        return static_cast<DocumentStatus>(status);
+    }
+};
+
+// Компактная таблица рейтингов и статусов, адресуемая напрямую по id документа.
+// Куски по 4096 записей создаются только для занятых диапазонов id
+class DocumentMetadataTable {
+public:
+    static constexpr int CHUNK_SHIFT = 12;
+    static constexpr int CHUNK_SIZE = 1 << CHUNK_SHIFT;
+
+    // Возвращает адрес ячейки, даже если документа нет, чтобы его можно было
+    // заранее подгрузить в кэш; наличие документа проверяется по полю present
+    const DocumentMetadata* Find(int document_id) const {
+        const size_t chunk_index = static_cast<size_t>(document_id) >> CHUNK_SHIFT;
+        if (chunk_index >= chunks_.size() || !chunks_[chunk_index]) {
+            return nullptr;
+        }
+
+        return &(*chunks_[chunk_index])[document_id & (CHUNK_SIZE - 1)];
+    }
+
+    // Обходит id документов по возрастанию, пока callback возвращает true
+    template <typename Callback>
+    void ForEachPresent(Callback callback) const {
+        for (size_t chunk_index = 0; chunk_index < chunks_.size(); ++chunk_index) {
+            if (!chunks_[chunk_index]) {
+                continue;
+            }
+
+            for (int offset = 0; offset < CHUNK_SIZE; ++offset) {
+                if ((*chunks_[chunk_index])[offset].present
+                    && !callback(static_cast<int>(chunk_index << CHUNK_SHIFT) + offset)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    void Set(int document_id, int rating, DocumentStatus status) {
+        const size_t chunk_index = static_cast<size_t>(document_id) >> CHUNK_SHIFT;
+        if (chunk_index >= chunks_.size()) {
+            chunks_.resize(chunk_index + 1);
+        }
+        if (!chunks_[chunk_index]) {
+            chunks_[chunk_index] = allocate_shared<Chunk>(HugePageAllocator<Chunk>());
+        } else if (!IsSoleOwner(chunks_[chunk_index])) {
+            // Кусок разделён со снимком индекса
+            chunks_[chunk_index] = allocate_shared<Chunk>(HugePageAllocator<Chunk>(), *chunks_[chunk_index]);
+        }
+
+        (*chunks_[chunk_index])[document_id & (CHUNK_SIZE - 1)] = {rating, static_cast<uint8_t>(status), true};
+    }
+
+    size_t GetChunkCount() const {
+        return chunks_.size();
+    }
+
+    bool HasChunk(size_t chunk_index) const {
+        return chunk_index < chunks_.size() && chunks_[chunk_index];
+    }
+
+    // Метки времени хранятся отдельным столбцом и только для кусков, где они заданы;
+    // у остальных документов метка равна нулю
+    void SetTimestamp(int document_id, int64_t timestamp) {
+        const size_t chunk_index = static_cast<size_t>(document_id) >> CHUNK_SHIFT;
+        if (chunk_index >= timestamp_chunks_.size()) {
+            timestamp_chunks_.resize(chunk_index + 1);
+        }
+        shared_ptr<TimestampChunk>& chunk = timestamp_chunks_[chunk_index];
+        if (!chunk) {
+            chunk = make_shared<TimestampChunk>();
+        } else if (!IsSoleOwner(chunk)) {
+            chunk = make_shared<TimestampChunk>(*chunk);
+        }
+
+        // Максимум при перезаписи метки не уменьшается и остаётся верхней границей
+        chunk->timestamps[document_id & (CHUNK_SIZE - 1)] = timestamp;
+        chunk->max_timestamp = max(chunk->max_timestamp, timestamp);
+    }
+
+    int64_t GetTimestamp(int document_id) const {
+        const int64_t* timestamps = FindTimestamps(static_cast<size_t>(document_id) >> CHUNK_SHIFT);
+        return timestamps == nullptr ? 0 : timestamps[document_id & (CHUNK_SIZE - 1)];
+    }
+
+    // CHUNK_SIZE меток куска или nullptr, если в куске меток нет
+    const int64_t* FindTimestamps(size_t chunk_index) const {
+        return chunk_index < timestamp_chunks_.size() && timestamp_chunks_[chunk_index]
+            ? timestamp_chunks_[chunk_index]->timestamps.data() : nullptr;
+    }
+
+    int64_t GetMaxTimestamp(size_t chunk_index) const {
+        return chunk_index < timestamp_chunks_.size() && timestamp_chunks_[chunk_index]
+            ? timestamp_chunks_[chunk_index]->max_timestamp : 0;
+    }
+
+private:
+    using Chunk = array<DocumentMetadata, CHUNK_SIZE>;
+
+    struct TimestampChunk {
+        int64_t max_timestamp = 0;
+        array<int64_t, CHUNK_SIZE> timestamps = {};
+    };
+
+    vector<shared_ptr<Chunk>> chunks_;
+    vector<shared_ptr<TimestampChunk>> timestamp_chunks_;
+};
+
+// Документы одного арендатора. Битовая карта по id нужна, чтобы отсекать чужие документы
+// прямо при обходе posting-листа; пока арендатор мал, хранится ещё и список его id,
+// по которому запрос проверяет только его документы, не трогая posting-листы целиком
+class TenantDocuments {
+public:
+    static constexpr int CHUNK_SHIFT = 12;
+    static constexpr int CHUNK_SIZE = 1 << CHUNK_SHIFT;
+    static constexpr size_t MAX_LISTED_DOCUMENTS = 4096;
+
+    bool Contains(int document_id) const {
+        const uint32_t chunk_index = static_cast<uint32_t>(document_id) >> CHUNK_SHIFT;
+        const auto it = lower_bound(chunks_.begin(), chunks_.end(), chunk_index, IsChunkBefore);
+        if (it == chunks_.end() || it->first != chunk_index) {
+            return false;
+        }
+
+        const size_t offset = document_id & (CHUNK_SIZE - 1);
+        return ((*it->second)[offset / 64] >> (offset % 64)) & 1;
+    }
+
+    void Add(int document_id) {
+        const uint32_t chunk_index = static_cast<uint32_t>(document_id) >> CHUNK_SHIFT;
+        auto it = lower_bound(chunks_.begin(), chunks_.end(), chunk_index, IsChunkBefore);
+        if (it == chunks_.end() || it->first != chunk_index) {
+            it = chunks_.emplace(it, chunk_index, make_shared<Chunk>());
+        } else if (!IsSoleOwner(it->second)) {
+            // Кусок разделён со снимком индекса
+            it->second = make_shared<Chunk>(*it->second);
+        }
+
+        const size_t offset = document_id & (CHUNK_SIZE - 1);
+        (*it->second)[offset / 64] |= uint64_t(1) << (offset % 64);
+
+        ++size_;
+        if (size_ <= MAX_LISTED_DOCUMENTS) {
+            document_ids_.push_back(document_id);
+        } else if (!document_ids_.empty()) {
+            document_ids_.clear();
+            document_ids_.shrink_to_fit();
+        }
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    // Id документов в порядке добавления; nullptr, если арендатор перерос список
+    const vector<int>* GetDocumentIds() const {
+        return size_ <= MAX_LISTED_DOCUMENTS ? &document_ids_ : nullptr;
+    }
+
+private:
+    using Chunk = array<uint64_t, CHUNK_SIZE / 64>;
+    using Chunks = vector<pair<uint32_t, shared_ptr<Chunk>>>;
+
+    // Только непустые куски по возрастанию номера: размер зависит от числа документов
+    // арендатора, а не от наибольшего id, и копия после снимка остаётся маленькой
+    Chunks chunks_;
+    vector<int> document_ids_;
+    size_t size_ = 0;
+
+    static bool IsChunkBefore(const Chunks::value_type& chunk, uint32_t chunk_index) {
+        return chunk.first < chunk_index;
+    }
+};
+
+// Счётчик промахов dTLB текущего потока; если perf_event_open недоступен, значения нет
+class DtlbMissCounter {
+public:
+    DtlbMissCounter() {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    DtlbMissCounter(const DtlbMissCounter&) = delete;
+    DtlbMissCounter& operator=(const DtlbMissCounter&) = delete;
+
+    ~DtlbMissCounter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    optional<uint64_t> Read() const {
+        uint64_t value = 0;
+        if (fd_ < 0 || read(fd_, &value, sizeof(value)) != sizeof(value)) {
+            return nullopt;
+        }
+
+        return value;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+struct DtlbStats {
+    bool available = false;
+    uint64_t queries = 0;
+    uint64_t dtlb_misses = 0;
+
+    double GetMissesPerQuery() const {
+        return queries == 0 ? 0.0 : dtlb_misses * 1.0 / queries;
+    }
+};
+
+struct TieredStorageOptions {
+    string path;
+    size_t max_hot_postings = 1 << 20;
+    chrono::milliseconds rebalance_interval{1000};
+};
+
+struct TieredStorageStats {
+    uint64_t hot_lookups = 0;
+    uint64_t cold_lookups = 0;
+    uint64_t queries = 0;
+    uint64_t page_faults = 0;
+    size_t hot_words = 0;
+    size_t cold_words = 0;
+
+    double GetHitRate() const {
+        const uint64_t lookups = hot_lookups + cold_lookups;
+        return lookups == 0 ? 1.0 : hot_lookups * 1.0 / lookups;
+    }
+
+    double GetPageFaultsPerQuery() const {
+        return queries == 0 ? 0.0 : page_faults * 1.0 / queries;
+    }
+};
+
+struct BufferedIngestOptions {
+    chrono::milliseconds refresh_interval{1000};
+    size_t max_buffered_documents = 10000;
+};
+
+struct IngestStats {
+    uint64_t documents_added = 0;
+    uint64_t documents_refreshed = 0;
+    uint64_t documents_pending = 0;
+    uint64_t refreshes = 0;
+    chrono::microseconds total_refresh_latency{0};
+    chrono::microseconds max_refresh_latency{0};
+    chrono::microseconds max_visibility_delay{0};
+    chrono::microseconds elapsed{0};
+
+    // Документов в секунду с момента включения буферизованной записи
+    double GetIngestRate() const {
+        return elapsed.count() == 0 ? 0.0 : documents_added * 1e6 / elapsed.count();
+    }
+
+    chrono::microseconds GetAverageRefreshLatency() const {
+        return refreshes == 0 ? chrono::microseconds(0) : total_refresh_latency / static_cast<int64_t>(refreshes);
+    }
+};
+
+struct QueryBatchingOptions {
+    chrono::microseconds window{200};
+    size_t max_batch_size = 64;
+};
+
+struct QueryBatchingStats {
+    uint64_t queries = 0;
+    uint64_t batches = 0;
+    // Сколько posting-листов запросы пачек читали бы по отдельности и сколько прочитано на деле
+    uint64_t posting_lists_requested = 0;
+    uint64_t posting_lists_scanned = 0;
+
+    double GetAverageBatchSize() const {
+        return batches == 0 ? 0.0 : queries * 1.0 / batches;
+    }
+
+    double GetScanSharing() const {
+        return posting_lists_scanned == 0 ? 1.0 : posting_lists_requested * 1.0 / posting_lists_scanned;
+    }
+};
+
+enum class MemorySubsystem : uint8_t {
+    POSTINGS,
+    DOCUMENTS,
+    INGEST_BUFFER,
+    RATING_ORDER,
+    QUERY_LOG,
+    QUERY_SCRATCH,
+};
+
+const size_t MEMORY_SUBSYSTEM_COUNT = 6;
+
+struct MemoryUsage {
+    array<size_t, MEMORY_SUBSYSTEM_COUNT> bytes = {};
+    array<size_t, MEMORY_SUBSYSTEM_COUNT> evicted_bytes = {};
+
+    size_t GetBytes(MemorySubsystem subsystem) const {
+        return bytes[static_cast<size_t>(subsystem)];
+    }
+
+    void SetBytes(MemorySubsystem subsystem, size_t subsystem_bytes) {
+        bytes[static_cast<size_t>(subsystem)] = subsystem_bytes;
+    }
+
+    void AddEvicted(MemorySubsystem subsystem, size_t subsystem_bytes) {
+        evicted_bytes[static_cast<size_t>(subsystem)] += subsystem_bytes;
+    }
+
+    size_t GetTotal() const {
+        size_t total = 0;
+        for (const size_t subsystem_bytes : bytes) {
+            total += subsystem_bytes;
+        }
+        return total;
+    }
+
+    size_t GetTotalEvicted() const {
+        size_t total = 0;
+        for (const size_t subsystem_bytes : evicted_bytes) {
+            total += subsystem_bytes;
+        }
+        return total;
+    }
+};
+
+// Лимит памяти, который могут делить несколько серверов процесса. Серверы сообщают
+// бюджету, сколько байт занимает каждая их подсистема, и при превышении лимита
+// вытесняют у себя то, что дешевле всего восстановить в пересчёте на байт
+class MemoryBudget {
+public:
+    // Польза — оценка работы, которую придётся проделать, если вытесненное понадобится снова
+    struct Candidate {
+        MemorySubsystem subsystem;
+        size_t bytes;
+        double benefit;
+        uint64_t key;
+    };
+
+    explicit MemoryBudget(size_t limit_bytes)
+        : limit_bytes_(limit_bytes) {
+    }
+
+    size_t GetLimit() const {
+        return limit_bytes_;
+    }
+
+    MemoryUsage GetUsage() const {
+        MemoryUsage usage;
+        for (size_t i = 0; i < MEMORY_SUBSYSTEM_COUNT; ++i) {
+            usage.bytes[i] = bytes_[i].load(memory_order_relaxed);
+            usage.evicted_bytes[i] = evicted_bytes_[i].load(memory_order_relaxed);
+        }
+        return usage;
+    }
+
+    size_t GetExcess() const {
+        const size_t total = GetUsage().GetTotal();
+        return total > limit_bytes_ ? total - limit_bytes_ : 0;
+    }
+
+    size_t GetHeadroom() const {
+        const size_t total = GetUsage().GetTotal();
+        return total < limit_bytes_ ? limit_bytes_ - total : 0;
+    }
+
+    // Сервер сообщает новые размеры своих подсистем вместе с тем, что сообщал в прошлый раз
+    void UpdateUsage(const MemoryUsage& previous, const MemoryUsage& current) {
+        for (size_t i = 0; i < MEMORY_SUBSYSTEM_COUNT; ++i) {
+            bytes_[i].fetch_add(current.bytes[i] - previous.bytes[i], memory_order_relaxed);
+        }
+    }
+
+    void RecordEviction(MemorySubsystem subsystem, size_t bytes) {
+        evicted_bytes_[static_cast<size_t>(subsystem)].fetch_add(bytes, memory_order_relaxed);
+    }
+
+    // Первыми вытесняются кандидаты с наименьшей пользой на байт, пока не наберётся bytes_to_free
+    static vector<Candidate> SelectEvictions(vector<Candidate> candidates, size_t bytes_to_free) {
+        sort(candidates.begin(), candidates.end(), [](const Candidate& lhs, const Candidate& rhs) {
+            return lhs.benefit * rhs.bytes < rhs.benefit * lhs.bytes;
+        });
+
+        size_t selected_bytes = 0;
+        size_t selected_count = 0;
+        while (selected_count < candidates.size() && selected_bytes < bytes_to_free) {
+            selected_bytes += candidates[selected_count++].bytes;
+        }
+        candidates.resize(selected_count);
+
+        return candidates;
+    }
+
+private:
+    size_t limit_bytes_;
+    array<atomic<size_t>, MEMORY_SUBSYSTEM_COUNT> bytes_ = {};
+    array<atomic<size_t>, MEMORY_SUBSYSTEM_COUNT> evicted_bytes_ = {};
+};
+
+// Журнал последних запросов. Каждый поток пишет в собственное кольцо, поэтому запись не берёт общий мьютекс,
+// а строка копируется в уже выделенный слот. Общий порядок восстанавливается по времени записи при чтении
+class QueryLog {
+public:
+    explicit QueryLog(size_t capacity)
+        : capacity_(capacity)
+        , id_(next_id_.fetch_add(1, memory_order_relaxed)) {
+    }
+
+    void Add(string_view raw_query) {
+        Ring& ring = GetThreadRing();
+        const uint64_t logged_at = chrono::steady_clock::now().time_since_epoch().count();
+        lock_guard lock(ring.entries_mutex);
+        if (ring.entries.size() < capacity_) {
+            ring.entries.push_back({logged_at, string(raw_query)});
+        } else {
+            Entry& entry = ring.entries[ring.next];
+            entry.logged_at = logged_at;
+            entry.raw_query.assign(raw_query);
+            ring.next = (ring.next + 1) % capacity_;
+        }
+    }
+
+    // Не больше capacity последних запросов, от старых к новым
+    vector<string> GetRecent() const {
+        vector<pair<uint64_t, string>> entries;
+        ForEachRing([&entries](const Ring& ring) {
+            for (const Entry& entry : ring.entries) {
+                if (entry.logged_at > 0) {
+                    entries.emplace_back(entry.logged_at, entry.raw_query);
+                }
+            }
+        });
+
+        sort(entries.begin(), entries.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+        const size_t skipped = entries.size() > capacity_ ? entries.size() - capacity_ : 0;
+
+        vector<string> raw_queries;
+        raw_queries.reserve(entries.size() - skipped);
+        for (size_t i = skipped; i < entries.size(); ++i) {
+            raw_queries.push_back(move(entries[i].second));
+        }
+        return raw_queries;
+    }
+
+    // Размеры записей от старых к новым
+    vector<size_t> GetEntryBytes() const {
+        vector<pair<uint64_t, size_t>> entries;
+        ForEachRing([&entries](const Ring& ring) {
+            for (const Entry& entry : ring.entries) {
+                if (entry.logged_at > 0) {
+                    entries.emplace_back(entry.logged_at, GetEntryBytes(entry));
+                }
+            }
+        });
+
+        sort(entries.begin(), entries.end());
+        vector<size_t> bytes;
+        bytes.reserve(entries.size());
+        for (const auto& [_, entry_bytes] : entries) {
+            bytes.push_back(entry_bytes);
+        }
+        return bytes;
+    }
+
+    size_t GetMemoryUsage() const {
+        size_t bytes = 0;
+        ForEachRing([&bytes](const Ring& ring) {
+            for (const Entry& entry : ring.entries) {
+                bytes += GetEntryBytes(entry);
+            }
+        });
+        return bytes;
+    }
+
+    // Освобождает count самых старых записей и возвращает число освобождённых байт
+    size_t EvictOldest(size_t count) {
+        lock_guard lock(rings_mutex_);
+        vector<tuple<uint64_t, Ring*, size_t>> entries;
+        for (const shared_ptr<Ring>& ring : rings_) {
+            lock_guard ring_lock(ring->entries_mutex);
+            for (size_t i = 0; i < ring->entries.size(); ++i) {
+                if (ring->entries[i].logged_at > 0) {
+                    entries.emplace_back(ring->entries[i].logged_at, ring.get(), i);
+                }
+            }
+        }
+
+        count = min(count, entries.size());
+        nth_element(entries.begin(), entries.begin() + count, entries.end());
+
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const auto [logged_at, ring, index] = entries[i];
+            lock_guard ring_lock(ring->entries_mutex);
+            Entry& entry = ring->entries[index];
+            // Поток мог перезаписать слот, пока мы выбирали
+            if (entry.logged_at == logged_at) {
+                bytes += GetEntryBytes(entry);
+                entry.logged_at = 0;
+                string().swap(entry.raw_query);
+            }
+        }
+        return bytes;
+    }
+
+private:
+    struct Entry {
+        uint64_t logged_at = 0;
+        string raw_query;
+    };
+
+    struct alignas(64) Ring {
+        mutex entries_mutex;
+        vector<Entry> entries;
+        size_t next = 0;
+    };
+
+    static size_t GetEntryBytes(const Entry& entry) {
+        return sizeof(Entry) + entry.raw_query.capacity();
+    }
+
+    template <typename Func>
+    void ForEachRing(Func func) const {
+        lock_guard lock(rings_mutex_);
+        for (const shared_ptr<Ring>& ring : rings_) {
+            lock_guard ring_lock(ring->entries_mutex);
+            func(*ring);
+        }
+    }
+
+    // Кольцо потока ищется по id журнала: адрес уничтоженного журнала может достаться новому
+    Ring& GetThreadRing() {
+        thread_local unordered_map<uint64_t, weak_ptr<Ring>> thread_rings;
+        if (const auto it = thread_rings.find(id_); it != thread_rings.end()) {
+            if (const shared_ptr<Ring> ring = it->second.lock()) {
+                return *ring;
+            }
+        }
+
+        for (auto it = thread_rings.begin(); it != thread_rings.end();) {
+            it = it->second.expired() ? thread_rings.erase(it) : next(it);
+        }
+
+        auto ring = make_shared<Ring>();
+        {
+            lock_guard lock(rings_mutex_);
+            rings_.push_back(ring);
+        }
+        thread_rings[id_] = ring;
+        return *ring;
+    }
+
+    inline static atomic<uint64_t> next_id_ = 1;
+
+    size_t capacity_;
+    uint64_t id_;
+    mutable mutex rings_mutex_;
+    vector<shared_ptr<Ring>> rings_;
+};
+
+// Холодный уровень хранения: posting-листы лежат в файле, отображённом в память,
+// а в оперативной памяти остаётся только словарь смещений и счётчики обращений
+class ColdPostingStore {
+public:
+    struct Posting {
+        int32_t document_id;
+        int32_t reserved;
+        double term_freq;
+    };
+
+    struct WordEntry {
+        uint64_t offset;
+        uint64_t count;
+        size_t slot;
+    };
+
+    static unique_ptr<ColdPostingStore> Create(const string& path, const CowMap<TermId, DocumentFreqs>& word_to_document_freqs) {
+        CowMap<TermId, WordEntry> words;
+        {
+            // Старый файл может быть ещё отображён в снимках индекса, поэтому
+            // он не перезаписывается, а заменяется новым
+            unlink(path.c_str());
+            ofstream out(path, ios::binary | ios::trunc);
+            uint64_t offset = 0;
+            for (const auto& [word, document_freqs] : word_to_document_freqs) {
+                words.Emplace(word, WordEntry{offset, document_freqs.size(), words.size()});
+                for (const auto& [document_id, term_freq] : document_freqs) {
+                    const Posting posting{document_id, 0, term_freq};
+                    out.write(reinterpret_cast<const char*>(&posting), sizeof(posting));
+                }
+                offset += document_freqs.size();
+            }
+            if (!out) {
+                return nullptr;
+            }
+        }
+
+        return Open(path, move(words));
+    }
+
+    // Переписывает хранилище в новый файл по одному posting-листу, не поднимая уровень в память:
+    // filter получает posting-и слова по возрастанию id и может их сократить, сохранив порядок;
+    // слова, у которых ничего не осталось, в новый файл не попадают. Счётчики обращений
+    // переносятся, а старое отображение остаётся у снимков
+    template <typename Filter>
+    unique_ptr<ColdPostingStore> Rewrite(const string& path, Filter filter) const {
+        CowMap<TermId, WordEntry> words;
+        vector<size_t> source_slots;
+        {
+            unlink(path.c_str());
+            ofstream out(path, ios::binary | ios::trunc);
+            uint64_t offset = 0;
+            vector<pair<int, double>> postings;
+            for (const auto& [word, entry] : words_) {
+                const auto [begin, end] = GetPostings(entry);
+                postings.clear();
+                for (const Posting* posting = begin; posting != end; ++posting) {
+                    postings.emplace_back(posting->document_id, posting->term_freq);
+                }
+                filter(word, postings);
+                if (postings.empty()) {
+                    continue;
+                }
+
+                words.Emplace(word, WordEntry{offset, postings.size(), words.size()});
+                source_slots.push_back(entry.slot);
+                for (const auto& [document_id, term_freq] : postings) {
+                    const Posting posting{document_id, 0, term_freq};
+                    out.write(reinterpret_cast<const char*>(&posting), sizeof(posting));
+                }
+                offset += postings.size();
+            }
+            if (!out) {
+                return nullptr;
+            }
+        }
+
+        unique_ptr<ColdPostingStore> store = Open(path, move(words));
+        if (store) {
+            for (size_t slot = 0; slot < source_slots.size(); ++slot) {
+                store->access_counts_[slot] = access_counts_[source_slots[slot]].load(memory_order_relaxed);
+            }
+        }
+
+        return store;
+    }
+
+    // Копии хранилища делят отображение файла и счётчики обращений,
+    // а словарь слов у каждой копии свой
+    ColdPostingStore(const ColdPostingStore&) = default;
+    ColdPostingStore& operator=(const ColdPostingStore&) = delete;
+
+    const WordEntry* Find(TermId word) const {
+        return words_.Find(word);
+    }
+
+    const CowMap<TermId, WordEntry>& GetWords() const {
+        return words_;
+    }
+
+    pair<const Posting*, const Posting*> GetPostings(const WordEntry& entry) const {
+        return {postings_.get() + entry.offset, postings_.get() + entry.offset + entry.count};
+    }
+
+    DocumentFreqs Load(const WordEntry& entry) const {
+        DocumentFreqs document_freqs;
+        const auto [begin, end] = GetPostings(entry);
+        for (const Posting* posting = begin; posting != end; ++posting) {
+            document_freqs.emplace_hint(document_freqs.end(), posting->document_id, posting->term_freq);
+        }
+
+        return document_freqs;
+    }
+
+    // Вызывается, когда posting-лист слова изменился в памяти и копия на диске устарела
+    void Forget(TermId word) {
+        words_.Erase(word);
+    }
+
+    void RecordAccess(const WordEntry& entry) const {
+        access_counts_[entry.slot].fetch_add(1, memory_order_relaxed);
+    }
+
+    uint64_t GetAccessCount(const WordEntry& entry) const {
+        return access_counts_[entry.slot].load(memory_order_relaxed);
+    }
+
+    // Возвращает число обращений с прошлого вызова и уменьшает его вдвое,
+    // чтобы старые обращения постепенно забывались
+    uint64_t DecayAccessCount(const WordEntry& entry) const {
+        const uint64_t count = access_counts_[entry.slot].load(memory_order_relaxed);
+        access_counts_[entry.slot].store(count / 2, memory_order_relaxed);
+        return count;
+    }
+
+    // Заранее подгружает страницы posting-листа, чтобы первый запрос не ловил page fault
+    uint64_t PrefaultPages(const WordEntry& entry) const {
+        const auto [begin, end] = GetPostings(entry);
+        if (begin == end) {
+            return 0;
+        }
+
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const uintptr_t first = reinterpret_cast<uintptr_t>(begin) & ~(page_size - 1);
+        const uintptr_t last = reinterpret_cast<uintptr_t>(end);
+        madvise(reinterpret_cast<void*>(first), last - first, MADV_WILLNEED);
+
+        uint64_t checksum = 0;
+        const char* bytes = reinterpret_cast<const char*>(begin);
+        for (uintptr_t offset = 0; offset < last - reinterpret_cast<uintptr_t>(begin); offset += page_size) {
+            checksum += static_cast<unsigned char>(bytes[offset]);
+        }
+
+        return checksum;
+    }
+
+    void ReleasePages(const WordEntry& entry) const {
+        const auto [begin, end] = GetPostings(entry);
+        if (begin == end) {
+            return;
+        }
+
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const uintptr_t first = reinterpret_cast<uintptr_t>(begin) & ~(page_size - 1);
+        const uintptr_t last = reinterpret_cast<uintptr_t>(end);
+        madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+    }
+
+private:
+    shared_ptr<const Posting> postings_;
+    CowMap<TermId, WordEntry> words_;
+    shared_ptr<atomic<uint64_t>[]> access_counts_;
+
+    ColdPostingStore(const Posting* postings, size_t size, CowMap<TermId, WordEntry> words)
+        : postings_(postings, [size](const Posting* data) {
+            if (data != nullptr) {
+                munmap(const_cast<Posting*>(data), size);
+            }
+        })
+        , words_(move(words))
+        , access_counts_(new atomic<uint64_t>[words_.size()]) {
+        for (size_t i = 0; i < words_.size(); ++i) {
+            access_counts_[i] = 0;
+        }
+    }
+
+    static unique_ptr<ColdPostingStore> Open(const string& path, CowMap<TermId, WordEntry> words) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        const size_t size = file_stat.st_size;
+        void* data = size == 0 ? nullptr : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+
+        if (data != nullptr) {
+            madvise(data, size, MADV_RANDOM);
+        }
+
+        return unique_ptr<ColdPostingStore>(new ColdPostingStore(static_cast<const Posting*>(data), size, move(words)));
+    }
+};
+
+uint32_t ComputeCrc32cSoftware(const char* data, size_t size, uint32_t crc) {
+    static const array<uint32_t, 256> table = [] {
+        array<uint32_t, 256> result;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = value & 1 ? (value >> 1) ^ 0x82F63B78 : value >> 1;
+            }
+            result[i] = value;
+        }
+        return result;
+    }();
+
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t ComputeCrc32cHardware(const char* data, size_t size, uint32_t crc) {
+    uint64_t crc64 = crc;
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc64 = _mm_crc32_u64(crc64, value);
+    }
+
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; ++data, --size) {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data));
+    }
+
+    return crc;
+}
+#endif
+
+// CRC32C (Castagnoli): на процессорах с SSE4.2 считается инструкцией crc32, иначе по таблице
+uint32_t ComputeCrc32c(const char* data, size_t size) {
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return ~ComputeCrc32cHardware(data, size, ~0u);
+    }
+#endif
+    return ~ComputeCrc32cSoftware(data, size, ~0u);
+}
+
+// Журнал изменений для реплик: записи идут в порядке применения к индексу,
+// документы хранятся уже разбитыми на слова, чтобы реплике не нужно было их разбирать.
+// У каждой записи своя контрольная сумма CRC32C заголовка и слов
+const char CHANGE_LOG_MAGIC[8] = {'S', 'S', 'L', 'O', 'G', '0', '0', '4'};
+
+// Слова одной записи — текст документа или набор стоп-слов; больше считается повреждением
+const uint32_t MAX_CHANGE_RECORD_WORDS_SIZE = 64 << 20;
+
+enum class ChangeType : uint32_t {
+    ADD_DOCUMENT = 1,
+    SET_STATUS = 2,
+    SET_STOP_WORDS = 3,
+    REMOVE_STOP_WORDS = 4,
+    SET_TIMESTAMP = 5,
+    PRUNE_INDEX = 6,
+    ADD_AUTO_STOP_WORDS = 7,
+    CLEAR_AUTO_STOP_WORDS = 8,
+};
+
+bool IsKnownChangeType(uint32_t type) {
+    return type >= static_cast<uint32_t>(ChangeType::ADD_DOCUMENT) && type <= static_cast<uint32_t>(ChangeType::CLEAR_AUTO_STOP_WORDS);
+}
+
+struct ChangeRecord {
+    ChangeType type = ChangeType::ADD_DOCUMENT;
+    int document_id = 0;
+    int rating = 0;
+    DocumentStatus status = DocumentStatus::ACTUAL;
+    uint32_t tenant = 0;
+    int64_t document_timestamp = 0;
+    uint64_t sequence = 0;
+    int64_t timestamp_us = 0;
+    // Параметры PRUNE_INDEX и ADD_AUTO_STOP_WORDS: порог вклада и предел числа posting-ов
+    // слова, для стоп-слов — сохранять ли их posting-и
+    double threshold = 0.0;
+    uint64_t limit = 0;
+    vector<string> words;
+};
+
+struct ChangeRecordHeader {
+    uint32_t type;
+    int32_t document_id;
+    int32_t rating;
+    int32_t status;
+    uint32_t tenant;
+    // CRC32C заголовка с нулём в этом поле и следующих за ним слов
+    uint32_t crc;
+    int64_t document_timestamp;
+    uint64_t sequence;
+    int64_t timestamp_us;
+    double threshold;
+    uint64_t limit;
+    uint32_t word_count;
+    uint32_t words_size;
+};
+
+// Заголовок и слова записи одним куском, вместе с контрольной суммой
+string EncodeChangeRecord(ChangeRecordHeader header, const vector<string_view>& words) {
+    header.crc = 0;
+    header.words_size = 0;
+    for (const string_view word : words) {
+        header.words_size += sizeof(uint32_t) + word.size();
+    }
+
+    string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const string_view word : words) {
+        const uint32_t size = word.size();
+        data.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        data.append(word);
+    }
+
+    const uint32_t crc = ComputeCrc32c(data.data(), data.size());
+    memcpy(data.data() + offsetof(ChangeRecordHeader, crc), &crc, sizeof(crc));
+    return data;
+}
+
+optional<vector<string>> ParseWords(const string& data, size_t offset, uint32_t word_count) {
+    vector<string> words;
+    words.reserve(min<size_t>(word_count, (data.size() - offset) / sizeof(uint32_t)));
+    for (uint32_t i = 0; i < word_count; ++i) {
+        uint32_t size = 0;
+        if (data.size() - offset < sizeof(size)) {
+            return nullopt;
+        }
+        memcpy(&size, data.data() + offset, sizeof(size));
+        offset += sizeof(size);
+        if (data.size() - offset < size) {
+            return nullopt;
+        }
+        words.emplace_back(data, offset, size);
+        offset += size;
+    }
+
+    if (offset != data.size()) {
+        return nullopt;
+    }
+
+    return words;
+}
+
+enum class ChangeRecordState {
+    COMPLETE,
+    // Запись ещё не дописана целиком: её стоит перечитать позже
+    INCOMPLETE,
+    // Запись дописана, но не прошла проверку: применять её и следующие за ней нельзя
+    CORRUPT,
+};
+
+ChangeRecordState ReadChangeRecord(istream& in, ChangeRecord& record) {
+    ChangeRecordHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return ChangeRecordState::INCOMPLETE;
+    }
+
+    if (!IsKnownChangeType(header.type) || header.status < 0 || header.status > static_cast<int32_t>(DocumentStatus::REMOVED)
+        || header.words_size > MAX_CHANGE_RECORD_WORDS_SIZE) {
+        return ChangeRecordState::CORRUPT;
+    }
+
+    string data(sizeof(header) + header.words_size, '\0');
+    memcpy(data.data(), &header, sizeof(header));
+    if (!in.read(data.data() + sizeof(header), header.words_size)) {
+        return ChangeRecordState::INCOMPLETE;
+    }
+
+    const uint32_t crc = header.crc;
+    memset(data.data() + offsetof(ChangeRecordHeader, crc), 0, sizeof(crc));
+    if (ComputeCrc32c(data.data(), data.size()) != crc) {
+        return ChangeRecordState::CORRUPT;
+    }
+
+    optional<vector<string>> words = ParseWords(data, sizeof(header), header.word_count);
+    if (!words.has_value()) {
+        return ChangeRecordState::CORRUPT;
+    }
+
+    record = ChangeRecord{static_cast<ChangeType>(header.type), header.document_id, header.rating,
+                          static_cast<DocumentStatus>(header.status), header.tenant, header.document_timestamp,
+                          header.sequence, header.timestamp_us, header.threshold, header.limit, move(words.value())};
+    return ChangeRecordState::COMPLETE;
+}
+
+int64_t GetTimestampUs() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct ReplicationStats {
+    uint64_t applied_sequence = 0;
+    uint64_t applied_records = 0;
+    uint64_t batches = 0;
+    uint64_t bytes_behind = 0;
+    // Смещение первой записи журнала, не прошедшей проверку, или 0. Реплика на ней
+    // останавливается: следующие записи без неё дали бы индекс, отличный от основного
+    uint64_t corrupt_offset = 0;
+    chrono::microseconds last_lag{0};
+    chrono::microseconds max_lag{0};
+};
+
+// Формат снимка: заголовок, таблица секций и сами секции. Каждая секция сжата
+// varint-кодированием с разностями соседних id и имеет свою контрольную сумму CRC32C,
+// поэтому секции пишутся, проверяются и разбираются параллельно
+const char SNAPSHOT_MAGIC[8] = {'S', 'S', 'S', 'N', 'A', 'P', '0', '4'};
+
+enum class SnapshotSectionType : uint32_t {
+    STOP_WORDS = 1,
+    DICTIONARY = 2,
+    DOCUMENTS = 3,
+    POSTINGS = 4,
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t section_count;
+    uint32_t table_crc;
+};
+
+struct SnapshotSectionEntry {
+    uint32_t type;
+    uint32_t crc;
+    uint64_t offset;
+    uint64_t size;
+};
+
+void AppendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+void AppendString(string& out, string_view value) {
+    AppendVarint(out, value.size());
+    out.append(value);
+}
+
+void AppendDouble(string& out, double value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint64_t EncodeZigZag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t DecodeZigZag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Читает секцию снимка; при выходе за её границу запоминает ошибку и дальше возвращает нули
+class SectionReader {
+public:
+    SectionReader(const char* begin, const char* end)
+        : pos_(begin)
+        , end_(end) {
+    }
+
+    uint64_t ReadVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64 && pos_ != end_; shift += 7) {
+            const uint8_t byte = static_cast<uint8_t>(*pos_++);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+
+        failed_ = true;
+        return 0;
+    }
+
+    string ReadString() {
+        const uint64_t size = ReadVarint();
+        if (failed_ || size > static_cast<uint64_t>(end_ - pos_)) {
+            failed_ = true;
+            return {};
+        }
+
+        string value(pos_, size);
+        pos_ += size;
+        return value;
+    }
+
+    double ReadDouble() {
+        double value = 0.0;
+        if (static_cast<size_t>(end_ - pos_) < sizeof(value)) {
+            failed_ = true;
+            return value;
+        }
+
+        memcpy(&value, pos_, sizeof(value));
+        pos_ += sizeof(value);
+        return value;
+    }
+
+    // Секция разобрана без ошибок и целиком
+    bool IsComplete() const {
+        return !failed_ && pos_ == end_;
+    }
+
+    bool IsFailed() const {
+        return failed_;
+    }
+
+private:
+    const char* pos_;
+    const char* end_;
+    bool failed_ = false;
+};
+
+class MappedIndex;
+class ChangeLogFollower;
+
+class SearchServer {
+public:
+    inline static constexpr int INVALID_DOCUMENT_ID = -1;
+
+    SearchServer() = default;
+    
+    template <typename StringCollection>
+    explicit SearchServer(const StringCollection& stop_words)
+        : SearchServer(make_shared<TermDictionary>(), stop_words) { }
+    
+    explicit SearchServer(const string& stop_words_text)
+        : SearchServer(SplitIntoWords(stop_words_text)) { }    
+
+    // Сервер, который разделяет словарь слов и наборы стоп-слов с другими серверами процесса
+    template <typename StringCollection>
+    SearchServer(shared_ptr<TermDictionary> terms, const StringCollection& stop_words)
+        : terms_(move(terms)) {
+        set<TermId> stop_word_ids;
+        for (const auto& word : stop_words) {
+            if (word.size()) {
+                stop_word_ids.insert(terms_->Intern(word));
+            }
+        }
+        stop_words_ = terms_->InternStopWords(move(stop_word_ids));
+    }
+
+    SearchServer(shared_ptr<TermDictionary> terms, const string& stop_words_text)
+        : SearchServer(move(terms), SplitIntoWords(stop_words_text)) { }
+
+    SearchServer(const SearchServer&) = delete;
+    SearchServer& operator=(const SearchServer&) = delete;
+
+    ~SearchServer() {
+        DisableQueryBatching();
+        DisableMemoryBudget();
+        StopTierRebalancer();
+        DisableBufferedIngest();
+        WaitForReindex();
+    }
+
+    // Документы новых стоп-слов удаляются из индекса сразу, а tf затронутых документов
+    // пересчитываются в фоне небольшими пачками, чтобы не блокировать запросы надолго
+    void SetStopWords(const string& text) {
+        SetStopWords(SplitIntoWords(text), 0, 0);
+    }
+
+    void RemoveStopWords(const string& text) {
+        RemoveStopWords(SplitIntoWords(text), 0, 0);
+    }
+
+    void WaitForReindex() const {
+        shared_future<void> reindex;
+        {
+            lock_guard lock(reindex_mutex_);
+            reindex = reindex_future_;
+        }
+
+        if (reindex.valid()) {
+            reindex.wait();
+        }
+    }
+
+    [[nodiscard]] bool AddDocument(int document_id, const string& document, DocumentStatus status, const vector<int>& ratings) {
+        return AddDocument(document_id, document, status, ratings, 0);
+    }
+
+    // Документ арендатора tenant; документы, добавленные без арендатора, относятся к арендатору 0.
+    // Можно вызывать из многих потоков сразу: документ попадает в полосу буфера по своему
+    // номеру, и без буферизованной записи вызвавший поток сам публикует всё накопленное
+    // в полосах одной пачкой, пока остальные продолжают добавлять
+    [[nodiscard]] bool AddDocument(int document_id, const string& document, DocumentStatus status, const vector<int>& ratings,
+                                   uint32_t tenant) {
+        if (document_id < 0 || !IsValidWord(document)) {
+            return false;
+        }
+
+        const int rating = ComputeAverageRating(ratings);
+
+        shared_lock mode_lock(ingest_mode_mutex_);
+        IngestStripe& stripe = GetIngestStripe(document_id);
+        {
+            // Номер уходит из полосы только после появления документа в индексе,
+            // поэтому повтор виден хотя бы в одном из двух мест
+            lock_guard stripe_lock(stripe.buffer_mutex);
+            if (stripe.pending_document_ids.count(document_id) > 0) {
+                return false;
+            }
+            {
+                shared_lock lock(index_mutex_);
+                if (documents_.count(document_id) > 0) {
+                    return false;
+                }
+            }
+
+            stripe.pending_document_ids.insert(document_id);
+        }
+
+        // Номер уже занят, поэтому слова отвергнутого повтора в общий словарь не попадают
+        vector<TermId> words = InternWords(SplitIntoWords(document));
+        bool refresh_due = false;
+        {
+            lock_guard stripe_lock(stripe.buffer_mutex);
+            stripe.buffer.push_back({document_id, rating, status, tenant, move(words), chrono::steady_clock::now()});
+            const size_t buffered_count = buffered_document_count_.fetch_add(1, memory_order_relaxed) + 1;
+            if (ingest_options_) {
+                ++stripe.documents_added;
+                refresh_due = buffered_count == ingest_options_->max_buffered_documents;
+            }
+        }
+
+        if (ingest_options_) {
+            if (refresh_due) {
+                lock_guard lock(ingest_mutex_);
+                ingest_cv_.notify_all();
+            }
+            return true;
+        }
+
+        // Пока один поток публикует, другие успевают положить документы в полосы, и
+        // следующий публикующий забирает их все; свой документ мог уже опубликовать другой
+        lock_guard publish_lock(publish_mutex_);
+        {
+            lock_guard stripe_lock(stripe.buffer_mutex);
+            if (stripe.pending_document_ids.count(document_id) == 0) {
+                return true;
+            }
+        }
+        PublishBufferedDocuments();
+
+        return true;
+    }
+
+    [[nodiscard]] bool SetDocumentStatus(int document_id, DocumentStatus status) {
+        return SetDocumentStatus(document_id, status, 0, 0);
+    }
+
+    // Метка времени документа для ранжирования по свежести, в единицах FreshnessDecay
+    [[nodiscard]] bool SetDocumentTimestamp(int document_id, int64_t timestamp) {
+        return SetDocumentTimestamp(document_id, timestamp, 0, 0);
+    }
+
+    // Документы копятся в буфере, добавление в который не блокирует запросы, и становятся
+    // видны поиску пачкой: раз в refresh_interval или когда набирается max_buffered_documents
+    void EnableBufferedIngest(const BufferedIngestOptions& options) {
+        DisableBufferedIngest();
+
+        {
+            unique_lock mode_lock(ingest_mode_mutex_);
+            lock_guard lock(ingest_mutex_);
+            ingest_options_ = options;
+            ingest_stats_ = {};
+            for (IngestStripe& stripe : ingest_stripes_) {
+                lock_guard stripe_lock(stripe.buffer_mutex);
+                stripe.documents_added = 0;
+            }
+            ingest_started_ = chrono::steady_clock::now();
+            stop_refresher_ = false;
+        }
+
+        refresher_ = thread([this] {
+            unique_lock lock(ingest_mutex_);
+            while (!stop_refresher_) {
+                ingest_cv_.wait_for(lock, ingest_options_->refresh_interval, [this] {
+                    return stop_refresher_ || buffered_document_count_.load(memory_order_relaxed) >= ingest_options_->max_buffered_documents;
+                });
+                lock.unlock();
+                Refresh();
+                lock.lock();
+            }
+        });
+    }
+
+    // Останавливает фоновое обновление и делает видимым всё, что осталось в буфере
+    void DisableBufferedIngest() {
+        {
+            lock_guard lock(ingest_mutex_);
+            stop_refresher_ = true;
+        }
+        ingest_cv_.notify_all();
+
+        if (refresher_.joinable()) {
+            refresher_.join();
+        }
+
+        {
+            unique_lock mode_lock(ingest_mode_mutex_);
+            lock_guard lock(ingest_mutex_);
+            ingest_options_.reset();
+        }
+        Refresh();
+    }
+
+    // Переносит накопленные документы в индекс; возвращает их число
+    size_t Refresh() {
+        const auto refresh_begin = chrono::steady_clock::now();
+        vector<BufferedDocument> batch;
+        {
+            lock_guard publish_lock(publish_mutex_);
+            batch = PublishBufferedDocuments();
+        }
+
+        if (batch.empty()) {
+            return 0;
+        }
+
+        const auto refresh_end = chrono::steady_clock::now();
+        const auto refresh_latency = chrono::duration_cast<chrono::microseconds>(refresh_end - refresh_begin);
+        auto first_added_at = batch.front().added_at;
+        for (const BufferedDocument& document : batch) {
+            first_added_at = min(first_added_at, document.added_at);
+        }
+        const auto visibility_delay = chrono::duration_cast<chrono::microseconds>(refresh_end - first_added_at);
+
+        lock_guard lock(ingest_mutex_);
+        ++ingest_stats_.refreshes;
+        ingest_stats_.documents_refreshed += batch.size();
+        ingest_stats_.total_refresh_latency += refresh_latency;
+        ingest_stats_.max_refresh_latency = max(ingest_stats_.max_refresh_latency, refresh_latency);
+        ingest_stats_.max_visibility_delay = max(ingest_stats_.max_visibility_delay, visibility_delay);
+
+        return batch.size();
+    }
+
+    IngestStats GetIngestStats() const {
+        lock_guard lock(ingest_mutex_);
+        IngestStats stats = ingest_stats_;
+        for (const IngestStripe& stripe : ingest_stripes_) {
+            lock_guard stripe_lock(stripe.buffer_mutex);
+            stats.documents_added += stripe.documents_added;
+            stats.documents_pending += stripe.pending_document_ids.size();
+        }
+        if (ingest_options_) {
+            stats.elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - ingest_started_);
+        }
+
+        return stats;
+    }
+
+    // Одиночные запросы разных клиентов копятся в течение window от первого из них или до
+    // max_batch_size и выполняются одной пачкой: каждый posting-лист, нужный нескольким
+    // запросам пачки, читается один раз. Ответ приходит через future
+    void EnableQueryBatching(const QueryBatchingOptions& options) {
+        DisableQueryBatching();
+
+        {
+            lock_guard lock(query_batch_mutex_);
+            query_batching_options_ = options;
+            query_batching_stats_ = {};
+            stop_query_batcher_ = false;
+        }
+
+        query_batcher_ = thread([this] {
+            unique_lock lock(query_batch_mutex_);
+            while (true) {
+                query_batch_cv_.wait(lock, [this] {
+                    return stop_query_batcher_ || !query_batch_.empty();
+                });
+                if (stop_query_batcher_) {
+                    break;
+                }
+
+                const QueryBatchingOptions options = *query_batching_options_;
+                query_batch_cv_.wait_until(lock, query_batch_.front().arrived_at + options.window, [this, &options] {
+                    return stop_query_batcher_ || query_batch_.size() >= options.max_batch_size;
+                });
+
+                const size_t batch_size = min(query_batch_.size(), options.max_batch_size);
+                vector<BatchedQuery> batch(make_move_iterator(query_batch_.begin()), make_move_iterator(query_batch_.begin() + batch_size));
+                query_batch_.erase(query_batch_.begin(), query_batch_.begin() + batch_size);
+                lock.unlock();
+                ExecuteQueryBatch(batch);
+                lock.lock();
+            }
+        });
+    }
+
+    // Останавливает сбор пачек и выполняет запросы, которые уже ждут
+    void DisableQueryBatching() {
+        {
+            lock_guard lock(query_batch_mutex_);
+            query_batching_options_.reset();
+            stop_query_batcher_ = true;
+        }
+        query_batch_cv_.notify_all();
+
+        if (query_batcher_.joinable()) {
+            query_batcher_.join();
+        }
+
+        vector<BatchedQuery> batch;
+        {
+            lock_guard lock(query_batch_mutex_);
+            batch.swap(query_batch_);
+        }
+        if (!batch.empty()) {
+            ExecuteQueryBatch(batch);
+        }
+    }
+
+    // То же, что FindTopDocuments(raw_query, status); без включённой пачечной обработки
+    // запрос выполняется сразу в вызывающем потоке
+    future<optional<vector<Document>>> FindTopDocumentsAsync(const string& raw_query, DocumentStatus status = DocumentStatus::ACTUAL) const {
+        promise<optional<vector<Document>>> result;
+        future<optional<vector<Document>>> result_future = result.get_future();
+        {
+            lock_guard lock(query_batch_mutex_);
+            if (query_batching_options_) {
+                query_batch_.push_back({raw_query, status, chrono::steady_clock::now(), move(result)});
+                if (query_batch_.size() == 1 || query_batch_.size() >= query_batching_options_->max_batch_size) {
+                    query_batch_cv_.notify_all();
+                }
+                return result_future;
+            }
+        }
+
+        result.set_value(FindTopDocuments(raw_query, status));
+        return result_future;
+    }
+
+    QueryBatchingStats GetQueryBatchingStats() const {
+        lock_guard lock(query_batch_mutex_);
+        return query_batching_stats_;
+    }
+
+    template <typename DocumentPredicate>
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate, double min_relevance = 0.0) const {
+        optional<vector<Document>> result = SearchTopDocuments(raw_query, document_predicate, min_relevance);
+        if (result.has_value()) {
+            LogQuery(raw_query);
+        }
+
+        return result;
+    }
+
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentStatus status, double min_relevance = 0.0) const {
+        return FindTopDocuments(raw_query, [status](int, DocumentStatus doc_status, int) { return doc_status == status; }, min_relevance);
+    }
+
+    optional<vector<Document>> FindTopDocuments(const string& raw_query) const {
+        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    }
+
+    // Порядок по рейтингу (по убыванию) или по id (по возрастанию) строится без сортировки
+    // всех совпадений: документы перебираются сразу в нужном порядке до первых
+    // MAX_RESULT_DOCUMENT_COUNT подходящих
+    template <typename DocumentPredicate>
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate, SortMode sort_mode) const {
+        if (sort_mode == SortMode::RELEVANCE) {
+            return FindTopDocuments(raw_query, document_predicate);
+        }
+
+        shared_lock lock(index_mutex_);
+        const optional<Query> query = ParseQuery(raw_query);
+        if (!IsValidWord(raw_query) || !query.has_value()) {
+            return nullopt;
+        }
+
+        vector<Document> result = sort_mode == SortMode::ID
+            ? FindDocumentsById(query.value(), document_predicate)
+            : FindDocumentsByRating(query.value(), document_predicate);
+        LogQuery(raw_query);
+
+        return result;
+    }
+
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentStatus status, SortMode sort_mode) const {
+        return FindTopDocuments(raw_query, [status](int, DocumentStatus doc_status, int) { return doc_status == status; }, sort_mode);
+    }
+
+    // Релевантность, умноженная на затухание по возрасту документа (см. SetDocumentTimestamp).
+    // Куски таблицы документов перебираются от самых свежих, и как только даже наибольшая
+    // возможная релевантность после затухания не дотягивает до K-го результата, поиск
+    // останавливается: в остальных кусках документы только старше
+    template <typename DocumentPredicate>
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate, const FreshnessDecay& decay) const {
+        if (decay.half_life <= 0) {
+            return nullopt;
+        }
+
+        shared_lock lock(index_mutex_);
+        const optional<Query> query = ParseQuery(raw_query);
+        if (!IsValidWord(raw_query) || !query.has_value()) {
+            return nullopt;
+        }
+
+        vector<Document> result = FindFreshDocuments(query.value(), document_predicate, decay);
+        SortAndTruncateDocuments(result);
+        LogQuery(raw_query);
+
+        return result;
+    }
+
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentStatus status, const FreshnessDecay& decay) const {
+        return FindTopDocuments(raw_query, [status](int, DocumentStatus doc_status, int) { return doc_status == status; }, decay);
+    }
+
+    // Поиск только среди документов арендатора tenant. У небольшого арендатора проверяются
+    // его собственные документы, если их меньше, чем записей в posting-листах запроса;
+    // иначе posting-листы обходятся с отсечением чужих документов по битовой карте
+    template <typename DocumentPredicate>
+    optional<vector<Document>> FindTenantDocuments(uint32_t tenant, const string& raw_query, DocumentPredicate document_predicate) const {
+        shared_lock lock(index_mutex_);
+        const optional<Query> query = ParseQuery(raw_query);
+        if (!IsValidWord(raw_query) || !query.has_value()) {
+            return nullopt;
+        }
+
+        const TenantDocuments* tenant_documents = tenants_.Find(tenant);
+        if (tenant_documents == nullptr) {
+            return vector<Document>();
+        }
+
+        size_t posting_count = 0;
+        for (const TermId word : query->plus_terms) {
+            posting_count += GetWordDocumentCount(word);
+        }
+
+        const vector<int>* document_ids = tenant_documents->GetDocumentIds();
+        vector<Document> result = document_ids != nullptr && document_ids->size() < posting_count
+            ? FindListedDocuments(query.value(), *document_ids, document_predicate)
+            : FindAllDocuments(query.value(), document_predicate, tenant_documents);
+        SortAndTruncateDocuments(result);
+        LogQuery(raw_query);
+
+        return result;
+    }
+
+    optional<vector<Document>> FindTenantDocuments(uint32_t tenant, const string& raw_query, DocumentStatus status) const {
+        return FindTenantDocuments(tenant, raw_query, [status](int, DocumentStatus doc_status, int) { return doc_status == status; });
+    }
+
+    optional<vector<Document>> FindTenantDocuments(uint32_t tenant, const string& raw_query) const {
+        return FindTenantDocuments(tenant, raw_query, DocumentStatus::ACTUAL);
+    }
+
+    size_t GetTenantDocumentCount(uint32_t tenant) const {
+        shared_lock lock(index_mutex_);
+        const TenantDocuments* tenant_documents = tenants_.Find(tenant);
+        return tenant_documents == nullptr ? 0 : tenant_documents->GetSize();
+    }
+
+    // Все найденные документы в порядке FindTopDocuments. Вместо сравнения с допуском
+    // DELTA релевантность квантуется корзинами шириной DELTA, и пара (корзина, рейтинг)
+    // кодируется в целочисленный ключ для поразрядной сортировки
+    template <typename DocumentPredicate, typename DocumentConsumer>
+    [[nodiscard]] bool StreamAllDocuments(const string& raw_query, DocumentPredicate document_predicate, DocumentConsumer consumer) const {
+        vector<Document> documents;
+        {
+            shared_lock lock(index_mutex_);
+            const optional<Query> query = ParseQuery(raw_query);
+            if (!IsValidWord(raw_query) || !query.has_value()) {
+                return false;
+            }
+
+            documents = FindAllDocuments(query.value(), document_predicate);
+        }
+
+        for (const uint32_t index : OrderByRelevance(documents)) {
+            consumer(documents[index]);
+        }
+
+        return true;
+    }
+
+    template <typename DocumentPredicate>
+    optional<vector<Document>> ExportAllDocuments(const string& raw_query, DocumentPredicate document_predicate) const {
+        vector<Document> result;
+        if (!StreamAllDocuments(raw_query, document_predicate, [&result](const Document& document) {
+                result.push_back(document);
+            })) {
+            return nullopt;
+        }
+
+        return result;
+    }
+
+    optional<vector<Document>> ExportAllDocuments(const string& raw_query, DocumentStatus status) const {
+        return ExportAllDocuments(raw_query, [status](int, DocumentStatus doc_status, int) { return doc_status == status; });
+    }
+
+    optional<vector<Document>> ExportAllDocuments(const string& raw_query) const {
+        return ExportAllDocuments(raw_query, DocumentStatus::ACTUAL);
+    }
+
+    int GetDocumentCount() const {
+        shared_lock lock(index_mutex_);
+        return documents_.size();
+    }
+
+    // Слова индекса с данным префиксом по алфавиту
+    vector<string> GetWordsWithPrefix(string_view prefix) const {
+        shared_lock lock(index_mutex_);
+        vector<string> result;
+        for (const TermId word : terms_->FindTermsWithPrefix(prefix)) {
+            if (HasWord(word)) {
+                result.emplace_back(terms_->GetTerm(word));
+            }
+        }
+        return result;
+    }
+
+    optional<tuple<vector<string>, DocumentStatus>> MatchDocument(const string& raw_query, int document_id) const {
+        shared_lock lock(index_mutex_);
+        const optional<Query> query = ParseQuery(raw_query);
+        if (!IsValidWord(raw_query) || !query.has_value()) {
+            return nullopt;
+        }
+
+        vector<string> matched_words;
+
+        for (const string& word : query.value().plus_words) {
+            if (HasPosting(word, document_id)) {
+                matched_words.push_back(word);
+            }
+        }
+
+        for (const string& word : query.value().minus_words) {
+            if (HasPosting(word, document_id)) {
+                matched_words.clear();
+                break;
+            }
+        }
+
+        return tuple {matched_words, documents_.At(document_id).status};
+    }
+
+    int GetDocumentId(int index) const {
+        shared_lock lock(index_mutex_);
+        if (index < 0 || index >= documents_.size()) {
+            return SearchServer::INVALID_DOCUMENT_ID;
+        }
+
+        int document_id = SearchServer::INVALID_DOCUMENT_ID;
+        int doc_index = 0;
+        document_metadata_.ForEachPresent([&](int id) {
+            if (doc_index++ == index) {
+                document_id = id;
+                return false;
+            }
+            return true;
+        });
+
+        return document_id;
+    }
+
+    // Размер индекса в отчёте — память posting-листов в оценке MeasureMemoryUsage, то есть
+    // при многоуровневом хранении только горячий уровень; файл холодного уровня переписывается
+    // по одному posting-листу, не поднимаясь в память целиком. Пробные запросы не попадают
+    // в журнал запросов. Реплики повторяют прореживание с той же политикой, поэтому пробные
+    // запросы им не передаются
+    optional<PruningReport> PruneIndex(const PruningPolicy& policy, const vector<string>& sample_queries) {
+        return PruneIndex(policy, sample_queries, 0, 0);
+    }
+
+    // Как и у SetStopWords, posting-и найденных слов удаляются сразу, а tf затронутых
+    // документов пересчитываются в фоне
+    vector<string> DetectStopWords(const StopWordPolicy& policy) {
+        WaitForReindex();
+        unique_lock lock(index_mutex_);
+        vector<string> detected;
+        if (documents_.empty()) {
+            return detected;
+        }
+
+        // Число документов слова известно и для холодного уровня, поэтому posting-листы не читаются
+        vector<TermId> detected_terms;
+        ForEachWord([&](TermId word) {
+            const double document_ratio = GetWordDocumentCount(word) * 1.0 / documents_.size();
+            if (document_ratio > policy.max_document_ratio
+                || ComputeWordInverseDocumentFreq(word) < policy.min_inverse_document_freq) {
+                detected_terms.push_back(word);
+                detected.emplace_back(terms_->GetTerm(word));
+            }
+        });
+
+        set<int> affected_documents = AddAutoStopWords(detected_terms, policy.keep_cold_postings, 0, 0);
+        lock.unlock();
+
+        ScheduleReindex(move(affected_documents), {});
+
+        return detected;
+    }
+
+    set<string> GetAutoStopWords() const {
+        shared_lock lock(index_mutex_);
+        return GetTermStrings(auto_stop_words_);
+    }
+
+    // Слова снова индексируются во всех документах, как после RemoveStopWords. Сохранённые
+    // posting-и (keep_cold_postings) возвращаются сразу и видны поиску до конца переиндексации
+    void ClearAutoStopWords() {
+        ClearAutoStopWords(0, 0);
+    }
+
+    // Запись идёт во временный файл, который затем атомарно переименовывается,
+    // чтобы подключающиеся процессы никогда не видели недописанный индекс
+    [[nodiscard]] bool ExportIndex(const string& path) const {
+        shared_lock lock(index_mutex_);
+
+        vector<MappedDocument> documents;
+        map<int, uint32_t> document_indexes;
+        document_metadata_.ForEachPresent([&](int document_id) {
+            const DocumentData& document_data = documents_.At(document_id);
+            document_indexes.emplace(document_id, static_cast<uint32_t>(documents.size()));
+            documents.push_back({document_id, document_data.rating, static_cast<int32_t>(document_data.status), 0});
+            return true;
+        });
+
+        string strings;
+        vector<MappedWord> words;
+        vector<MappedPosting> postings;
+        ForEachWord([&](TermId word) {
+            const size_t postings_begin = postings.size();
+            ForEachPosting(word, [&](int document_id, double term_freq) {
+                postings.push_back({document_indexes.at(document_id), 0, term_freq});
+            });
+            const string_view text = terms_->GetTerm(word);
+            words.push_back({{strings.size(), text.size()}, postings_begin, postings.size() - postings_begin, GetWordDocumentCount(word)});
+            strings += text;
+        });
+
+        set<string> all_stop_words = GetTermStrings(*stop_words_);
+        all_stop_words.merge(GetTermStrings(auto_stop_words_));
+        vector<MappedString> stop_words;
+        for (const string& word : all_stop_words) {
+            stop_words.push_back({strings.size(), word.size()});
+            strings += word;
+        }
+
+        lock.unlock();
+
+        MappedIndexHeader header = {};
+        memcpy(header.magic, MAPPED_INDEX_MAGIC, sizeof(header.magic));
+        header.document_count = documents.size();
+        header.word_count = words.size();
+        header.stop_word_count = stop_words.size();
+        header.posting_count = postings.size();
+        header.strings_size = strings.size();
+        header.documents_offset = sizeof(header);
+        header.words_offset = header.documents_offset + documents.size() * sizeof(MappedDocument);
+        header.stop_words_offset = header.words_offset + words.size() * sizeof(MappedWord);
+        header.postings_offset = header.stop_words_offset + stop_words.size() * sizeof(MappedString);
+        header.strings_offset = header.postings_offset + postings.size() * sizeof(MappedPosting);
+        header.file_size = header.strings_offset + strings.size();
+
+        const string temp_path = path + ".tmp"s;
+        {
+            ofstream out(temp_path, ios::binary | ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(documents.data()), documents.size() * sizeof(MappedDocument));
+            out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(MappedWord));
+            out.write(reinterpret_cast<const char*>(stop_words.data()), stop_words.size() * sizeof(MappedString));
+            out.write(reinterpret_cast<const char*>(postings.data()), postings.size() * sizeof(MappedPosting));
+            out.write(strings.data(), strings.size());
+            if (!out) {
+                remove(temp_path.c_str());
+                return false;
+            }
+        }
+
+        return rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    // Все posting-листы выгружаются в файл, а в памяти остаются только часто
+    // запрашиваемые слова; фоновый поток периодически пересматривает горячий набор
+    [[nodiscard]] bool EnableTieredStorage(const TieredStorageOptions& options) {
+        StopTierRebalancer();
+
+        unique_lock lock(index_mutex_);
+        LoadColdPostings();
+        tiered_options_ = options;
+        if (!StoreColdPostings()) {
+            tiered_options_.reset();
+            return false;
+        }
+        lock.unlock();
+
+        stop_tier_rebalancer_ = false;
+        tier_rebalancer_ = thread([this] {
+            unique_lock rebalancer_lock(tier_rebalancer_mutex_);
+            while (!tier_rebalancer_cv_.wait_for(rebalancer_lock, tiered_options_->rebalance_interval,
+                                                 [this] { return stop_tier_rebalancer_; })) {
+                rebalancer_lock.unlock();
+                RebalanceTiers();
+                rebalancer_lock.lock();
+            }
+        });
+
+        return true;
+    }
+
+    void DisableTieredStorage() {
+        StopTierRebalancer();
+
+        unique_lock lock(index_mutex_);
+        LoadColdPostings();
+        tiered_options_.reset();
+    }
+
+    // Прогревает posting-листы, словарь и таблицу документов для слов из запросов.
+    // Пока прогрев идёт, IsReady() возвращает false
+    void WarmUp(const vector<string>& raw_queries) {
+        ready_ = false;
+
+        set<string> words;
+        {
+            shared_lock lock(index_mutex_);
+            for (const string& raw_query : raw_queries) {
+                if (const optional<Query> query = ParseQuery(raw_query); query.has_value() && IsValidWord(raw_query)) {
+                    words.insert(query->plus_words.begin(), query->plus_words.end());
+                    words.insert(query->minus_words.begin(), query->minus_words.end());
+                }
+            }
+        }
+
+        const vector<string> word_list(words.begin(), words.end());
+        ParallelFor(word_list.size(), [this, &word_list](size_t i) {
+            shared_lock lock(index_mutex_);
+            WarmUpWord(word_list[i]);
+        });
+
+        ready_ = true;
+    }
+
+    void WarmUpFromRecentQueries() {
+        WarmUp(GetRecentQueries());
+    }
+
+    [[nodiscard]] bool WarmUpFromQueryLog(const string& path) {
+        ifstream in(path);
+        if (!in) {
+            return false;
+        }
+
+        vector<string> raw_queries;
+        for (string line; getline(in, line);) {
+            raw_queries.push_back(move(line));
+        }
+
+        WarmUp(raw_queries);
+        return true;
+    }
+
+    [[nodiscard]] bool SaveQueryLog(const string& path) const {
+        ofstream out(path, ios::trunc);
+        for (const string& raw_query : GetRecentQueries()) {
+            out << raw_query << '\n';
+        }
+
+        return static_cast<bool>(out);
+    }
+
+    vector<string> GetRecentQueries() const {
+        return query_log_.GetRecent();
+    }
+
+    // Сервер готов сразу после создания. Если его нужно прогреть до приёма запросов,
+    // RequireWarmUp делает его неготовым до WarmUp или SkipWarmUp
+    void RequireWarmUp() {
+        ready_ = false;
+    }
+
+    void SkipWarmUp() {
+        ready_ = true;
+    }
+
+    bool IsReady() const {
+        return ready_;
+    }
+
+    void EnableDtlbCounters(bool enabled) {
+        dtlb_counters_enabled_ = enabled;
+    }
+
+    DtlbStats GetDtlbStats() const {
+        DtlbStats stats;
+        stats.available = GetThreadDtlbCounter().Read().has_value();
+        stats.queries = dtlb_counters_.queries.load(memory_order_relaxed);
+        stats.dtlb_misses = dtlb_counters_.dtlb_misses.load(memory_order_relaxed);
+        return stats;
+    }
+
+    // Раз в check_interval сервер пересчитывает память своих подсистем и сообщает её
+    // бюджету. Если вместе с другими серверами бюджета лимит превышен, сервер вытесняет
+    // у себя то, что дешевле всего восстановить: журнал запросов, свободные массивы оценок,
+    // кэш порядка по рейтингу и горячие posting-листы, у которых есть копия в холодном файле.
+    // Копия есть только при включённом EnableTieredStorage: без него posting-листы не
+    // вытесняются, и бюджет может освободить лишь остальное
+    void EnableMemoryBudget(shared_ptr<MemoryBudget> budget, chrono::milliseconds check_interval = chrono::milliseconds(500)) {
+        DisableMemoryBudget();
+
+        {
+            lock_guard lock(memory_budget_mutex_);
+            memory_budget_ = move(budget);
+        }
+
+        stop_memory_budget_ = false;
+        memory_budget_thread_ = thread([this, check_interval] {
+            unique_lock thread_lock(memory_budget_thread_mutex_);
+            while (!memory_budget_cv_.wait_for(thread_lock, check_interval, [this] { return stop_memory_budget_; })) {
+                thread_lock.unlock();
+                EnforceMemoryBudget();
+                thread_lock.lock();
+            }
+        });
+    }
+
+    void DisableMemoryBudget() {
+        {
+            lock_guard lock(memory_budget_thread_mutex_);
+            stop_memory_budget_ = true;
+        }
+        memory_budget_cv_.notify_all();
+
+        if (memory_budget_thread_.joinable()) {
+            memory_budget_thread_.join();
+        }
+
+        lock_guard lock(memory_budget_mutex_);
+        if (memory_budget_) {
+            memory_budget_->UpdateUsage(reported_memory_usage_, {});
+            memory_budget_.reset();
+        }
+        reported_memory_usage_ = {};
+        budget_hot_postings_ = numeric_limits<size_t>::max();
+    }
+
+    // Одна проверка бюджета; возвращает число вытесненных байт
+    size_t EnforceMemoryBudget() {
+        lock_guard lock(memory_budget_mutex_);
+        if (!memory_budget_) {
+            return 0;
+        }
+
+        ReportMemoryUsage();
+        const size_t excess = memory_budget_->GetExcess();
+        if (excess == 0) {
+            // Освободившееся место снова можно занять горячими posting-листами
+            const size_t hot_postings = budget_hot_postings_.load(memory_order_relaxed);
+            if (hot_postings != numeric_limits<size_t>::max()) {
+                const size_t headroom_postings = memory_budget_->GetHeadroom() / POSTING_BYTES;
+                budget_hot_postings_ = hot_postings + min(numeric_limits<size_t>::max() - hot_postings, headroom_postings);
+            }
+            return 0;
+        }
+
+        const size_t evicted = EvictMemory(MemoryBudget::SelectEvictions(CollectEvictionCandidates(), excess));
+        ReportMemoryUsage();
+        return evicted;
+    }
+
+    // Память подсистем этого сервера на текущий момент и сколько он вытеснил по бюджету
+    MemoryUsage GetMemoryUsage() const {
+        MemoryUsage usage = MeasureMemoryUsage();
+        lock_guard lock(memory_budget_mutex_);
+        usage.evicted_bytes = evicted_memory_.evicted_bytes;
+        return usage;
+    }
+
+    TieredStorageStats GetTieredStorageStats() const {
+        shared_lock lock(index_mutex_);
+        TieredStorageStats stats;
+        stats.hot_lookups = tier_counters_.hot_lookups.load(memory_order_relaxed);
+        stats.cold_lookups = tier_counters_.cold_lookups.load(memory_order_relaxed);
+        stats.queries = tier_counters_.queries.load(memory_order_relaxed);
+        stats.page_faults = tier_counters_.page_faults.load(memory_order_relaxed);
+        stats.hot_words = word_to_document_freqs_.size();
+        if (cold_store_) {
+            for (const auto& [word, _] : cold_store_->GetWords()) {
+                stats.cold_words += word_to_document_freqs_.count(word) == 0 ? 1 : 0;
+            }
+        }
+
+        return stats;
+    }
+
+    // Все дальнейшие изменения индекса дописываются в журнал, который читают реплики
+    [[nodiscard]] bool EnableChangeLog(const string& path) {
+        struct stat file_stat;
+        const bool is_new = stat(path.c_str(), &file_stat) != 0 || file_stat.st_size == 0;
+        if (!is_new) {
+            // Дописывать можно только журнал того же формата
+            ifstream in(path, ios::binary);
+            char magic[sizeof(CHANGE_LOG_MAGIC)];
+            if (!in.read(magic, sizeof(magic)) || memcmp(magic, CHANGE_LOG_MAGIC, sizeof(magic)) != 0) {
+                return false;
+            }
+        }
+
+        auto change_log = make_unique<ofstream>(path, ios::binary | ios::app);
+        if (is_new) {
+            change_log->write(CHANGE_LOG_MAGIC, sizeof(CHANGE_LOG_MAGIC));
+            change_log->flush();
+        }
+        if (!*change_log) {
+            return false;
+        }
+
+        unique_lock lock(index_mutex_);
+        change_log_ = move(change_log);
+        return true;
+    }
+
+    void DisableChangeLog() {
+        unique_lock lock(index_mutex_);
+        change_log_.reset();
+    }
+
+    // Номер последнего изменения индекса; у реплики — номер последней применённой записи журнала
+    uint64_t GetChangeLogSequence() const {
+        shared_lock lock(index_mutex_);
+        return change_log_sequence_;
+    }
+
+    // Снимок для начальной загрузки реплики: стоп-слова, словарь, таблица документов и
+    // posting-листы вместе с номером журнала, на котором он сделан. Секции кодируются
+    // параллельно по копии индекса, поэтому сервер во время записи не блокируется
+    [[nodiscard]] bool SaveSnapshot(const string& path) const {
+        return Snapshot()->WriteSnapshotFile(path);
+    }
+
+    // Загружает снимок в пустой сервер; после этого реплика продолжает с того же номера журнала.
+    // Если хотя бы одна секция повреждена, сервер не меняется
+    [[nodiscard]] bool LoadSnapshot(const string& path) {
+        string data;
+        {
+            ifstream in(path, ios::binary | ios::ate);
+            if (!in) {
+                return false;
+            }
+            data.resize(in.tellg());
+            in.seekg(0);
+            if (!in.read(data.data(), data.size())) {
+                return false;
+            }
+        }
+
+        SnapshotHeader header;
+        if (data.size() < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        const uint64_t table_size = static_cast<uint64_t>(header.section_count) * sizeof(SnapshotSectionEntry);
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || data.size() - sizeof(header) < table_size
+            || ComputeCrc32c(data.data() + sizeof(header), table_size) != header.table_crc) {
+            return false;
+        }
+
+        vector<SnapshotSectionEntry> sections(header.section_count);
+        memcpy(sections.data(), data.data() + sizeof(header), table_size);
+        for (const SnapshotSectionEntry& section : sections) {
+            if (section.offset > data.size() || section.size > data.size() - section.offset) {
+                return false;
+            }
+        }
+
+        atomic<bool> valid = true;
+        ParallelFor(sections.size(), [&](size_t i) {
+            if (ComputeCrc32c(data.data() + sections[i].offset, sections[i].size) != sections[i].crc) {
+                valid = false;
+            }
+        });
+        if (!valid) {
+            return false;
+        }
+
+        const auto open_section = [&data](const SnapshotSectionEntry& section) {
+            return SectionReader(data.data() + section.offset, data.data() + section.offset + section.size);
+        };
+
+        set<string> stop_words;
+        set<string> auto_stop_words;
+        vector<string> dictionary;
+        for (const SnapshotSectionEntry& section : sections) {
+            SectionReader reader = open_section(section);
+            if (section.type == static_cast<uint32_t>(SnapshotSectionType::STOP_WORDS)) {
+                for (set<string>* words : {&stop_words, &auto_stop_words}) {
+                    for (uint64_t count = reader.ReadVarint(); count > 0 && !reader.IsFailed(); --count) {
+                        words->insert(reader.ReadString());
+                    }
+                }
+            } else if (section.type == static_cast<uint32_t>(SnapshotSectionType::DICTIONARY)) {
+                for (uint64_t count = reader.ReadVarint(); count > 0 && !reader.IsFailed(); --count) {
+                    dictionary.push_back(reader.ReadString());
+                }
+            } else {
+                continue;
+            }
+
+            if (!reader.IsComplete()) {
+                return false;
+            }
+        }
+
+        struct LoadedWord {
+            uint64_t term_id;
+            size_t document_count;
+            double max_term_freq;
+            DocumentFreqs document_freqs;
+        };
+
+        struct LoadedDocument {
+            int document_id;
+            int64_t timestamp;
+            DocumentData document_data;
+        };
+
+        vector<vector<LoadedDocument>> documents(sections.size());
+        vector<vector<LoadedWord>> words(sections.size());
+        ParallelFor(sections.size(), [&](size_t i) {
+            SectionReader reader = open_section(sections[i]);
+            if (sections[i].type == static_cast<uint32_t>(SnapshotSectionType::DOCUMENTS)) {
+                int64_t document_id = 0;
+                for (uint64_t count = reader.ReadVarint(); count > 0 && !reader.IsFailed(); --count) {
+                    document_id += reader.ReadVarint();
+                    DocumentData document_data;
+                    document_data.rating = static_cast<int>(DecodeZigZag(reader.ReadVarint()));
+                    document_data.status = static_cast<DocumentStatus>(reader.ReadVarint());
+                    document_data.tenant = static_cast<uint32_t>(reader.ReadVarint());
+                    const int64_t timestamp = DecodeZigZag(reader.ReadVarint());
+                    // Пока снимок не принят, слова документа — номера в словаре снимка
+                    document_data.words.resize(reader.ReadVarint());
+                    for (TermId& word : document_data.words) {
+                        const uint64_t term_id = reader.ReadVarint();
+                        if (term_id >= dictionary.size()) {
+                            valid = false;
+                            return;
+                        }
+                        word = static_cast<TermId>(term_id);
+                    }
+                    documents[i].push_back({static_cast<int>(document_id), timestamp, move(document_data)});
+                }
+            } else if (sections[i].type == static_cast<uint32_t>(SnapshotSectionType::POSTINGS)) {
+                uint64_t term_id = 0;
+                for (uint64_t count = reader.ReadVarint(); count > 0 && !reader.IsFailed(); --count) {
+                    LoadedWord word{term_id += reader.ReadVarint(), reader.ReadVarint(), 0.0, {}};
+                    int64_t document_id = 0;
+                    for (uint64_t postings = reader.ReadVarint(); postings > 0 && !reader.IsFailed(); --postings) {
+                        document_id += reader.ReadVarint();
+                        const double term_freq = reader.ReadDouble();
+                        word.document_freqs.emplace_hint(word.document_freqs.end(), static_cast<int>(document_id), term_freq);
+                        word.max_term_freq = max(word.max_term_freq, term_freq);
+                    }
+                    if (word.term_id >= dictionary.size()) {
+                        valid = false;
+                        return;
+                    }
+                    words[i].push_back(move(word));
+                }
+            } else {
+                return;
+            }
+
+            if (!reader.IsComplete()) {
+                valid = false;
+            }
+        });
+        if (!valid) {
+            return false;
+        }
+
+        // Словарь общий с другими серверами, поэтому слова снимка попадают в него, только
+        // когда снимок проверен целиком и сервер точно его примет
+        unique_lock lock(index_mutex_);
+        if (!documents_.empty()) {
+            return false;
+        }
+
+        const vector<TermId> terms = InternWords(dictionary);
+        ParallelFor(documents.size(), [&](size_t i) {
+            for (auto& [document_id, timestamp, document_data] : documents[i]) {
+                for (TermId& word : document_data.words) {
+                    word = terms[word];
+                }
+            }
+        });
+
+        set<TermId> stop_word_ids = *stop_words_;
+        for (const TermId word : InternWords({stop_words.begin(), stop_words.end()})) {
+            stop_word_ids.insert(word);
+        }
+        stop_words_ = terms_->InternStopWords(move(stop_word_ids));
+        for (const TermId word : InternWords({auto_stop_words.begin(), auto_stop_words.end()})) {
+            auto_stop_words_.insert(word);
+        }
+        for (auto& section_documents : documents) {
+            for (auto& [document_id, timestamp, document_data] : section_documents) {
+                document_metadata_.Set(document_id, document_data.rating, document_data.status);
+                if (timestamp != 0) {
+                    document_metadata_.SetTimestamp(document_id, timestamp);
+                }
+                tenants_[document_data.tenant].Add(document_id);
+                documents_.Emplace(document_id, move(document_data));
+            }
+        }
+        for (auto& section_words : words) {
+            for (LoadedWord& word : section_words) {
+                const TermId term = terms[word.term_id];
+                if (word.document_count != word.document_freqs.size()) {
+                    pruned_word_document_counts_[term] = word.document_count;
+                }
+                word_to_max_term_freq_[term] = word.max_term_freq;
+                word_to_document_freqs_.Emplace(term, move(word.document_freqs));
+            }
+        }
+        change_log_sequence_ = header.sequence;
+        InvalidateRatingOrder();
+
+        return true;
+    }
+
+    // Неизменяемый снимок индекса на текущий момент. Снимок делит с сервером шарды словарей
+    // и куски таблицы документов, поэтому создаётся без копирования posting-листов;
+    // последующая запись в сервер копирует только затронутые шарды и posting-листы
+    shared_ptr<const SearchServer> Snapshot() const {
+        return shared_ptr<const SearchServer>(new SearchServer(*this, SnapshotTag()));
+    }
+
+    // Изменяемая копия сервера, например для проверки другого набора стоп-слов.
+    // Журнал запросов, счётчики и фоновое перераспределение уровней не копируются
+    unique_ptr<SearchServer> Fork() const {
+        return unique_ptr<SearchServer>(new SearchServer(*this, SnapshotTag()));
+    }
+
+private:
+    friend class MappedIndex;
+    friend class ChangeLogFollower;
+
+    struct SnapshotTag {};
+
+    struct DtlbCounters {
+        atomic<uint64_t> queries = 0;
+        atomic<uint64_t> dtlb_misses = 0;
+    };
+
+    struct TierCounters {
+        atomic<uint64_t> hot_lookups = 0;
+        atomic<uint64_t> cold_lookups = 0;
+        atomic<uint64_t> queries = 0;
+        atomic<uint64_t> page_faults = 0;
+    };
+
+    struct DocumentData {
+        int rating;
+        DocumentStatus status;
+        uint32_t tenant;
+        vector<TermId> words;
+    };
+
+    shared_ptr<TermDictionary> terms_ = make_shared<TermDictionary>();
+    shared_ptr<const set<TermId>> stop_words_ = make_shared<const set<TermId>>();
+    set<TermId> auto_stop_words_;
+    CowMap<TermId, DocumentFreqs> word_to_document_freqs_;
+    CowMap<int, DocumentData> documents_;
+    DocumentMetadataTable document_metadata_;
+    CowMap<TermId, size_t> pruned_word_document_counts_;
+    CowMap<TermId, double> word_to_max_term_freq_;
+    mutable mutex rating_order_mutex_;
+    mutable shared_ptr<const vector<int>> documents_by_rating_;
+    CowMap<TermId, DocumentFreqs> cold_word_to_document_freqs_;
+    CowMap<uint32_t, TenantDocuments> tenants_;
+    mutable shared_mutex index_mutex_;
+    mutable mutex reindex_mutex_;
+    shared_future<void> reindex_future_;
+
+    optional<TieredStorageOptions> tiered_options_;
+    unique_ptr<ColdPostingStore> cold_store_;
+    mutable TierCounters tier_counters_;
+    thread tier_rebalancer_;
+    mutex tier_rebalancer_mutex_;
+    condition_variable tier_rebalancer_cv_;
+    bool stop_tier_rebalancer_ = false;
+
+    // Размер узла posting-листа вместе с накладными расходами красно-чёрного дерева
+    static constexpr size_t POSTING_BYTES = sizeof(DocumentFreqs::value_type) + 4 * sizeof(void*);
+    // Чтение posting-а из холодного файла относительно одного сравнения при сортировке
+    static constexpr double COLD_POSTING_READ_COST = 4.0;
+    // Повторное выделение и заполнение байта массива оценок: он дешевле любого posting-а
+    static constexpr double SCORE_BUFFER_FILL_COST = 0.01;
+
+    mutable mutex memory_budget_mutex_;
+    shared_ptr<MemoryBudget> memory_budget_;
+    MemoryUsage reported_memory_usage_;
+    MemoryUsage evicted_memory_;
+    // Сколько posting-ов фоновый перебор уровней может держать в памяти по бюджету
+    atomic<size_t> budget_hot_postings_ = numeric_limits<size_t>::max();
+    thread memory_budget_thread_;
+    mutex memory_budget_thread_mutex_;
+    condition_variable memory_budget_cv_;
+    bool stop_memory_budget_ = false;
+
+    using ScoreBuffer = vector<double, HugePageAllocator<double>>;
+
+    // Плотные массивы оценок принадлежат серверу, чтобы их память шла в его бюджет:
+    // запрос берёт массив из пула и возвращает после выборки совпадений
+    class ScoreBufferLease {
+    public:
+        ScoreBufferLease(const SearchServer& server, size_t id_range)
+            : server_(server) {
+            {
+                lock_guard lock(server_.score_buffers_mutex_);
+                if (!server_.score_buffers_.empty()) {
+                    buffer_ = move(server_.score_buffers_.back());
+                    server_.score_buffers_.pop_back();
+                }
+            }
+            // Массив, выросший под больший диапазон id, не держим: он вдвое больше нужного
+            if (buffer_.capacity() > 2 * id_range) {
+                buffer_ = ScoreBuffer();
+            }
+            buffer_.assign(id_range, -0.0);
+            server_.scratch_bytes_ += buffer_.capacity() * sizeof(double);
+        }
+
+        ScoreBufferLease(const ScoreBufferLease&) = delete;
+        ScoreBufferLease& operator=(const ScoreBufferLease&) = delete;
+
+        ~ScoreBufferLease() {
+            server_.scratch_bytes_ -= buffer_.capacity() * sizeof(double);
+            lock_guard lock(server_.score_buffers_mutex_);
+            server_.score_buffers_.push_back(move(buffer_));
+        }
+
+        double* GetData() {
+            return buffer_.data();
+        }
+
+    private:
+        const SearchServer& server_;
+        ScoreBuffer buffer_;
+    };
+
+    // Временный буфер запроса учитывается в бюджете, пока жив
+    class ScratchCharge {
+    public:
+        explicit ScratchCharge(atomic<size_t>& scratch_bytes)
+            : scratch_bytes_(scratch_bytes) {
+        }
+
+        ScratchCharge(const ScratchCharge&) = delete;
+        ScratchCharge& operator=(const ScratchCharge&) = delete;
+
+        ~ScratchCharge() {
+            scratch_bytes_ -= bytes_;
+        }
+
+        void Set(size_t bytes) {
+            scratch_bytes_ += bytes;
+            scratch_bytes_ -= bytes_;
+            bytes_ = bytes;
+        }
+
+    private:
+        atomic<size_t>& scratch_bytes_;
+        size_t bytes_ = 0;
+    };
+
+    mutable mutex score_buffers_mutex_;
+    mutable vector<ScoreBuffer> score_buffers_;
+    // Массивы и буферы, которыми сейчас пользуются запросы; свободные массивы пула считаются отдельно
+    mutable atomic<size_t> scratch_bytes_ = 0;
+
+    mutable QueryLog query_log_{QUERY_LOG_SIZE};
+    atomic<bool> ready_ = true;
+
+    atomic<bool> dtlb_counters_enabled_ = false;
+    mutable DtlbCounters dtlb_counters_;
+
+    struct BufferedDocument {
+        int document_id;
+        int rating;
+        DocumentStatus status;
+        uint32_t tenant;
+        vector<TermId> words;
+        chrono::steady_clock::time_point added_at;
+        uint64_t sequence = 0;
+        int64_t timestamp_us = 0;
+    };
+
+    // Документ ждёт публикации в полосе, выбранной по его номеру; у каждой полосы свой
+    // мьютекс, так что добавляющие потоки почти не мешают друг другу
+    struct alignas(64) IngestStripe {
+        mutable mutex buffer_mutex;
+        vector<BufferedDocument> buffer;
+        unordered_set<int> pending_document_ids;
+        uint64_t documents_added = 0;
+    };
+
+    static constexpr size_t INGEST_STRIPE_COUNT = 16;
+
+    // Режим записи меняется под монопольной блокировкой, а добавления держат разделяемую
+    shared_mutex ingest_mode_mutex_;
+    mutable mutex ingest_mutex_;
+    condition_variable ingest_cv_;
+    optional<BufferedIngestOptions> ingest_options_;
+    array<IngestStripe, INGEST_STRIPE_COUNT> ingest_stripes_;
+    atomic<size_t> buffered_document_count_ = 0;
+    mutex publish_mutex_;
+    IngestStats ingest_stats_;
+    chrono::steady_clock::time_point ingest_started_;
+    thread refresher_;
+    bool stop_refresher_ = false;
+
+    struct BatchedQuery {
+        string raw_query;
+        DocumentStatus status;
+        chrono::steady_clock::time_point arrived_at;
+        promise<optional<vector<Document>>> result;
+    };
+
+    mutable mutex query_batch_mutex_;
+    mutable condition_variable query_batch_cv_;
+    optional<QueryBatchingOptions> query_batching_options_;
+    mutable vector<BatchedQuery> query_batch_;
+    mutable QueryBatchingStats query_batching_stats_;
+    thread query_batcher_;
+    bool stop_query_batcher_ = false;
+
+    unique_ptr<ofstream> change_log_;
+    uint64_t change_log_sequence_ = 0;
+
+    SearchServer(const SearchServer& other, SnapshotTag) {
+        shared_lock lock(other.index_mutex_);
+        terms_ = other.terms_;
+        stop_words_ = other.stop_words_;
+        auto_stop_words_ = other.auto_stop_words_;
+        word_to_document_freqs_ = other.word_to_document_freqs_;
+        documents_ = other.documents_;
+        document_metadata_ = other.document_metadata_;
+        pruned_word_document_counts_ = other.pruned_word_document_counts_;
+        word_to_max_term_freq_ = other.word_to_max_term_freq_;
+        cold_word_to_document_freqs_ = other.cold_word_to_document_freqs_;
+        tenants_ = other.tenants_;
+        change_log_sequence_ = other.change_log_sequence_;
+        {
+            lock_guard rating_lock(other.rating_order_mutex_);
+            documents_by_rating_ = other.documents_by_rating_;
+        }
+        if (other.cold_store_) {
+            cold_store_ = make_unique<ColdPostingStore>(*other.cold_store_);
+        }
+    }
+
+    optional<TermId> FindTerm(string_view word) const {
+        return terms_->Find(word);
+    }
+
+    vector<TermId> InternWords(const vector<string>& words) const {
+        vector<TermId> terms;
+        terms.reserve(words.size());
+        for (const string& word : words) {
+            terms.push_back(terms_->Intern(word));
+        }
+        return terms;
+    }
+
+    set<string> GetTermStrings(const set<TermId>& terms) const {
+        set<string> words;
+        for (const TermId term : terms) {
+            words.emplace(terms_->GetTerm(term));
+        }
+        return words;
+    }
+
+    bool IsStopWord(TermId word) const {
+        return stop_words_->count(word) > 0 || auto_stop_words_.count(word) > 0;
+    }
+
+    bool IsStopWord(const string& word) const {
+        const optional<TermId> term = FindTerm(word);
+        return term && IsStopWord(*term);
+    }
+
+    map<TermId, double> ComputeTermFreqs(const vector<TermId>& words) const {
+        map<TermId, double> term_freqs;
+        size_t word_count = 0;
+
+        for (const TermId word : words) {
+            if (!IsStopWord(word)) {
+                term_freqs[word] += 1.0;
+                ++word_count;
+            }
+        }
+
+        for (auto& [word, term_freq] : term_freqs) {
+            term_freq /= word_count;
+        }
+
+        return term_freqs;
+    }
+
+    void ScheduleReindex(set<int> document_ids, set<TermId> restored_words) {
+        if (document_ids.empty() && restored_words.empty()) {
+            return;
+        }
+
+        lock_guard lock(reindex_mutex_);
+        reindex_future_ = async(launch::async,
+            [this, document_ids = move(document_ids), restored_words = move(restored_words), previous = reindex_future_]() mutable {
+                if (previous.valid()) {
+                    previous.wait();
+                }
+
+                if (!restored_words.empty()) {
+                    shared_lock index_lock(index_mutex_);
+                    for (const auto& [document_id, document_data] : documents_) {
+                        if (any_of(document_data.words.begin(), document_data.words.end(), [&restored_words](TermId word) {
+                                return restored_words.count(word) > 0;
+                            })) {
+                            document_ids.insert(document_id);
+                        }
+                    }
+                }
+
+                ReindexDocuments(document_ids, restored_words);
+            }).share();
+    }
+
+    // Переписывает только posting-и, которые уже были в индексе, и posting-и вернувшихся слов:
+    // удалённые PruneIndex пары (слово, документ) не восстанавливаются
+    void ReindexDocuments(const set<int>& document_ids, const set<TermId>& restored_words) {
+        const vector<int> ids(document_ids.begin(), document_ids.end());
+
+        for (size_t batch_begin = 0; batch_begin < ids.size(); batch_begin += REINDEX_BATCH_SIZE) {
+            const size_t batch_end = min(ids.size(), batch_begin + REINDEX_BATCH_SIZE);
+
+            vector<pair<int, map<TermId, double>>> batch;
+            {
+                shared_lock lock(index_mutex_);
+                for (size_t i = batch_begin; i < batch_end; ++i) {
+                    if (const DocumentData* document_data = documents_.Find(ids[i])) {
+                        batch.emplace_back(ids[i], ComputeTermFreqs(document_data->words));
+                    }
+                }
+            }
+
+            unique_lock lock(index_mutex_);
+            for (const auto& [document_id, term_freqs] : batch) {
+                set<TermId> indexed_words;
+                for (const TermId word : documents_.At(document_id).words) {
+                    PrepareWordForWrite(word);
+                    const DocumentFreqs* postings = word_to_document_freqs_.Find(word);
+                    if (postings == nullptr || postings->count(document_id) == 0) {
+                        continue;
+                    }
+
+                    indexed_words.insert(word);
+                    DocumentFreqs& document_freqs = *word_to_document_freqs_.FindMutable(word);
+                    document_freqs.erase(document_id);
+                    if (document_freqs.empty()) {
+                        word_to_document_freqs_.Erase(word);
+                    }
+                }
+
+                for (const auto& [word, term_freq] : term_freqs) {
+                    if (indexed_words.count(word) == 0 && restored_words.count(word) == 0) {
+                        continue;
+                    }
+                    PrepareWordForWrite(word);
+                    word_to_document_freqs_[word][document_id] = term_freq;
+                    UpdateMaxTermFreq(word, term_freq);
+                }
+            }
+        }
+    }
+
+    // Ненулевые sequence и timestamp_us приходят из журнала основного сервера
+    void SetStopWords(const vector<string>& words, uint64_t sequence, int64_t timestamp_us) {
+        const vector<TermId> terms = InternWords(words);
+        set<int> affected_documents;
+        {
+            unique_lock lock(index_mutex_);
+            RecordChange(ChangeType::SET_STOP_WORDS, 0, 0, DocumentStatus::ACTUAL, 0, 0, terms, sequence, timestamp_us);
+            FlushChangeLog();
+            set<TermId> stop_words = *stop_words_;
+            for (const TermId word : terms) {
+                if (!stop_words.insert(word).second) {
+                    continue;
+                }
+
+                PrepareWordForWrite(word);
+                if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+                    for (const auto& [document_id, _] : *document_freqs) {
+                        affected_documents.insert(document_id);
+                    }
+                    word_to_document_freqs_.Erase(word);
+                }
+                // Posting-и стоп-слова удалены целиком; при возврате слово индексируется заново без прореживания
+                pruned_word_document_counts_.Erase(word);
+            }
+            stop_words_ = terms_->InternStopWords(move(stop_words));
+        }
+
+        ScheduleReindex(move(affected_documents), {});
+    }
+
+    void RemoveStopWords(const vector<string>& words, uint64_t sequence, int64_t timestamp_us) {
+        const vector<TermId> terms = InternWords(words);
+        set<TermId> restored_words;
+        {
+            unique_lock lock(index_mutex_);
+            RecordChange(ChangeType::REMOVE_STOP_WORDS, 0, 0, DocumentStatus::ACTUAL, 0, 0, terms, sequence, timestamp_us);
+            FlushChangeLog();
+            set<TermId> stop_words = *stop_words_;
+            for (const TermId word : terms) {
+                if (stop_words.erase(word) > 0) {
+                    restored_words.insert(word);
+                }
+            }
+            stop_words_ = terms_->InternStopWords(move(stop_words));
+        }
+
+        ScheduleReindex({}, move(restored_words));
+    }
+
+    // Прореживание смотрит на tf, поэтому сначала дожидается начатого пересчёта: иначе
+    // результат зависел бы от того, как далеко тот успел зайти, и реплика разошлась бы с основным
+    optional<PruningReport> PruneIndex(const PruningPolicy& policy, const vector<string>& sample_queries, uint64_t sequence, int64_t timestamp_us) {
+        WaitForReindex();
+        const auto is_actual = [](int, DocumentStatus status, int) { return status == DocumentStatus::ACTUAL; };
+        vector<vector<Document>> full_results;
+        for (const string& raw_query : sample_queries) {
+            optional<vector<Document>> documents = SearchTopDocuments(raw_query, is_actual, 0.0);
+            if (!documents.has_value()) {
+                return nullopt;
+            }
+            full_results.push_back(move(documents.value()));
+        }
+
+        PruningReport report;
+        unique_lock lock(index_mutex_);
+        report.words_before = CountWords();
+        report.postings_before = CountPostings();
+        report.bytes_before = MeasurePostingBytes();
+
+        // Сокращает posting-и слова по политике; true, если что-то отсечено
+        const auto prune_postings = [this, &policy](TermId word, vector<pair<int, double>>& postings) {
+            const size_t posting_count = postings.size();
+            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
+            postings.erase(remove_if(postings.begin(), postings.end(),
+                                     [&](const pair<int, double>& posting) {
+                                         return posting.second * inverse_document_freq < policy.min_contribution;
+                                     }),
+                           postings.end());
+
+            if (policy.max_postings_per_word > 0 && postings.size() > policy.max_postings_per_word) {
+                // idf у всех документов слова одинаковый, поэтому достаточно сравнить tf
+                nth_element(postings.begin(), postings.begin() + policy.max_postings_per_word, postings.end(),
+                            [](const pair<int, double>& lhs, const pair<int, double>& rhs) {
+                                return lhs.second > rhs.second;
+                            });
+                postings.resize(policy.max_postings_per_word);
+                // Холодные posting-и ищутся двоичным поиском по id
+                sort(postings.begin(), postings.end());
+            }
+
+            return postings.size() != posting_count;
+        };
+
+        // Запоминаем исходное число документов, чтобы idf после прореживания не менялся
+        map<TermId, size_t> document_counts;
+        map<TermId, vector<pair<int, double>>> pruned_hot_copies;
+        vector<TermId> hot_words;
+        for (const auto& [word, _] : word_to_document_freqs_) {
+            if (!cold_store_ || cold_store_->Find(word) == nullptr) {
+                hot_words.push_back(word);
+            }
+        }
+
+        // Холодный уровень переписывается по одному слову; горячие копии его слов
+        // заменяются, только когда новый файл записан
+        if (cold_store_) {
+            unique_ptr<ColdPostingStore> cold_store = cold_store_->Rewrite(
+                tiered_options_->path, [&](TermId word, vector<pair<int, double>>& postings) {
+                    const size_t document_count = GetWordDocumentCount(word);
+                    if (!prune_postings(word, postings)) {
+                        return;
+                    }
+                    document_counts[word] = document_count;
+                    if (word_to_document_freqs_.count(word) > 0) {
+                        pruned_hot_copies[word] = postings;
+                    }
+                });
+            if (!cold_store) {
+                return nullopt;
+            }
+            cold_store_ = move(cold_store);
+        }
+
+        RecordChange(ChangeType::PRUNE_INDEX, 0, 0, DocumentStatus::ACTUAL, 0, 0, {}, sequence, timestamp_us,
+                     policy.min_contribution, policy.max_postings_per_word);
+        FlushChangeLog();
+
+        for (const TermId word : hot_words) {
+            const DocumentFreqs& document_freqs = word_to_document_freqs_.At(word);
+            vector<pair<int, double>> postings(document_freqs.begin(), document_freqs.end());
+            const size_t document_count = GetWordDocumentCount(word);
+            if (prune_postings(word, postings)) {
+                document_counts[word] = document_count;
+                pruned_hot_copies[word] = move(postings);
+            }
+        }
+
+        for (const auto& [word, document_count] : document_counts) {
+            pruned_word_document_counts_[word] = document_count;
+        }
+        for (auto& [word, postings] : pruned_hot_copies) {
+            if (postings.empty()) {
+                word_to_document_freqs_.Erase(word);
+            } else {
+                word_to_document_freqs_[word] = DocumentFreqs(postings.begin(), postings.end());
+            }
+        }
+
+        report.words_after = CountWords();
+        report.postings_after = CountPostings();
+        report.bytes_after = MeasurePostingBytes();
+        lock.unlock();
+
+        if (!sample_queries.empty()) {
+            double overlap_sum = 0.0;
+            for (size_t i = 0; i < sample_queries.size(); ++i) {
+                overlap_sum += ComputeResultOverlap(full_results[i], SearchTopDocuments(sample_queries[i], is_actual, 0.0).value());
+            }
+            report.average_overlap = overlap_sum / sample_queries.size();
+        }
+
+        return report;
+    }
+
+    // Реплика получает из журнала уже найденные основным сервером слова и не ищет их заново
+    void AddAutoStopWords(const vector<string>& words, bool keep_cold_postings, uint64_t sequence, int64_t timestamp_us) {
+        const vector<TermId> terms = InternWords(words);
+        set<int> affected_documents;
+        {
+            unique_lock lock(index_mutex_);
+            affected_documents = AddAutoStopWords(terms, keep_cold_postings, sequence, timestamp_us);
+        }
+
+        ScheduleReindex(move(affected_documents), {});
+    }
+
+    // Вызывается под index_mutex_; возвращает документы, tf которых нужно пересчитать
+    set<int> AddAutoStopWords(const vector<TermId>& words, bool keep_cold_postings, uint64_t sequence, int64_t timestamp_us) {
+        RecordChange(ChangeType::ADD_AUTO_STOP_WORDS, 0, 0, DocumentStatus::ACTUAL, 0, 0, words, sequence, timestamp_us,
+                     0.0, keep_cold_postings ? 1 : 0);
+        FlushChangeLog();
+
+        set<int> affected_documents;
+        for (const TermId word : words) {
+            auto_stop_words_.insert(word);
+            // С холодного уровня в память поднимается только posting-лист этого слова
+            PrepareWordForWrite(word);
+            DocumentFreqs* document_freqs = word_to_document_freqs_.FindMutable(word);
+            if (document_freqs == nullptr) {
+                continue;
+            }
+            for (const auto& [document_id, _] : *document_freqs) {
+                affected_documents.insert(document_id);
+            }
+            if (keep_cold_postings) {
+                cold_word_to_document_freqs_[word] = move(*document_freqs);
+            }
+            word_to_document_freqs_.Erase(word);
+            // При возврате слово индексируется заново без прореживания
+            pruned_word_document_counts_.Erase(word);
+        }
+
+        return affected_documents;
+    }
+
+    void ClearAutoStopWords(uint64_t sequence, int64_t timestamp_us) {
+        set<TermId> restored_words;
+        {
+            unique_lock lock(index_mutex_);
+            RecordChange(ChangeType::CLEAR_AUTO_STOP_WORDS, 0, 0, DocumentStatus::ACTUAL, 0, 0, {}, sequence, timestamp_us);
+            FlushChangeLog();
+            for (const auto& [word, document_freqs] : cold_word_to_document_freqs_) {
+                PrepareWordForWrite(word);
+                word_to_document_freqs_[word].insert(document_freqs.begin(), document_freqs.end());
+            }
+
+            cold_word_to_document_freqs_.Clear();
+            restored_words.swap(auto_stop_words_);
+        }
+
+        ScheduleReindex({}, move(restored_words));
+    }
+
+    bool SetDocumentStatus(int document_id, DocumentStatus status, uint64_t sequence, int64_t timestamp_us) {
+        unique_lock lock(index_mutex_);
+        DocumentData* document_data = documents_.FindMutable(document_id);
+        if (document_data == nullptr) {
+            return false;
+        }
+
+        RecordChange(ChangeType::SET_STATUS, document_id, document_data->rating, status, document_data->tenant,
+                     document_metadata_.GetTimestamp(document_id), {}, sequence, timestamp_us);
+        FlushChangeLog();
+        document_data->status = status;
+        document_metadata_.Set(document_id, document_data->rating, status);
+        return true;
+    }
+
+    bool SetDocumentTimestamp(int document_id, int64_t timestamp, uint64_t sequence, int64_t timestamp_us) {
+        unique_lock lock(index_mutex_);
+        const DocumentData* document_data = documents_.Find(document_id);
+        if (document_data == nullptr) {
+            return false;
+        }
+
+        RecordChange(ChangeType::SET_TIMESTAMP, document_id, document_data->rating, document_data->status, document_data->tenant,
+                     timestamp, {}, sequence, timestamp_us);
+        FlushChangeLog();
+        document_metadata_.SetTimestamp(document_id, timestamp);
+        return true;
+    }
+
+    // Присваивает изменению следующий номер и, если журнал включён, дописывает его туда.
+    // Реплика передаёт номер и время из журнала основного сервера, и они сохраняются как есть
+    void RecordChange(ChangeType type, int document_id, int rating, DocumentStatus status, uint32_t tenant,
+                      int64_t document_timestamp, const vector<TermId>& terms, uint64_t sequence = 0, int64_t timestamp_us = 0,
+                      double threshold = 0.0, uint64_t limit = 0) {
+        change_log_sequence_ = sequence == 0 ? change_log_sequence_ + 1 : sequence;
+        if (!change_log_) {
+            return;
+        }
+
+        vector<string_view> words;
+        words.reserve(terms.size());
+        for (const TermId term : terms) {
+            words.push_back(terms_->GetTerm(term));
+        }
+
+        const ChangeRecordHeader header{static_cast<uint32_t>(type), document_id, rating, static_cast<int32_t>(status), tenant, 0,
+                                        document_timestamp, change_log_sequence_, timestamp_us == 0 ? GetTimestampUs() : timestamp_us,
+                                        threshold, limit, static_cast<uint32_t>(words.size()), 0};
+        const string record = EncodeChangeRecord(header, words);
+        change_log_->write(record.data(), record.size());
+    }
+
+    // Вызывается у неизменяемого снимка, поэтому работает без блокировок
+    bool WriteSnapshotFile(const string& path) const {
+        vector<int> document_ids;
+        document_metadata_.ForEachPresent([&document_ids](int document_id) {
+            document_ids.push_back(document_id);
+            return true;
+        });
+
+        vector<TermId> posting_words;
+        ForEachWord([&posting_words](TermId word) {
+            posting_words.push_back(word);
+        });
+
+        // Словарь общий с другими серверами, поэтому в файл слова попадают со своими
+        // номерами: только встречающиеся в этом индексе и по алфавиту
+        unordered_map<TermId, uint32_t> term_ids;
+        for (const TermId word : posting_words) {
+            term_ids.emplace(word, 0);
+        }
+        for (const int document_id : document_ids) {
+            for (const TermId word : documents_.At(document_id).words) {
+                term_ids.emplace(word, 0);
+            }
+        }
+        vector<pair<string_view, TermId>> dictionary;
+        dictionary.reserve(term_ids.size());
+        for (const auto& [word, _] : term_ids) {
+            dictionary.emplace_back(terms_->GetTerm(word), word);
+        }
+        sort(dictionary.begin(), dictionary.end());
+        for (uint32_t term_id = 0; term_id < dictionary.size(); ++term_id) {
+            term_ids[dictionary[term_id].second] = term_id;
+        }
+
+        struct Section {
+            SnapshotSectionType type;
+            size_t begin;
+            size_t end;
+            string data;
+            uint32_t crc;
+        };
+
+        vector<Section> sections;
+        sections.push_back({SnapshotSectionType::STOP_WORDS, 0, 0, {}, 0});
+        sections.push_back({SnapshotSectionType::DICTIONARY, 0, 0, {}, 0});
+        for (size_t begin = 0; begin < document_ids.size(); begin += SNAPSHOT_SECTION_ITEMS) {
+            sections.push_back({SnapshotSectionType::DOCUMENTS, begin, min(document_ids.size(), begin + SNAPSHOT_SECTION_ITEMS), {}, 0});
+        }
+        for (size_t begin = 0; begin < posting_words.size(); begin += SNAPSHOT_SECTION_ITEMS) {
+            sections.push_back({SnapshotSectionType::POSTINGS, begin, min(posting_words.size(), begin + SNAPSHOT_SECTION_ITEMS), {}, 0});
+        }
+
+        ParallelFor(sections.size(), [&](size_t i) {
+            Section& section = sections[i];
+            string& out = section.data;
+            switch (section.type) {
+            case SnapshotSectionType::STOP_WORDS:
+                for (const set<TermId>* words : {stop_words_.get(), &auto_stop_words_}) {
+                    AppendVarint(out, words->size());
+                    for (const string& word : GetTermStrings(*words)) {
+                        AppendString(out, word);
+                    }
+                }
+                break;
+            case SnapshotSectionType::DICTIONARY:
+                AppendVarint(out, dictionary.size());
+                for (const auto& [word, _] : dictionary) {
+                    AppendString(out, word);
+                }
+                break;
+            case SnapshotSectionType::DOCUMENTS: {
+                AppendVarint(out, section.end - section.begin);
+                int previous_id = 0;
+                for (size_t j = section.begin; j < section.end; ++j) {
+                    const DocumentData& document_data = documents_.At(document_ids[j]);
+                    AppendVarint(out, document_ids[j] - previous_id);
+                    AppendVarint(out, EncodeZigZag(document_data.rating));
+                    AppendVarint(out, static_cast<uint64_t>(document_data.status));
+                    AppendVarint(out, document_data.tenant);
+                    AppendVarint(out, EncodeZigZag(document_metadata_.GetTimestamp(document_ids[j])));
+                    AppendVarint(out, document_data.words.size());
+                    for (const TermId word : document_data.words) {
+                        AppendVarint(out, term_ids.at(word));
+                    }
+                    previous_id = document_ids[j];
+                }
+                break;
+            }
+            case SnapshotSectionType::POSTINGS: {
+                AppendVarint(out, section.end - section.begin);
+                uint32_t previous_term_id = 0;
+                vector<pair<int, double>> postings;
+                for (size_t j = section.begin; j < section.end; ++j) {
+                    const TermId word = posting_words[j];
+                    const uint32_t term_id = term_ids.at(word);
+                    postings.clear();
+                    ForEachPosting(word, [&postings](int document_id, double term_freq) {
+                        postings.emplace_back(document_id, term_freq);
+                    });
+
+                    AppendVarint(out, term_id - previous_term_id);
+                    AppendVarint(out, GetWordDocumentCount(word));
+                    AppendVarint(out, postings.size());
+                    int previous_id = 0;
+                    for (const auto& [document_id, term_freq] : postings) {
+                        AppendVarint(out, document_id - previous_id);
+                        AppendDouble(out, term_freq);
+                        previous_id = document_id;
+                    }
+                    previous_term_id = term_id;
+                }
+                break;
+            }
+            }
+            section.crc = ComputeCrc32c(out.data(), out.size());
+        });
+
+        vector<SnapshotSectionEntry> table;
+        uint64_t offset = sizeof(SnapshotHeader) + sections.size() * sizeof(SnapshotSectionEntry);
+        for (const Section& section : sections) {
+            table.push_back({static_cast<uint32_t>(section.type), section.crc, offset, section.data.size()});
+            offset += section.data.size();
+        }
+
+        SnapshotHeader header = {};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.sequence = change_log_sequence_;
+        header.section_count = table.size();
+        header.table_crc = ComputeCrc32c(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotSectionEntry));
+
+        const string temp_path = path + ".tmp"s;
+        {
+            ofstream out(temp_path, ios::binary | ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotSectionEntry));
+            for (const Section& section : sections) {
+                out.write(section.data.data(), section.data.size());
+            }
+            if (!out) {
+                return false;
+            }
+        }
+
+        return rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    void FlushChangeLog() {
+        if (change_log_) {
+            change_log_->flush();
+        }
+    }
+
+    // Применяет записи журнала по порядку; подряд идущие добавления вставляются одной пачкой
+    void ApplyChanges(vector<ChangeRecord>& records) {
+        vector<BufferedDocument> batch;
+        const auto apply_batch = [this, &batch] {
+            if (!batch.empty()) {
+                ApplyDocumentBatch(batch);
+                batch.clear();
+            }
+        };
+
+        for (ChangeRecord& record : records) {
+            switch (record.type) {
+            case ChangeType::ADD_DOCUMENT:
+                batch.push_back({record.document_id, record.rating, record.status, record.tenant, InternWords(record.words),
+                                 chrono::steady_clock::now(), record.sequence, record.timestamp_us});
+                break;
+            case ChangeType::SET_STATUS:
+                apply_batch();
+                SetDocumentStatus(record.document_id, record.status, record.sequence, record.timestamp_us);
+                break;
+            case ChangeType::SET_TIMESTAMP:
+                apply_batch();
+                SetDocumentTimestamp(record.document_id, record.document_timestamp, record.sequence, record.timestamp_us);
+                break;
+            case ChangeType::SET_STOP_WORDS:
+                apply_batch();
+                SetStopWords(record.words, record.sequence, record.timestamp_us);
+                break;
+            case ChangeType::REMOVE_STOP_WORDS:
+                apply_batch();
+                RemoveStopWords(record.words, record.sequence, record.timestamp_us);
+                break;
+            case ChangeType::PRUNE_INDEX:
+                apply_batch();
+                PruneIndex({record.threshold, static_cast<size_t>(record.limit)}, {}, record.sequence, record.timestamp_us);
+                break;
+            case ChangeType::ADD_AUTO_STOP_WORDS:
+                apply_batch();
+                AddAutoStopWords(record.words, record.limit != 0, record.sequence, record.timestamp_us);
+                break;
+            case ChangeType::CLEAR_AUTO_STOP_WORDS:
+                apply_batch();
+                ClearAutoStopWords(record.sequence, record.timestamp_us);
+                break;
+            }
+        }
+
+        apply_batch();
+    }
+
+    // Вставляет пачку уже разбитых на слова документов
+    IngestStripe& GetIngestStripe(int document_id) {
+        return ingest_stripes_[static_cast<size_t>(document_id) % INGEST_STRIPE_COUNT];
+    }
+
+    // Сливает полосы в одну пачку и делает её видимой поиску. Вызывается под publish_mutex_
+    vector<BufferedDocument> PublishBufferedDocuments() {
+        vector<BufferedDocument> batch;
+        for (IngestStripe& stripe : ingest_stripes_) {
+            lock_guard stripe_lock(stripe.buffer_mutex);
+            buffered_document_count_.fetch_sub(stripe.buffer.size(), memory_order_relaxed);
+            move(stripe.buffer.begin(), stripe.buffer.end(), back_inserter(batch));
+            stripe.buffer.clear();
+        }
+
+        if (batch.empty()) {
+            return batch;
+        }
+
+        ApplyDocumentBatch(batch);
+
+        for (const BufferedDocument& document : batch) {
+            IngestStripe& stripe = GetIngestStripe(document.document_id);
+            lock_guard stripe_lock(stripe.buffer_mutex);
+            stripe.pending_document_ids.erase(document.document_id);
+        }
+
+        return batch;
+    }
+
+    // Ошибка пачки, например нехватка памяти, уходит ждущим её запросам через future,
+    // а не завершает поток сбора пачек
+    void ExecuteQueryBatch(vector<BatchedQuery>& batch) const {
+        vector<bool> answered(batch.size());
+        try {
+            RunQueryBatch(batch, answered);
+        } catch (...) {
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (!answered[i]) {
+                    batch[i].result.set_exception(current_exception());
+                }
+            }
+        }
+    }
+
+    // Каждый задетый пачкой документ получает строку оценок, по одной на запрос, так что
+    // posting общего слова обновляет соседние ячейки. -0.0 в ячейке означает «нет совпадений»,
+    // как в FindAllDocumentsDense, а -1.0 — документ исключён минус-словом. Номера строк
+    // ищутся по id в массиве на весь диапазон id, только если posting-ов пачки не меньше
+    // DENSE_ACCUMULATOR_MIN_DENSITY от него, иначе в хеш-таблице на число posting-ов.
+    // Слова пачки перебираются по алфавиту, как и внутри каждого запроса, поэтому суммы
+    // релевантности складываются в том же порядке, что и при одиночном поиске
+    void RunQueryBatch(vector<BatchedQuery>& batch, vector<bool>& answered) const {
+        constexpr uint32_t NO_ROW = numeric_limits<uint32_t>::max();
+
+        const size_t batch_size = batch.size();
+        vector<optional<Query>> queries(batch_size);
+        vector<uint32_t> dense_rows;
+        unordered_map<int, uint32_t> sparse_rows;
+        vector<int> row_documents;
+        vector<double> scores;
+        ScratchCharge scratch_charge(scratch_bytes_);
+        uint64_t posting_lists_requested = 0;
+        uint64_t posting_lists_scanned = 0;
+        {
+            shared_lock lock(index_mutex_);
+            map<TermId, vector<size_t>> plus_word_queries;
+            map<TermId, vector<size_t>> minus_word_queries;
+            for (size_t i = 0; i < batch_size; ++i) {
+                queries[i] = ParseQuery(batch[i].raw_query);
+                if (!IsValidWord(batch[i].raw_query) || !queries[i].has_value()) {
+                    queries[i].reset();
+                    continue;
+                }
+                for (const TermId word : queries[i]->plus_terms) {
+                    plus_word_queries[word].push_back(i);
+                }
+                for (const TermId word : queries[i]->minus_terms) {
+                    minus_word_queries[word].push_back(i);
+                }
+            }
+
+            vector<pair<string_view, TermId>> plus_words;
+            size_t posting_count = 0;
+            for (const auto& [word, _] : plus_word_queries) {
+                plus_words.emplace_back(terms_->GetTerm(word), word);
+                posting_count += GetPostingCount(word);
+            }
+            sort(plus_words.begin(), plus_words.end());
+
+            const size_t id_range = document_metadata_.GetChunkCount() << DocumentMetadataTable::CHUNK_SHIFT;
+            const bool use_dense_rows = id_range <= DENSE_ACCUMULATOR_MAX_IDS && posting_count >= id_range * DENSE_ACCUMULATOR_MIN_DENSITY;
+            if (use_dense_rows) {
+                dense_rows.assign(id_range, NO_ROW);
+            } else {
+                sparse_rows.reserve(posting_count);
+            }
+            const auto find_row = [&](int document_id) {
+                if (use_dense_rows) {
+                    return static_cast<size_t>(document_id) < dense_rows.size() ? dense_rows[document_id] : NO_ROW;
+                }
+                const auto it = sparse_rows.find(document_id);
+                return it == sparse_rows.end() ? NO_ROW : it->second;
+            };
+
+            for (const auto& [_, word] : plus_words) {
+                if (!HasWord(word)) {
+                    continue;
+                }
+
+                const vector<size_t>& word_queries = plus_word_queries.at(word);
+                posting_lists_requested += word_queries.size();
+                ++posting_lists_scanned;
+                const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
+                ForEachPosting(word, [&](int document_id, double term_freq) {
+                    uint32_t& row = use_dense_rows ? dense_rows[document_id] : sparse_rows.try_emplace(document_id, NO_ROW).first->second;
+                    if (row == NO_ROW) {
+                        row = static_cast<uint32_t>(row_documents.size());
+                        row_documents.push_back(document_id);
+                        scores.resize(scores.size() + batch_size, -0.0);
+                    }
+
+                    double* row_scores = scores.data() + static_cast<size_t>(row) * batch_size;
+                    for (const size_t query_index : word_queries) {
+                        row_scores[query_index] += term_freq * inverse_document_freq;
+                    }
+                });
+            }
+
+            for (const auto& [word, word_queries] : minus_word_queries) {
+                posting_lists_requested += word_queries.size();
+                ++posting_lists_scanned;
+                ForEachPosting(word, [&](int document_id, double) {
+                    const uint32_t row = find_row(document_id);
+                    if (row == NO_ROW) {
+                        return;
+                    }
+                    double* row_scores = scores.data() + static_cast<size_t>(row) * batch_size;
+                    for (const size_t query_index : word_queries) {
+                        row_scores[query_index] = -1.0;
+                    }
+                });
+            }
+
+            // Статус и наличие документа проверяются один раз на строку, а не на каждый posting.
+            // Строки перебираются по возрастанию id, как совпадения одиночного поиска
+            vector<uint32_t> rows;
+            rows.reserve(row_documents.size());
+            // Узел хеш-таблицы: пара, указатель на следующий узел и закэшированный хеш
+            scratch_charge.Set(dense_rows.capacity() * sizeof(uint32_t)
+                               + sparse_rows.bucket_count() * sizeof(void*)
+                               + sparse_rows.size() * (sizeof(pair<const int, uint32_t>) + 2 * sizeof(void*))
+                               + row_documents.capacity() * sizeof(int) + scores.capacity() * sizeof(double)
+                               + rows.capacity() * sizeof(uint32_t));
+            if (use_dense_rows) {
+                for (const uint32_t row : dense_rows) {
+                    if (row != NO_ROW) {
+                        rows.push_back(row);
+                    }
+                }
+            } else {
+                rows.resize(row_documents.size());
+                iota(rows.begin(), rows.end(), 0);
+                sort(rows.begin(), rows.end(), [&row_documents](uint32_t lhs, uint32_t rhs) {
+                    return row_documents[lhs] < row_documents[rhs];
+                });
+            }
+
+            vector<vector<Document>> results(batch_size);
+            for (const uint32_t row : rows) {
+                const int document_id = row_documents[row];
+                const double* row_scores = scores.data() + static_cast<size_t>(row) * batch_size;
+                const DocumentMetadata* metadata = document_metadata_.Find(document_id);
+                if (metadata == nullptr || !metadata->present) {
+                    continue;
+                }
+                const DocumentStatus status = metadata->GetStatus();
+                for (size_t i = 0; i < batch_size; ++i) {
+                    if (!signbit(row_scores[i]) && batch[i].status == status) {
+                        results[i].push_back({document_id, row_scores[i], metadata->rating});
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < batch_size; ++i) {
+                if (!queries[i].has_value()) {
+                    continue;
+                }
+                vector<Document>& result = results[i];
+                SortAndTruncateDocuments(result);
+                LogQuery(batch[i].raw_query);
+                batch[i].result.set_value(move(result));
+                answered[i] = true;
+            }
+        }
+
+        for (size_t i = 0; i < batch_size; ++i) {
+            if (!queries[i].has_value()) {
+                batch[i].result.set_value(nullopt);
+                answered[i] = true;
+            }
+        }
+
+        lock_guard lock(query_batch_mutex_);
+        ++query_batching_stats_.batches;
+        query_batching_stats_.queries += batch.size();
+        query_batching_stats_.posting_lists_requested += posting_lists_requested;
+        query_batching_stats_.posting_lists_scanned += posting_lists_scanned;
+    }
+
+    void ApplyDocumentBatch(vector<BufferedDocument>& batch) {
+        // tf считаются под разделяемой блокировкой, а монопольная нужна только на вставку.
+        // Если стоп-слова успели поменяться, tf пересчитываются
+        shared_ptr<const set<TermId>> stop_words;
+        set<TermId> auto_stop_words;
+        vector<map<TermId, double>> term_freqs;
+        term_freqs.reserve(batch.size());
+        {
+            shared_lock lock(index_mutex_);
+            stop_words = stop_words_;
+            auto_stop_words = auto_stop_words_;
+            for (const BufferedDocument& document : batch) {
+                term_freqs.push_back(ComputeTermFreqs(document.words));
+            }
+        }
+
+        {
+            unique_lock lock(index_mutex_);
+            if (stop_words != stop_words_ || auto_stop_words != auto_stop_words_) {
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    term_freqs[i] = ComputeTermFreqs(batch[i].words);
+                }
+            }
+
+            // Каждый posting-лист меняется один раз за пачку. Документы, которые уже есть
+            // в индексе, пропускаются: реплика может получить их и из снимка, и из журнала
+            map<TermId, vector<pair<int, double>>> word_postings;
+            vector<bool> skipped(batch.size());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                skipped[i] = documents_.count(batch[i].document_id) > 0;
+                if (skipped[i]) {
+                    continue;
+                }
+                for (const auto& [word, term_freq] : term_freqs[i]) {
+                    word_postings[word].emplace_back(batch[i].document_id, term_freq);
+                }
+            }
+
+            for (const auto& [word, postings] : word_postings) {
+                PrepareWordForWrite(word);
+                DocumentFreqs& document_freqs = word_to_document_freqs_[word];
+                for (const auto& [document_id, term_freq] : postings) {
+                    document_freqs[document_id] = term_freq;
+                    UpdateMaxTermFreq(word, term_freq);
+                }
+                if (size_t* document_count = pruned_word_document_counts_.FindMutable(word)) {
+                    *document_count += postings.size();
+                }
+            }
+
+            for (size_t i = 0; i < batch.size(); ++i) {
+                BufferedDocument& document = batch[i];
+                if (skipped[i]) {
+                    continue;
+                }
+                RecordChange(ChangeType::ADD_DOCUMENT, document.document_id, document.rating, document.status, document.tenant, 0,
+                             document.words, document.sequence, document.timestamp_us);
+                documents_.Emplace(document.document_id,
+                                   DocumentData{document.rating, document.status, document.tenant, move(document.words)});
+                document_metadata_.Set(document.document_id, document.rating, document.status);
+                tenants_[document.tenant].Add(document.document_id);
+            }
+            InvalidateRatingOrder();
+            FlushChangeLog();
+        }
+    }
+
+    static int ComputeAverageRating(const vector<int>& ratings) {
+        if (ratings.empty()) {
+            return 0;
+        }
+
+        int rating_sum = 0;
+        for (const int rating : ratings) {
+            rating_sum += rating;
+        }
+
+        return rating_sum / static_cast<int>(ratings.size());
+    }
+
+    struct QueryWord {
+        string data;
+        bool is_minus;
+        bool is_stop;
+    };
+
+    template <typename StopWordChecker>
+    static optional<QueryWord> ParseQueryWord(string text, StopWordChecker is_stop_word) {
+        if (!IsValidWord(text)) {
+            return nullopt;
+        }
+
+        bool is_minus = false;
+
+        if (text[0] == '-') {
+            if (text[1] == '-') {
+                return nullopt;
+            }
+
+            is_minus = true;
+            text = text.substr(1);
+        }
+
+        return QueryWord {text, is_minus, is_stop_word(text)};
+    }
+
+    struct Query {
+        set<string> plus_words;
+        set<string> minus_words;
+        // Номера слов запроса, известных словарю, в порядке plus_words и minus_words
+        vector<TermId> plus_terms;
+        vector<TermId> minus_terms;
+    };
+
+    // Каждое слово запроса ищется в словаре один раз, по одному хешу, а дальше
+    // поиск работает только с номерами слов
+    optional<Query> ParseQuery(const string& text) const {
+        optional<Query> query = ParseQuery(text, [](const string&) {
+            return false;
+        });
+        if (!query.has_value()) {
+            return nullopt;
+        }
+
+        const auto resolve = [this](set<string>& words, vector<TermId>& terms) {
+            for (auto it = words.begin(); it != words.end();) {
+                const optional<TermId> term = FindTerm(*it);
+                if (term.has_value() && IsStopWord(*term)) {
+                    it = words.erase(it);
+                    continue;
+                }
+                if (term.has_value()) {
+                    terms.push_back(*term);
+                }
+                ++it;
+            }
+        };
+        resolve(query->plus_words, query->plus_terms);
+        resolve(query->minus_words, query->minus_terms);
+
+        return query;
+    }
+
+    template <typename StopWordChecker>
+    static optional<Query> ParseQuery(const string& text, StopWordChecker is_stop_word) {
+        Query result;
+
+        for (const string& word : SplitIntoWords(text)) {
+            const optional<QueryWord> query_word = ParseQueryWord(word, is_stop_word);
+            if (!query_word.has_value()) {
+                return nullopt;
+            }
+
+            if (!query_word.value().is_stop) {
+                if (query_word.value().is_minus) {
+                    result.minus_words.insert(query_word.value().data);
+                } else {
+                    result.plus_words.insert(query_word.value().data);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    size_t GetWordDocumentCount(const string& word) const {
+        const optional<TermId> term = FindTerm(word);
+        return term ? GetWordDocumentCount(*term) : 0;
+    }
+
+    size_t GetWordDocumentCount(TermId word) const {
+        if (const size_t* document_count = pruned_word_document_counts_.Find(word)) {
+            return *document_count;
+        }
+
+        if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+            return document_freqs->size();
+        }
+
+        const ColdPostingStore::WordEntry* cold_entry = cold_store_ ? cold_store_->Find(word) : nullptr;
+        return cold_entry != nullptr ? cold_entry->count : 0;
+    }
+
+    bool HasWord(const string& word) const {
+        const optional<TermId> term = FindTerm(word);
+        return term && HasWord(*term);
+    }
+
+    bool HasWord(TermId word) const {
+        return word_to_document_freqs_.count(word) > 0 || (cold_store_ && cold_store_->Find(word) != nullptr);
+    }
+
+    template <typename Callback>
+    bool ForEachPosting(const string& word, Callback callback) const {
+        const optional<TermId> term = FindTerm(word);
+        return term && ForEachPosting(*term, callback);
+    }
+
+    template <typename Callback>
+    bool ForEachPosting(TermId word, Callback callback) const {
+        const ColdPostingStore::WordEntry* cold_entry = cold_store_ ? cold_store_->Find(word) : nullptr;
+        if (cold_entry != nullptr) {
+            cold_store_->RecordAccess(*cold_entry);
+        }
+
+        if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+            if (cold_store_) {
+                tier_counters_.hot_lookups.fetch_add(1, memory_order_relaxed);
+            }
+            for (const auto& [document_id, term_freq] : *document_freqs) {
+                callback(document_id, term_freq);
+            }
+            return true;
+        }
+
+        if (cold_entry == nullptr) {
+            return false;
+        }
+
+        tier_counters_.cold_lookups.fetch_add(1, memory_order_relaxed);
+        const auto [begin, end] = cold_store_->GetPostings(*cold_entry);
+        for (const ColdPostingStore::Posting* posting = begin; posting != end; ++posting) {
+            callback(posting->document_id, posting->term_freq);
+        }
+
+        return true;
+    }
+
+    // Раскладывает posting-лист в блоки по POSTING_BLOCK_SIZE id и tf,
+    // чтобы обработчик мог обращаться к метаданным документов пачкой
+    template <typename BlockCallback>
+    bool ForEachPostingBlock(TermId word, BlockCallback callback) const {
+        int document_ids[POSTING_BLOCK_SIZE];
+        double term_freqs[POSTING_BLOCK_SIZE];
+        size_t count = 0;
+
+        const bool found = ForEachPosting(word, [&](int document_id, double term_freq) {
+            document_ids[count] = document_id;
+            term_freqs[count] = term_freq;
+            if (++count == POSTING_BLOCK_SIZE) {
+                callback(document_ids, term_freqs, count);
+                count = 0;
+            }
+        });
+
+        if (count > 0) {
+            callback(document_ids, term_freqs, count);
+        }
+
+        return found;
+    }
+
+    // Posting-и слова с id документов из [begin, end)
+    template <typename Callback>
+    void ForEachPostingInRange(TermId word, int begin, int64_t end, Callback callback) const {
+        if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+            for (auto it = document_freqs->lower_bound(begin); it != document_freqs->end() && it->first < end; ++it) {
+                callback(it->first, it->second);
+            }
+            return;
+        }
+
+        const ColdPostingStore::WordEntry* cold_entry = cold_store_ ? cold_store_->Find(word) : nullptr;
+        if (cold_entry == nullptr) {
+            return;
+        }
+
+        cold_store_->RecordAccess(*cold_entry);
+        const auto [first, last] = cold_store_->GetPostings(*cold_entry);
+        auto posting = lower_bound(first, last, begin, [](const ColdPostingStore::Posting& posting, int id) {
+            return posting.document_id < id;
+        });
+        for (; posting != last && posting->document_id < end; ++posting) {
+            callback(posting->document_id, posting->term_freq);
+        }
+    }
+
+    // Число posting-ов, которые действительно хранятся (после прореживания оно меньше GetWordDocumentCount)
+    size_t GetPostingCount(TermId word) const {
+        if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+            return document_freqs->size();
+        }
+
+        const ColdPostingStore::WordEntry* cold_entry = cold_store_ ? cold_store_->Find(word) : nullptr;
+        return cold_entry != nullptr ? cold_entry->count : 0;
+    }
+
+    bool HasPosting(const string& word, int document_id) const {
+        return FindTermFreq(word, document_id).has_value();
+    }
+
+    bool HasPosting(TermId word, int document_id) const {
+        return FindTermFreq(word, document_id).has_value();
+    }
+
+    optional<double> FindTermFreq(const string& word, int document_id) const {
+        const optional<TermId> term = FindTerm(word);
+        return term ? FindTermFreq(*term, document_id) : nullopt;
+    }
+
+    optional<double> FindTermFreq(TermId word, int document_id) const {
+        if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+            const auto posting = document_freqs->find(document_id);
+            return posting == document_freqs->end() ? nullopt : optional<double>(posting->second);
+        }
+
+        const ColdPostingStore::WordEntry* cold_entry = cold_store_ ? cold_store_->Find(word) : nullptr;
+        if (cold_entry == nullptr) {
+            return nullopt;
+        }
+
+        cold_store_->RecordAccess(*cold_entry);
+        const auto [begin, end] = cold_store_->GetPostings(*cold_entry);
+        const auto it = lower_bound(begin, end, document_id, [](const ColdPostingStore::Posting& posting, int id) {
+            return posting.document_id < id;
+        });
+
+        return it != end && it->document_id == document_id ? optional<double>(it->term_freq) : nullopt;
+    }
+
+    void UpdateMaxTermFreq(TermId word, double term_freq) {
+        if (const double* max_term_freq = word_to_max_term_freq_.Find(word); max_term_freq == nullptr || *max_term_freq < term_freq) {
+            word_to_max_term_freq_[word] = term_freq;
+        }
+    }
+
+    // tf никогда не превышает 1, поэтому для слов без записи это безопасная верхняя граница
+    double GetMaxTermFreq(const string& word) const {
+        const optional<TermId> term = FindTerm(word);
+        return term ? GetMaxTermFreq(*term) : 1.0;
+    }
+
+    double GetMaxTermFreq(TermId word) const {
+        const double* max_term_freq = word_to_max_term_freq_.Find(word);
+        return max_term_freq == nullptr ? 1.0 : *max_term_freq;
+    }
+
+    // Обходит слова обоих уровней по возрастанию текста, каждое слово один раз
+    template <typename Callback>
+    void ForEachWord(Callback callback) const {
+        vector<pair<string_view, TermId>> words;
+        for (const auto& [word, _] : word_to_document_freqs_) {
+            words.emplace_back(terms_->GetTerm(word), word);
+        }
+        if (cold_store_) {
+            for (const auto& [word, _] : cold_store_->GetWords()) {
+                if (word_to_document_freqs_.count(word) == 0) {
+                    words.emplace_back(terms_->GetTerm(word), word);
+                }
+            }
+        }
+
+        sort(words.begin(), words.end());
+        for (const auto& [_, word] : words) {
+            callback(word);
+        }
+    }
+
+    // Слово, которое собираются изменить, поднимается в память, а его копия на диске забывается
+    void PrepareWordForWrite(TermId word) {
+        if (!cold_store_) {
+            return;
+        }
+
+        const ColdPostingStore::WordEntry* cold_entry = cold_store_->Find(word);
+        if (cold_entry == nullptr) {
+            return;
+        }
+
+        if (word_to_document_freqs_.count(word) == 0) {
+            word_to_document_freqs_.Emplace(word, cold_store_->Load(*cold_entry));
+        }
+        cold_store_->Forget(word);
+    }
+
+    void LoadColdPostings() {
+        if (!cold_store_) {
+            return;
+        }
+
+        for (const auto& [word, cold_entry] : cold_store_->GetWords()) {
+            if (word_to_document_freqs_.count(word) == 0) {
+                word_to_document_freqs_.Emplace(word, cold_store_->Load(cold_entry));
+            }
+        }
+        cold_store_.reset();
+    }
+
+    bool StoreColdPostings() {
+        if (!tiered_options_) {
+            return true;
+        }
+
+        cold_store_ = ColdPostingStore::Create(tiered_options_->path, word_to_document_freqs_);
+        if (!cold_store_) {
+            return false;
+        }
+
+        word_to_document_freqs_.Clear();
+        return true;
+    }
+
+    void RebalanceTiers() {
+        map<TermId, DocumentFreqs> promoted;
+        vector<TermId> demoted;
+        {
+            shared_lock lock(index_mutex_);
+            if (!cold_store_) {
+                return;
+            }
+
+            vector<pair<uint64_t, TermId>> ranked;
+            for (const auto& [word, cold_entry] : cold_store_->GetWords()) {
+                if (const uint64_t access_count = cold_store_->DecayAccessCount(cold_entry); access_count > 0) {
+                    ranked.emplace_back(access_count, word);
+                }
+            }
+            sort(ranked.begin(), ranked.end(), [](const auto& lhs, const auto& rhs) {
+                return lhs.first > rhs.first;
+            });
+
+            set<TermId> hot_words;
+            size_t hot_postings = 0;
+            for (const auto& [_, word] : ranked) {
+                const ColdPostingStore::WordEntry& cold_entry = *cold_store_->Find(word);
+                if (hot_postings + cold_entry.count > min(tiered_options_->max_hot_postings, budget_hot_postings_.load(memory_order_relaxed))) {
+                    continue;
+                }
+
+                hot_postings += cold_entry.count;
+                hot_words.insert(word);
+                if (word_to_document_freqs_.count(word) == 0) {
+                    promoted.emplace(word, cold_store_->Load(cold_entry));
+                }
+            }
+
+            for (const auto& [word, _] : word_to_document_freqs_) {
+                if (hot_words.count(word) == 0 && cold_store_->Find(word) != nullptr) {
+                    demoted.push_back(word);
+                }
+            }
+        }
+
+        unique_lock lock(index_mutex_);
+        if (!cold_store_) {
+            return;
+        }
+
+        for (auto& [word, document_freqs] : promoted) {
+            // Прореживание могло успеть переписать файл: тогда в нём posting-ов меньше, чем в прочитанном листе
+            const ColdPostingStore::WordEntry* cold_entry = cold_store_->Find(word);
+            if (cold_entry != nullptr && cold_entry->count == document_freqs.size()) {
+                if (word_to_document_freqs_.Emplace(word, move(document_freqs))) {
+                    cold_store_->ReleasePages(*cold_entry);
+                }
+            }
+        }
+
+        for (const TermId word : demoted) {
+            if (cold_store_->Find(word) != nullptr) {
+                word_to_document_freqs_.Erase(word);
+            }
+        }
+    }
+
+    // Оценка места в CowMap: узел дерева, ключ, указатель на значение и само значение с блоком счётчиков
+    template <typename Key, typename Value>
+    static constexpr size_t GetCowMapEntryBytes() {
+        return 4 * sizeof(void*) + sizeof(Key) + sizeof(shared_ptr<Value>) + 2 * sizeof(long) + sizeof(Value);
+    }
+
+    // Вызывается под index_mutex_
+    size_t MeasurePostingBytes() const {
+        size_t postings = 0;
+        for (const auto& [_, document_freqs] : word_to_document_freqs_) {
+            postings += document_freqs.size();
+        }
+        for (const auto& [_, document_freqs] : cold_word_to_document_freqs_) {
+            postings += document_freqs.size();
+        }
+
+        return postings * POSTING_BYTES
+            + (word_to_document_freqs_.size() + cold_word_to_document_freqs_.size()) * GetCowMapEntryBytes<TermId, DocumentFreqs>()
+            + word_to_max_term_freq_.size() * GetCowMapEntryBytes<TermId, double>()
+            + pruned_word_document_counts_.size() * GetCowMapEntryBytes<TermId, size_t>();
+    }
+
+    MemoryUsage MeasureMemoryUsage() const {
+        MemoryUsage usage;
+        {
+            shared_lock lock(index_mutex_);
+            usage.SetBytes(MemorySubsystem::POSTINGS, MeasurePostingBytes());
+
+            size_t document_bytes = documents_.size() * (GetCowMapEntryBytes<int, DocumentData>() + sizeof(DocumentMetadata));
+            for (const auto& [_, document_data] : documents_) {
+                document_bytes += document_data.words.capacity() * sizeof(TermId);
+            }
+            usage.SetBytes(MemorySubsystem::DOCUMENTS, document_bytes);
+        }
+
+        size_t buffer_bytes = 0;
+        for (const IngestStripe& stripe : ingest_stripes_) {
+            lock_guard stripe_lock(stripe.buffer_mutex);
+            for (const BufferedDocument& document : stripe.buffer) {
+                buffer_bytes += sizeof(BufferedDocument) + document.words.capacity() * sizeof(TermId);
+            }
+            buffer_bytes += stripe.pending_document_ids.size() * (sizeof(int) + 2 * sizeof(void*));
+        }
+        usage.SetBytes(MemorySubsystem::INGEST_BUFFER, buffer_bytes);
+
+        {
+            lock_guard lock(rating_order_mutex_);
+            usage.SetBytes(MemorySubsystem::RATING_ORDER, documents_by_rating_ ? documents_by_rating_->capacity() * sizeof(int) : 0);
+        }
+
+        usage.SetBytes(MemorySubsystem::QUERY_LOG, query_log_.GetMemoryUsage());
+
+        {
+            lock_guard lock(score_buffers_mutex_);
+            size_t scratch_bytes = scratch_bytes_.load(memory_order_relaxed);
+            for (const ScoreBuffer& buffer : score_buffers_) {
+                scratch_bytes += buffer.capacity() * sizeof(double);
+            }
+            usage.SetBytes(MemorySubsystem::QUERY_SCRATCH, scratch_bytes);
+        }
+
+        return usage;
+    }
+
+    // Вызывается под memory_budget_mutex_
+    void ReportMemoryUsage() {
+        const MemoryUsage usage = MeasureMemoryUsage();
+        memory_budget_->UpdateUsage(reported_memory_usage_, usage);
+        reported_memory_usage_ = usage;
+    }
+
+    // Горячий posting-лист можно вытеснить, только если в холодном файле есть его актуальная копия.
+    // Польза считается как работа на повторное чтение с учётом недавних обращений к слову
+    vector<MemoryBudget::Candidate> CollectEvictionCandidates() const {
+        vector<MemoryBudget::Candidate> candidates;
+        {
+            shared_lock lock(index_mutex_);
+            if (cold_store_) {
+                for (const auto& [word, document_freqs] : word_to_document_freqs_) {
+                    if (const ColdPostingStore::WordEntry* cold_entry = cold_store_->Find(word)) {
+                        const size_t bytes = GetCowMapEntryBytes<TermId, DocumentFreqs>() + document_freqs.size() * POSTING_BYTES;
+                        const double benefit = (cold_store_->GetAccessCount(*cold_entry) + 1.0) * document_freqs.size() * COLD_POSTING_READ_COST;
+                        candidates.push_back({MemorySubsystem::POSTINGS, bytes, benefit, word});
+                    }
+                }
+            }
+        }
+
+        {
+            lock_guard lock(rating_order_mutex_);
+            if (documents_by_rating_) {
+                const size_t document_count = documents_by_rating_->size();
+                candidates.push_back({MemorySubsystem::RATING_ORDER, documents_by_rating_->capacity() * sizeof(int),
+                                      document_count * log2(document_count + 1.0), 0});
+            }
+        }
+
+        // Журнал запросов нужен только для прогрева, поэтому он уходит первым
+        const vector<size_t> query_bytes = query_log_.GetEntryBytes();
+        for (size_t i = 0; i < query_bytes.size(); ++i) {
+            candidates.push_back({MemorySubsystem::QUERY_LOG, query_bytes[i], 0.0, i});
+        }
+
+        // Свободный массив оценок восстанавливается одним выделением и заполнением
+        {
+            lock_guard lock(score_buffers_mutex_);
+            for (size_t i = 0; i < score_buffers_.size(); ++i) {
+                const size_t bytes = score_buffers_[i].capacity() * sizeof(double);
+                candidates.push_back({MemorySubsystem::QUERY_SCRATCH, bytes, bytes * SCORE_BUFFER_FILL_COST, i});
+            }
+        }
+
+        return candidates;
+    }
+
+    size_t EvictMemory(const vector<MemoryBudget::Candidate>& candidates) {
+        MemoryUsage evicted;
+        vector<TermId> words;
+        size_t query_count = 0;
+        size_t score_buffer_count = 0;
+        for (const MemoryBudget::Candidate& candidate : candidates) {
+            switch (candidate.subsystem) {
+            case MemorySubsystem::POSTINGS:
+                words.push_back(static_cast<TermId>(candidate.key));
+                break;
+            case MemorySubsystem::RATING_ORDER:
+                InvalidateRatingOrder();
+                evicted.AddEvicted(candidate.subsystem, candidate.bytes);
+                break;
+            case MemorySubsystem::QUERY_LOG:
+                ++query_count;
+                break;
+            case MemorySubsystem::QUERY_SCRATCH:
+                ++score_buffer_count;
+                break;
+            case MemorySubsystem::DOCUMENTS:
+            case MemorySubsystem::INGEST_BUFFER:
+                break;
+            }
+        }
+
+        if (!words.empty()) {
+            unique_lock lock(index_mutex_);
+            if (cold_store_) {
+                for (const TermId word : words) {
+                    // Слово могли изменить после выбора, тогда копии на диске уже нет
+                    const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word);
+                    if (document_freqs != nullptr && cold_store_->Find(word) != nullptr) {
+                        evicted.AddEvicted(MemorySubsystem::POSTINGS,
+                                           GetCowMapEntryBytes<TermId, DocumentFreqs>() + document_freqs->size() * POSTING_BYTES);
+                        word_to_document_freqs_.Erase(word);
+                    }
+                }
+
+                // Фоновый перебор уровней не поднимет вытесненное обратно, пока бюджет не освободится
+                size_t hot_postings = 0;
+                for (const auto& [_, document_freqs] : word_to_document_freqs_) {
+                    hot_postings += document_freqs.size();
+                }
+                budget_hot_postings_ = hot_postings;
+            }
+        }
+
+        if (query_count > 0) {
+            evicted.AddEvicted(MemorySubsystem::QUERY_LOG, query_log_.EvictOldest(query_count));
+        }
+
+        if (score_buffer_count > 0) {
+            lock_guard lock(score_buffers_mutex_);
+            for (size_t i = 0; i < score_buffer_count && !score_buffers_.empty(); ++i) {
+                evicted.AddEvicted(MemorySubsystem::QUERY_SCRATCH, score_buffers_.back().capacity() * sizeof(double));
+                score_buffers_.pop_back();
+            }
+        }
+
+        for (size_t i = 0; i < MEMORY_SUBSYSTEM_COUNT; ++i) {
+            const auto subsystem = static_cast<MemorySubsystem>(i);
+            const size_t bytes = evicted.evicted_bytes[i];
+            if (bytes > 0) {
+                memory_budget_->RecordEviction(subsystem, bytes);
+                evicted_memory_.AddEvicted(subsystem, bytes);
+            }
+        }
+
+        return evicted.GetTotalEvicted();
+    }
+
+    void StopTierRebalancer() {
+        {
+            lock_guard lock(tier_rebalancer_mutex_);
+            stop_tier_rebalancer_ = true;
+        }
+        tier_rebalancer_cv_.notify_all();
+
+        if (tier_rebalancer_.joinable()) {
+            tier_rebalancer_.join();
+        }
+    }
+
+    // FindTopDocuments без записи в журнал запросов: служебные запросы сервера не должны
+    // вытеснять из журнала запросы пользователей, по которым идёт прогрев
+    template <typename DocumentPredicate>
+    optional<vector<Document>> SearchTopDocuments(const string& raw_query, DocumentPredicate document_predicate, double min_relevance) const {
+        shared_lock lock(index_mutex_);
+        const optional<Query> query = ParseQuery(raw_query);
+        
+        if (!IsValidWord(raw_query) || !query.has_value()) {
+            return nullopt;
+        }
+
+        const uint64_t page_faults_before = cold_store_ ? GetThreadPageFaults() : 0;
+        const optional<uint64_t> dtlb_misses_before = dtlb_counters_enabled_ ? GetThreadDtlbCounter().Read() : nullopt;
+
+        vector<Document> result;
+        if (min_relevance > 0.0) {
+            result = FindRelevantDocuments(query.value(), document_predicate, min_relevance);
+        } else if (query->minus_words.empty() && query->plus_words.size() <= MAX_SHORT_QUERY_WORDS) {
+            result = FindShortQueryDocuments(query->plus_terms, document_predicate);
+        } else {
+            result = FindAllDocuments(query.value(), document_predicate);
+        }
+        SortAndTruncateDocuments(result);
+
+        if (dtlb_misses_before.has_value()) {
+            if (const optional<uint64_t> dtlb_misses_after = GetThreadDtlbCounter().Read()) {
+                dtlb_counters_.dtlb_misses.fetch_add(*dtlb_misses_after - *dtlb_misses_before, memory_order_relaxed);
+                dtlb_counters_.queries.fetch_add(1, memory_order_relaxed);
+            }
+        }
+
+        if (cold_store_) {
+            tier_counters_.page_faults.fetch_add(GetThreadPageFaults() - page_faults_before, memory_order_relaxed);
+            tier_counters_.queries.fetch_add(1, memory_order_relaxed);
+        }
+
+        return result;
+    }
+
+    void LogQuery(const string& raw_query) const {
+        query_log_.Add(raw_query);
+    }
+
+    void WarmUpWord(const string& word) const {
+        if (const optional<TermId> term = FindTerm(word)) {
+            WarmUpWord(*term);
+        }
+    }
+
+    void WarmUpWord(TermId word) const {
+        if (!HasWord(word)) {
+            return;
+        }
+
+        if (cold_store_ && word_to_document_freqs_.count(word) == 0) {
+            if (const ColdPostingStore::WordEntry* cold_entry = cold_store_->Find(word)) {
+                cold_store_->RecordAccess(*cold_entry);
+                volatile uint64_t checksum = cold_store_->PrefaultPages(*cold_entry);
+                (void) checksum;
+            }
+        }
+
+        const auto touch = [this](int document_id, double) {
+            const DocumentData* document_data = documents_.Find(document_id);
+            const DocumentMetadata* metadata = document_metadata_.Find(document_id);
+            volatile int rating = (document_data == nullptr ? 0 : document_data->rating) + (metadata == nullptr ? 0 : metadata->rating);
+            (void) rating;
+        };
+
+        if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+            for (const auto& [document_id, term_freq] : *document_freqs) {
+                touch(document_id, term_freq);
+            }
+        } else if (const ColdPostingStore::WordEntry* cold_entry = cold_store_->Find(word)) {
+            const auto [begin, end] = cold_store_->GetPostings(*cold_entry);
+            for (const ColdPostingStore::Posting* posting = begin; posting != end; ++posting) {
+                touch(posting->document_id, posting->term_freq);
+            }
+        }
+    }
+
+    static DtlbMissCounter& GetThreadDtlbCounter() {
+        thread_local DtlbMissCounter counter;
+        return counter;
+    }
+
+    static uint64_t GetThreadPageFaults() {
+        rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        return usage.ru_minflt + usage.ru_majflt;
+    }
+
+    double ComputeWordInverseDocumentFreq(const string& word) const {
+        return log(documents_.size() * 1.0 / GetWordDocumentCount(word));
+    }
+
+    double ComputeWordInverseDocumentFreq(TermId word) const {
+        return log(documents_.size() * 1.0 / GetWordDocumentCount(word));
+    }
+
+    // Слова и posting-и обоих уровней; горячая копия холодного слова считается один раз
+    size_t CountWords() const {
+        size_t words = word_to_document_freqs_.size();
+        if (cold_store_) {
+            for (const auto& [word, _] : cold_store_->GetWords()) {
+                words += word_to_document_freqs_.count(word) == 0 ? 1 : 0;
+            }
+        }
+
+        return words;
+    }
+
+    size_t CountPostings() const {
+        size_t postings = 0;
+        for (const auto& [word, document_freqs] : word_to_document_freqs_) {
+            postings += document_freqs.size();
+        }
+        if (cold_store_) {
+            for (const auto& [word, cold_entry] : cold_store_->GetWords()) {
+                postings += word_to_document_freqs_.count(word) == 0 ? cold_entry.count : 0;
+            }
+        }
+
+        return postings;
+    }
+
+    static double ComputeResultOverlap(const vector<Document>& full, const vector<Document>& pruned) {
+        if (full.empty()) {
+            return pruned.empty() ? 1.0 : 0.0;
+        }
+
+        size_t common = 0;
+        for (const Document& document : full) {
+            common += count_if(pruned.begin(), pruned.end(), [&document](const Document& other) {
+                return other.id == document.id;
+            });
+        }
+
+        return common * 1.0 / full.size();
+    }
+
+    // Курсор по posting-листу слова в любом из уровней хранения; документы идут по возрастанию id
+    struct PostingCursor {
+        DocumentFreqs::const_iterator hot;
+        DocumentFreqs::const_iterator hot_end;
+        const ColdPostingStore::Posting* cold = nullptr;
+        const ColdPostingStore::Posting* cold_end = nullptr;
+        bool is_cold = false;
+
+        bool AtEnd() const {
+            return is_cold ? cold == cold_end : hot == hot_end;
+        }
+
+        int GetDocumentId() const {
+            return is_cold ? cold->document_id : hot->first;
+        }
+
+        double GetTermFreq() const {
+            return is_cold ? cold->term_freq : hot->second;
+        }
+
+        void Next() {
+            if (is_cold) {
+                ++cold;
+            } else {
+                ++hot;
+            }
+        }
+    };
+
+    optional<PostingCursor> OpenPostingCursor(const string& word) const {
+        const optional<TermId> term = FindTerm(word);
+        return term ? OpenPostingCursor(*term) : nullopt;
+    }
+
+    optional<PostingCursor> OpenPostingCursor(TermId word) const {
+        const ColdPostingStore::WordEntry* cold_entry = cold_store_ ? cold_store_->Find(word) : nullptr;
+        if (cold_entry != nullptr) {
+            cold_store_->RecordAccess(*cold_entry);
+        }
+
+        PostingCursor cursor;
+        if (const DocumentFreqs* document_freqs = word_to_document_freqs_.Find(word)) {
+            if (cold_store_) {
+                tier_counters_.hot_lookups.fetch_add(1, memory_order_relaxed);
+            }
+            cursor.hot = document_freqs->begin();
+            cursor.hot_end = document_freqs->end();
+            return cursor;
+        }
+
+        if (cold_entry == nullptr) {
+            return nullopt;
+        }
+
+        tier_counters_.cold_lookups.fetch_add(1, memory_order_relaxed);
+        tie(cursor.cold, cursor.cold_end) = cold_store_->GetPostings(*cold_entry);
+        cursor.is_cold = true;
+        return cursor;
+    }
+
+    // Короткие запросы без минус-слов обходятся без словаря-аккумулятора:
+    // posting-листы сливаются по id, и релевантность документа считается сразу целиком
+    template <typename DocumentPredicate>
+    vector<Document> FindShortQueryDocuments(const vector<TermId>& plus_words, DocumentPredicate document_predicate) const {
+        array<PostingCursor, MAX_SHORT_QUERY_WORDS> cursors;
+        array<double, MAX_SHORT_QUERY_WORDS> inverse_document_freqs;
+        size_t word_count = 0;
+
+        for (const TermId word : plus_words) {
+            if (!HasWord(word)) {
+                continue;
+            }
+
+            inverse_document_freqs[word_count] = ComputeWordInverseDocumentFreq(word);
+            cursors[word_count] = *OpenPostingCursor(word);
+            ++word_count;
+        }
+
+        switch (word_count) {
+            case 1:
+                return MergePostingCursors<1>(cursors, inverse_document_freqs, document_predicate);
+            case 2:
+                return MergePostingCursors<2>(cursors, inverse_document_freqs, document_predicate);
+            case 3:
+                return MergePostingCursors<3>(cursors, inverse_document_freqs, document_predicate);
+            default:
+                return {};
+        }
+    }
+
+    template <size_t WordCount, typename DocumentPredicate>
+    vector<Document> MergePostingCursors(array<PostingCursor, MAX_SHORT_QUERY_WORDS>& cursors,
+                                         const array<double, MAX_SHORT_QUERY_WORDS>& inverse_document_freqs,
+                                         DocumentPredicate document_predicate) const {
+        vector<Document> matched_documents;
+        const auto add_document = [&](int document_id, double relevance) {
+            const DocumentMetadata* metadata = document_metadata_.Find(document_id);
+            if (metadata != nullptr && metadata->present
+                && document_predicate(document_id, metadata->GetStatus(), metadata->rating)) {
+                matched_documents.push_back({document_id, relevance, metadata->rating});
+            }
+        };
+
+        if constexpr (WordCount == 1) {
+            for (PostingCursor& cursor = cursors[0]; !cursor.AtEnd(); cursor.Next()) {
+                add_document(cursor.GetDocumentId(), cursor.GetTermFreq() * inverse_document_freqs[0]);
+            }
+        } else {
+            while (true) {
+                // INT_MAX — допустимый id документа, поэтому конец всех листов отмечается отдельно
+                optional<int> next_document_id;
+                for (size_t i = 0; i < WordCount; ++i) {
+                    if (!cursors[i].AtEnd() && (!next_document_id || cursors[i].GetDocumentId() < *next_document_id)) {
+                        next_document_id = cursors[i].GetDocumentId();
+                    }
+                }
+
+                if (!next_document_id) {
+                    break;
+                }
+                const int document_id = *next_document_id;
+
+                double relevance = 0.0;
+                for (size_t i = 0; i < WordCount; ++i) {
+                    if (!cursors[i].AtEnd() && cursors[i].GetDocumentId() == document_id) {
+                        relevance += cursors[i].GetTermFreq() * inverse_document_freqs[i];
+                        cursors[i].Next();
+                    }
+                }
+
+                add_document(document_id, relevance);
+            }
+        }
+
+        return matched_documents;
+    }
+
+    // Поиск с порогом релевантности по схеме MaxScore: слова упорядочиваются по максимально
+    // возможному вкладу, и документы, встречающиеся только в «слабых» словах, суммарный
+    // вклад которых ниже порога, вообще не рассматриваются. Posting-листы слабых слов не
+    // обходятся целиком, а используются только для дополнения уже найденных кандидатов
+    template <typename DocumentPredicate>
+    vector<Document> FindRelevantDocuments(const Query& query, DocumentPredicate document_predicate, double min_relevance) const {
+        struct WordBound {
+            TermId word;
+            double inverse_document_freq;
+            double max_score;
+        };
+
+        vector<WordBound> bounds;
+        for (const TermId word : query.plus_terms) {
+            if (HasWord(word)) {
+                const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
+                bounds.push_back({word, inverse_document_freq, GetMaxTermFreq(word) * inverse_document_freq});
+            }
+        }
+
+        sort(bounds.begin(), bounds.end(), [](const WordBound& lhs, const WordBound& rhs) {
+            return lhs.max_score < rhs.max_score;
+        });
+
+        size_t essential_begin = 0;
+        double non_essential_score = 0.0;
+        while (essential_begin < bounds.size() && non_essential_score + bounds[essential_begin].max_score < min_relevance) {
+            non_essential_score += bounds[essential_begin].max_score;
+            ++essential_begin;
+        }
+
+        map<int, double> document_to_relevance;
+        for (size_t i = essential_begin; i < bounds.size(); ++i) {
+            ForEachPostingBlock(bounds[i].word, [&](const int* document_ids, const double* term_freqs, size_t count) {
+                const DocumentMetadata* metadata[POSTING_BLOCK_SIZE];
+                for (size_t j = 0; j < count; ++j) {
+                    metadata[j] = document_metadata_.Find(document_ids[j]);
+                    __builtin_prefetch(metadata[j]);
+                }
+
+                for (size_t j = 0; j < count; ++j) {
+                    if (metadata[j] != nullptr && metadata[j]->present
+                        && document_predicate(document_ids[j], metadata[j]->GetStatus(), metadata[j]->rating)) {
+                        document_to_relevance[document_ids[j]] += term_freqs[j] * bounds[i].inverse_document_freq;
+                    }
+                }
+            });
+        }
+
+        double remaining_score = non_essential_score;
+        for (size_t i = essential_begin; i-- > 0;) {
+            for (auto it = document_to_relevance.begin(); it != document_to_relevance.end();) {
+                if (it->second + remaining_score < min_relevance) {
+                    it = document_to_relevance.erase(it);
+                    continue;
+                }
+
+                if (const optional<double> term_freq = FindTermFreq(bounds[i].word, it->first)) {
+                    it->second += *term_freq * bounds[i].inverse_document_freq;
+                }
+                ++it;
+            }
+            remaining_score -= bounds[i].max_score;
+        }
+
+        for (const TermId word : query.minus_terms) {
+            ForEachPosting(word, [&document_to_relevance](int document_id, double) {
+                document_to_relevance.erase(document_id);
+            });
+        }
+
+        vector<Document> matched_documents;
+        for (const auto& [document_id, relevance] : document_to_relevance) {
+            if (relevance >= min_relevance) {
+                matched_documents.push_back({document_id, relevance, document_metadata_.Find(document_id)->rating});
+            }
+        }
+
+        return matched_documents;
+    }
+
+    void InvalidateRatingOrder() {
+        lock_guard lock(rating_order_mutex_);
+        documents_by_rating_.reset();
+    }
+
+    // Перестановка id документов по убыванию рейтинга пересчитывается лениво после изменений
+    shared_ptr<const vector<int>> GetDocumentsByRating() const {
+        lock_guard lock(rating_order_mutex_);
+        if (!documents_by_rating_) {
+            vector<pair<int, int>> ratings;
+            ratings.reserve(documents_.size());
+            for (const auto& [document_id, document_data] : documents_) {
+                ratings.emplace_back(-document_data.rating, document_id);
+            }
+            sort(ratings.begin(), ratings.end());
+
+            auto order = make_shared<vector<int>>();
+            order->reserve(ratings.size());
+            for (const auto& [_, document_id] : ratings) {
+                order->push_back(document_id);
+            }
+            documents_by_rating_ = move(order);
+        }
+
+        return documents_by_rating_;
+    }
+
+    // Релевантность одного документа по плюс-словам; nullopt, если документ не подходит под запрос
+    optional<double> ComputeDocumentRelevance(const Query& query, const vector<double>& inverse_document_freqs, int document_id) const {
+        for (const TermId word : query.minus_terms) {
+            if (HasPosting(word, document_id)) {
+                return nullopt;
+            }
+        }
+
+        bool matched = false;
+        double relevance = 0.0;
+        size_t word_index = 0;
+        for (const TermId word : query.plus_terms) {
+            const double inverse_document_freq = inverse_document_freqs[word_index++];
+            if (inverse_document_freq < 0.0) {
+                continue;
+            }
+
+            if (const optional<double> term_freq = FindTermFreq(word, document_id)) {
+                relevance += *term_freq * inverse_document_freq;
+                matched = true;
+            }
+        }
+
+        return matched ? optional<double>(relevance) : nullopt;
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindDocumentsByRating(const Query& query, DocumentPredicate document_predicate) const {
+        vector<double> inverse_document_freqs;
+        size_t posting_count = 0;
+        for (const TermId word : query.plus_terms) {
+            if (HasWord(word)) {
+                inverse_document_freqs.push_back(ComputeWordInverseDocumentFreq(word));
+                posting_count += GetWordDocumentCount(word);
+            } else {
+                inverse_document_freqs.push_back(-1.0);
+            }
+        }
+
+        const auto by_rating = [](const Document& lhs, const Document& rhs) {
+            return lhs.rating > rhs.rating || (lhs.rating == rhs.rating && lhs.id < rhs.id);
+        };
+
+        // Редкие слова выгоднее обойти целиком и отсортировать совпадения,
+        // частые — идти по перестановке документов и остановиться на K-м совпадении
+        if (posting_count * 4 < documents_.size()) {
+            vector<Document> result = FindAllDocuments(query, document_predicate);
+            const size_t result_size = min<size_t>(result.size(), MAX_RESULT_DOCUMENT_COUNT);
+            partial_sort(result.begin(), result.begin() + result_size, result.end(), by_rating);
+            result.resize(result_size);
+            return result;
+        }
+
+        vector<Document> result;
+        const shared_ptr<const vector<int>> documents_by_rating = GetDocumentsByRating();
+        for (const int document_id : *documents_by_rating) {
+            const DocumentMetadata* metadata = document_metadata_.Find(document_id);
+            if (!document_predicate(document_id, metadata->GetStatus(), metadata->rating)) {
+                continue;
+            }
+
+            if (const optional<double> relevance = ComputeDocumentRelevance(query, inverse_document_freqs, document_id)) {
+                result.push_back({document_id, *relevance, metadata->rating});
+                if (result.size() == MAX_RESULT_DOCUMENT_COUNT) {
+                    break;
+                }
+            }
+        }
+
+        return result;
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindDocumentsById(const Query& query, DocumentPredicate document_predicate) const {
+        vector<PostingCursor> cursors;
+        vector<double> inverse_document_freqs;
+        for (const TermId word : query.plus_terms) {
+            if (HasWord(word)) {
+                inverse_document_freqs.push_back(ComputeWordInverseDocumentFreq(word));
+                cursors.push_back(*OpenPostingCursor(word));
+            }
+        }
+
+        vector<Document> result;
+        while (result.size() < MAX_RESULT_DOCUMENT_COUNT) {
+            // Как и в MergePostingCursors, конец листов не кодируется значением id
+            optional<int> next_document_id;
+            for (const PostingCursor& cursor : cursors) {
+                if (!cursor.AtEnd() && (!next_document_id || cursor.GetDocumentId() < *next_document_id)) {
+                    next_document_id = cursor.GetDocumentId();
+                }
+            }
+
+            if (!next_document_id) {
+                break;
+            }
+            const int document_id = *next_document_id;
+
+            double relevance = 0.0;
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                if (!cursors[i].AtEnd() && cursors[i].GetDocumentId() == document_id) {
+                    relevance += cursors[i].GetTermFreq() * inverse_document_freqs[i];
+                    cursors[i].Next();
+                }
+            }
+
+            const DocumentMetadata* metadata = document_metadata_.Find(document_id);
+            if (metadata == nullptr || !metadata->present || !document_predicate(document_id, metadata->GetStatus(), metadata->rating)) {
+                continue;
+            }
+
+            if (none_of(query.minus_terms.begin(), query.minus_terms.end(), [this, document_id](TermId word) {
+                    return HasPosting(word, document_id);
+                })) {
+                result.push_back({document_id, relevance, metadata->rating});
+            }
+        }
+
+        return result;
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindFreshDocuments(const Query& query, DocumentPredicate document_predicate, const FreshnessDecay& decay) const {
+        constexpr int CHUNK_SIZE = DocumentMetadataTable::CHUNK_SIZE;
+
+        vector<pair<TermId, double>> plus_words;
+        double max_relevance = 0.0;
+        // Когда все posting-и слов запроса обойдены, в остальных кусках совпадений нет
+        size_t remaining_postings = 0;
+        for (const TermId word : query.plus_terms) {
+            if (HasWord(word)) {
+                const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
+                plus_words.emplace_back(word, inverse_document_freq);
+                max_relevance += GetMaxTermFreq(word) * inverse_document_freq;
+                remaining_postings += GetPostingCount(word);
+            }
+        }
+
+        vector<pair<int64_t, size_t>> chunks;
+        for (size_t chunk_index = 0; chunk_index < document_metadata_.GetChunkCount(); ++chunk_index) {
+            if (document_metadata_.HasChunk(chunk_index)) {
+                chunks.emplace_back(document_metadata_.GetMaxTimestamp(chunk_index), chunk_index);
+            }
+        }
+        sort(chunks.begin(), chunks.end(), greater<>());
+
+        vector<double> scores(CHUNK_SIZE);
+        vector<uint8_t> matched(CHUNK_SIZE);
+        vector<Document> result;
+        // Документ с релевантностью ниже порога не попадёт в первые MAX_RESULT_DOCUMENT_COUNT
+        double threshold = -numeric_limits<double>::infinity();
+        for (const auto& [max_timestamp, chunk_index] : chunks) {
+            if (remaining_postings == 0 || max_relevance * decay.GetWeight(max_timestamp) < threshold) {
+                break;
+            }
+
+            const int begin = static_cast<int>(chunk_index << DocumentMetadataTable::CHUNK_SHIFT);
+            const int64_t end = static_cast<int64_t>(begin) + CHUNK_SIZE;
+            fill(scores.begin(), scores.end(), 0.0);
+            fill(matched.begin(), matched.end(), 0);
+            for (const auto& [word, inverse_document_freq] : plus_words) {
+                ForEachPostingInRange(word, begin, end, [&, idf = inverse_document_freq](int document_id, double term_freq) {
+                    scores[document_id - begin] += term_freq * idf;
+                    matched[document_id - begin] = 1;
+                    --remaining_postings;
+                });
+            }
+            for (const TermId word : query.minus_terms) {
+                ForEachPostingInRange(word, begin, end, [&](int document_id, double) {
+                    matched[document_id - begin] = 0;
+                });
+            }
+
+            ApplyFreshnessDecay(scores.data(), document_metadata_.FindTimestamps(chunk_index), decay);
+
+            for (int offset = 0; offset < CHUNK_SIZE; ++offset) {
+                if (!matched[offset] || scores[offset] < threshold) {
+                    continue;
+                }
+
+                const int document_id = begin + offset;
+                const DocumentMetadata* metadata = document_metadata_.Find(document_id);
+                if (metadata->present && document_predicate(document_id, metadata->GetStatus(), metadata->rating)) {
+                    result.push_back({document_id, scores[offset], metadata->rating});
+                }
+            }
+
+            if (result.size() >= MAX_RESULT_DOCUMENT_COUNT) {
+                nth_element(result.begin(), result.begin() + MAX_RESULT_DOCUMENT_COUNT - 1, result.end(),
+                            [](const Document& lhs, const Document& rhs) {
+                                return lhs.relevance > rhs.relevance;
+                            });
+                threshold = result[MAX_RESULT_DOCUMENT_COUNT - 1].relevance - DELTA;
+                result.erase(remove_if(result.begin(), result.end(), [threshold](const Document& document) {
+                                 return document.relevance < threshold;
+                             }),
+                             result.end());
+            }
+        }
+
+        return result;
+    }
+
+    // Ядро оценки: релевантности всего куска умножаются на затухание одним проходом
+    // без ветвлений по массивам меток и оценок, который компилятор векторизует
+    static void ApplyFreshnessDecay(double* scores, const int64_t* timestamps, const FreshnessDecay& decay) {
+        constexpr int CHUNK_SIZE = DocumentMetadataTable::CHUNK_SIZE;
+        if (timestamps == nullptr) {
+            const double weight = decay.GetWeight(0);
+            for (int i = 0; i < CHUNK_SIZE; ++i) {
+                scores[i] *= weight;
+            }
+            return;
+        }
+
+        const double half_life = decay.half_life;
+        const double now = decay.now;
+        for (int i = 0; i < CHUNK_SIZE; ++i) {
+            scores[i] *= half_life / (half_life + max(0.0, now - static_cast<double>(timestamps[i])));
+        }
+    }
+
+    // Документы из списка, проверяемые по одному: релевантность считается поиском
+    // в posting-листах, которые при этом не обходятся
+    template <typename DocumentPredicate>
+    vector<Document> FindListedDocuments(const Query& query, const vector<int>& document_ids, DocumentPredicate document_predicate) const {
+        vector<double> inverse_document_freqs;
+        for (const TermId word : query.plus_terms) {
+            inverse_document_freqs.push_back(HasWord(word) ? ComputeWordInverseDocumentFreq(word) : -1.0);
+        }
+
+        vector<Document> result;
+        for (const int document_id : document_ids) {
+            const DocumentMetadata* metadata = document_metadata_.Find(document_id);
+            if (!document_predicate(document_id, metadata->GetStatus(), metadata->rating)) {
+                continue;
+            }
 
-    Document(int doc_id, double doc_relevance, int doc_raiting): id(doc_id), relevance(doc_relevance), rating(doc_raiting) { }
+            if (const optional<double> relevance = ComputeDocumentRelevance(query, inverse_document_freqs, document_id)) {
+                result.push_back({document_id, *relevance, metadata->rating});
+            }
+        }
 
-    int id;
-    double relevance;
-    int rating;
-};
+        return result;
+    }
 
-enum class DocumentStatus {
-    ACTUAL,
-    IRRELEVANT,
-    BANNED,
-    REMOVED,
-};
+    template <typename KeyMapper>
+    vector<Document> FindAllDocuments(const Query& query, KeyMapper key_mapper, const TenantDocuments* tenant_documents = nullptr) const {
+        if (tenant_documents == nullptr) {
+            size_t posting_count = 0;
+            for (const TermId word : query.plus_terms) {
+                posting_count += GetPostingCount(word);
+            }
+            const size_t id_range = document_metadata_.GetChunkCount() << DocumentMetadataTable::CHUNK_SHIFT;
+            if (id_range <= DENSE_ACCUMULATOR_MAX_IDS && posting_count >= id_range * DENSE_ACCUMULATOR_MIN_DENSITY) {
+                return FindAllDocumentsDense(query, key_mapper, id_range);
+            }
+        }
 
-class SearchServer {
-public:
-    inline static constexpr int INVALID_DOCUMENT_ID = -1;
+        map<int, double> document_to_relevance;
 
-    SearchServer() = default;
-    
-    template <typename StringCollection>
-    explicit SearchServer(const StringCollection& stop_words) {
-        for (const auto& word : stop_words) {
-            if (word.size()) {
-                stop_words_.insert(word);
+        for (const TermId word : query.plus_terms) {
+            if (!HasWord(word)) {
+                continue;
             }
+
+            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
+            ForEachPostingBlock(word, [&](const int* document_ids, const double* term_freqs, size_t count) {
+                // Сначала запрашиваем метаданные всего блока, а проверяем предикат,
+                // когда они уже едут в кэш, вместо зависимого промаха на каждом документе
+                const DocumentMetadata* metadata[POSTING_BLOCK_SIZE];
+                for (size_t i = 0; i < count; ++i) {
+                    if (tenant_documents != nullptr && !tenant_documents->Contains(document_ids[i])) {
+                        metadata[i] = nullptr;
+                        continue;
+                    }
+                    metadata[i] = document_metadata_.Find(document_ids[i]);
+                    __builtin_prefetch(metadata[i]);
+                }
+
+                for (size_t i = 0; i < count; ++i) {
+                    if (metadata[i] != nullptr && metadata[i]->present
+                        && key_mapper(document_ids[i], metadata[i]->GetStatus(), metadata[i]->rating)) {
+                        document_to_relevance[document_ids[i]] += term_freqs[i] * inverse_document_freq;
+                    }
+                }
+            });
         }
-    }
-    
-    explicit SearchServer(const string& stop_words_text)
-        : SearchServer(SplitIntoWords(stop_words_text)) { }    
 
-    void SetStopWords(const string& text) {
-        for (const string& word : SplitIntoWords(text)) {
-            stop_words_.insert(word);
+        for (const TermId word : query.minus_terms) {
+            ForEachPosting(word, [&document_to_relevance](int document_id, double) {
+                document_to_relevance.erase(document_id);
+            });
         }
-    }
 
-    [[nodiscard]] bool AddDocument(int document_id, const string& document, DocumentStatus status, const vector<int>& ratings) {
-        if (document_id < 0 || documents_.count(document_id) > 0 || !IsValidWord(document)) {
-            return false;
+        vector<Document> matched_documents;
+        for (const auto &[document_id, relevance] : document_to_relevance) {
+            matched_documents.push_back(
+                {document_id, relevance, document_metadata_.Find(document_id)->rating});
         }
 
-        const vector<string> words = SplitIntoWordsNoStop(document);
+        return matched_documents;
+    }
 
-        if (words.empty()) {
-            documents_.emplace(document_id, DocumentData{ComputeAverageRating(ratings), status});
-        } else {
-            const double inv_word_count = 1 / static_cast<double>(words.size());
-            
-            for (const string& word : words) {
-                word_to_document_freqs_[word][document_id] += inv_word_count;
+    // Оценки копятся в плотном массиве по id векторным ядром, а предикат проверяется
+    // один раз на документ при выборке совпадений
+    template <typename KeyMapper>
+    vector<Document> FindAllDocumentsDense(const Query& query, KeyMapper key_mapper, size_t id_range) const {
+        // -0.0 означает «нет совпадений»: слагаемые tf * idf неотрицательны, а -0.0 + 0.0 == +0.0,
+        // поэтому по знаку документ с нулевой релевантностью отличается от не найденного
+        ScoreBufferLease score_buffer(*this, id_range);
+        double* scores = score_buffer.GetData();
+
+        const AccumulateScoresKernel accumulate = GetAccumulateScoresKernel();
+        for (const TermId word : query.plus_terms) {
+            if (!HasWord(word)) {
+                continue;
             }
 
-            documents_.emplace(document_id, DocumentData{ComputeAverageRating(ratings), status});
+            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
+            ForEachPostingBlock(word, [&](const int* document_ids, const double* term_freqs, size_t count) {
+                accumulate(scores, document_ids, term_freqs, count, inverse_document_freq);
+            });
         }
 
-        return true;
-    }
+        for (const TermId word : query.minus_terms) {
+            ForEachPosting(word, [scores](int document_id, double) {
+                scores[document_id] = -0.0;
+            });
+        }
 
-    template <typename DocumentPredicate>
-    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate) const {
-        const optional<Query> query = ParseQuery(raw_query);
-        
-        if (!IsValidWord(raw_query) || !query.has_value()) {
-            return nullopt;
+        vector<Document> matched_documents;
+        for (size_t document_id = 0; document_id < id_range; ++document_id) {
+            if (signbit(scores[document_id])) {
+                continue;
+            }
+
+            const DocumentMetadata* metadata = document_metadata_.Find(static_cast<int>(document_id));
+            if (metadata->present && key_mapper(static_cast<int>(document_id), metadata->GetStatus(), metadata->rating)) {
+                matched_documents.push_back({static_cast<int>(document_id), scores[document_id], metadata->rating});
+            }
         }
 
-        vector<Document> result = FindAllDocuments(query.value(), document_predicate);
+        return matched_documents;
+    }
 
-        sort(result.begin(), result.end(),
+    static void SortAndTruncateDocuments(vector<Document>& documents) {
+        const size_t result_size = min<size_t>(documents.size(), MAX_RESULT_DOCUMENT_COUNT);
+        partial_sort(documents.begin(), documents.begin() + result_size, documents.end(),
              [](const Document& lhs, const Document& rhs) {
                  if (abs(lhs.relevance - rhs.relevance) < DELTA) {
                      return lhs.rating > rhs.rating;
@@ -127,212 +6369,375 @@ public:
                      return lhs.relevance > rhs.relevance;
                  }
              });
-        
-        if (result.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            result.resize(MAX_RESULT_DOCUMENT_COUNT);
+
+        documents.resize(result_size);
+    }
+
+    static bool IsValidWord(const string& word) {
+        if (word == "-"s) {
+            return false;
         }
+        
+        return none_of(word.begin(), word.end(), [](char c) {
+            return c >= '\0' && c < ' ';
+        });
+    }
+};
 
-        return result;
+// Реплика для чтения: читает журнал изменений основного сервера и применяет новые записи
+// пачками. Начинает с номера, на котором остановился индекс реплики, например после LoadSnapshot
+class ChangeLogFollower {
+public:
+    ChangeLogFollower(SearchServer& replica, const string& log_path)
+        : replica_(replica)
+        , log_path_(log_path) {
+        stats_.applied_sequence = replica.GetChangeLogSequence();
     }
 
-    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentStatus status) const {
-        return FindTopDocuments(raw_query, [status](int document_id, DocumentStatus doc_status, int rating) { return doc_status == status; });
+    ChangeLogFollower(const ChangeLogFollower&) = delete;
+    ChangeLogFollower& operator=(const ChangeLogFollower&) = delete;
+
+    ~ChangeLogFollower() {
+        Stop();
     }
 
-    optional<vector<Document>> FindTopDocuments(const string& raw_query) const {
-        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    void Start(chrono::milliseconds poll_interval) {
+        Stop();
+
+        stop_ = false;
+        poller_ = thread([this, poll_interval] {
+            unique_lock lock(poller_mutex_);
+            while (!poller_cv_.wait_for(lock, poll_interval, [this] { return stop_; })) {
+                lock.unlock();
+                Poll();
+                lock.lock();
+            }
+        });
     }
 
-    int GetDocumentCount() const {
-        return documents_.size();
+    void Stop() {
+        {
+            lock_guard lock(poller_mutex_);
+            stop_ = true;
+        }
+        poller_cv_.notify_all();
+
+        if (poller_.joinable()) {
+            poller_.join();
+        }
     }
 
-    optional<tuple<vector<string>, DocumentStatus>> MatchDocument(const string& raw_query, int document_id) const {
-        const optional<Query> query = ParseQuery(raw_query);
-        if (!IsValidWord(raw_query) || !query.has_value()) {
-            return nullopt;
+    // Применяет все записи, дописанные в журнал целиком; возвращает их число
+    size_t Poll() {
+        lock_guard poll_lock(poll_mutex_);
+        ifstream in(log_path_, ios::binary);
+        if (!in) {
+            return 0;
         }
 
-        vector<string> matched_words;
+        if (offset_ == 0) {
+            char magic[sizeof(CHANGE_LOG_MAGIC)];
+            if (!in.read(magic, sizeof(magic)) || memcmp(magic, CHANGE_LOG_MAGIC, sizeof(magic)) != 0) {
+                return 0;
+            }
+            offset_ = sizeof(magic);
+        }
+        in.seekg(offset_);
 
-        for (const string& word : query.value().plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
+        size_t applied = 0;
+        uint64_t applied_sequence = GetStats().applied_sequence;
+        while (true) {
+            vector<ChangeRecord> records;
+            ChangeRecordState state = ChangeRecordState::COMPLETE;
+            while (records.size() < REPLICATION_BATCH_SIZE) {
+                ChangeRecord record;
+                state = ReadChangeRecord(in, record);
+                if (state != ChangeRecordState::COMPLETE) {
+                    break;
+                }
+
+                offset_ = in.tellg();
+                if (record.sequence > applied_sequence) {
+                    records.push_back(move(record));
+                }
             }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.push_back(word);
+
+            if (state == ChangeRecordState::CORRUPT) {
+                lock_guard lock(stats_mutex_);
+                stats_.corrupt_offset = offset_;
             }
-        }
 
-        for (const string& word : query.value().minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
+            const bool caught_up = records.size() < REPLICATION_BATCH_SIZE;
+            if (!records.empty()) {
+                applied_sequence = records.back().sequence;
+                const int64_t newest_timestamp_us = records.back().timestamp_us;
+                replica_.ApplyChanges(records);
+                applied += records.size();
+
+                const chrono::microseconds lag(max<int64_t>(0, GetTimestampUs() - newest_timestamp_us));
+                lock_guard lock(stats_mutex_);
+                stats_.applied_sequence = applied_sequence;
+                stats_.applied_records += records.size();
+                ++stats_.batches;
+                stats_.last_lag = lag;
+                stats_.max_lag = max(stats_.max_lag, lag);
             }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.clear();
+
+            if (caught_up) {
                 break;
             }
         }
 
-        return tuple {matched_words, documents_.at(document_id).status};
+        lock_guard lock(stats_mutex_);
+        read_offset_ = offset_;
+        return applied;
     }
 
-    int GetDocumentId(int index) const {
-        if (index < 0 || index >= documents_.size()) {
-            return SearchServer::INVALID_DOCUMENT_ID;
-        }
-
-        size_t doc_index = 0;
-        for (const auto& doc : documents_) {
-            if (doc_index == index) {
-                return doc.first;
-            }
-
-            ++doc_index;
+    // bytes_behind — сколько байт журнала ещё не прочитано, last_lag — задержка
+    // между записью последнего применённого изменения и его применением
+    ReplicationStats GetStats() const {
+        lock_guard lock(stats_mutex_);
+        ReplicationStats stats = stats_;
+        struct stat file_stat;
+        if (stat(log_path_.c_str(), &file_stat) == 0 && static_cast<uint64_t>(file_stat.st_size) > read_offset_) {
+            stats.bytes_behind = file_stat.st_size - max<uint64_t>(read_offset_, sizeof(CHANGE_LOG_MAGIC));
         }
 
-        return SearchServer::INVALID_DOCUMENT_ID;
+        return stats;
     }
 
 private:
-    struct DocumentData {
-        int rating;
-        DocumentStatus status;
-    };
+    SearchServer& replica_;
+    string log_path_;
+    uint64_t offset_ = 0;
 
-    set<string> stop_words_;
-    map<string, map<int, double>> word_to_document_freqs_;
-    map<int, DocumentData> documents_;
+    mutable mutex stats_mutex_;
+    ReplicationStats stats_;
+    uint64_t read_offset_ = 0;
 
-    bool IsStopWord(const string& word) const {
-        return stop_words_.count(word) > 0;
-    }
+    mutex poll_mutex_;
+    thread poller_;
+    mutex poller_mutex_;
+    condition_variable poller_cv_;
+    bool stop_ = false;
+};
 
-    vector<string> SplitIntoWordsNoStop(const string& text) const {
-        vector<string> words;
+class MappedIndex {
+public:
+    static optional<MappedIndex> Open(const string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullopt;
+        }
 
-        for (const string& word : SplitIntoWords(text)) {
-            if (!IsStopWord(word)) {
-                words.push_back(word);
-            }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(MappedIndexHeader)) {
+            close(fd);
+            return nullopt;
         }
 
-        return words;
-    }
+        const size_t size = file_stat.st_size;
+        void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return nullopt;
+        }
 
-    static int ComputeAverageRating(const vector<int>& ratings) {
-        if (ratings.empty()) {
-            return 0;
+        MappedIndex index(static_cast<const char*>(data), size);
+        if (!index.IsValid()) {
+            return nullopt;
         }
 
-        int rating_sum = 0;
-        for (const int rating : ratings) {
-            rating_sum += rating;
+        return index;
+    }
+
+    MappedIndex(MappedIndex&& other) noexcept
+        : data_(exchange(other.data_, nullptr)), size_(exchange(other.size_, 0)) { }
+
+    MappedIndex& operator=(MappedIndex&& other) noexcept {
+        if (this != &other) {
+            Unmap();
+            data_ = exchange(other.data_, nullptr);
+            size_ = exchange(other.size_, 0);
         }
 
-        return rating_sum / static_cast<int>(ratings.size());
+        return *this;
     }
 
-    struct QueryWord {
-        string data;
-        bool is_minus;
-        bool is_stop;
-    };
+    MappedIndex(const MappedIndex&) = delete;
+    MappedIndex& operator=(const MappedIndex&) = delete;
 
-    optional<QueryWord> ParseQueryWord(string text) const {
-        if (!IsValidWord(text)) {
+    ~MappedIndex() {
+        Unmap();
+    }
+
+    template <typename DocumentPredicate>
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate) const {
+        const optional<SearchServer::Query> query = ParseQuery(raw_query);
+        if (!SearchServer::IsValidWord(raw_query) || !query.has_value()) {
             return nullopt;
         }
 
-        bool is_minus = false;
+        vector<Document> result = FindAllDocuments(query.value(), document_predicate);
+        SearchServer::SortAndTruncateDocuments(result);
 
-        if (text[0] == '-') {
-            if (text[1] == '-') {
-                return nullopt;
-            }
+        return result;
+    }
 
-            is_minus = true;
-            text = text.substr(1);
+    optional<vector<Document>> FindTopDocuments(const string& raw_query, DocumentStatus status) const {
+        return FindTopDocuments(raw_query, [status](int, DocumentStatus doc_status, int) { return doc_status == status; });
+    }
+
+    optional<vector<Document>> FindTopDocuments(const string& raw_query) const {
+        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    }
+
+    int GetDocumentCount() const {
+        return Header().document_count;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+    MappedIndex(const char* data, size_t size)
+        : data_(data), size_(size) { }
+
+    void Unmap() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+            data_ = nullptr;
         }
+    }
 
-        return QueryWord {text, is_minus, IsStopWord(text)};
+    const MappedIndexHeader& Header() const {
+        return *reinterpret_cast<const MappedIndexHeader*>(data_);
     }
 
-    struct Query {
-        set<string> plus_words;
-        set<string> minus_words;
-    };
+    template <typename T>
+    const T* Section(uint64_t offset) const {
+        return reinterpret_cast<const T*>(data_ + offset);
+    }
 
-    optional<Query> ParseQuery(const string& text) const {
-        Query result;
+    // Проверяется один раз при открытии: после неё поиск не выходит за пределы файла
+    // при любых ссылках внутри него, а бинарный поиск слов работает по упорядоченным секциям
+    bool IsValid() const {
+        const MappedIndexHeader& header = Header();
+        const auto fits = [this](uint64_t offset, uint64_t count, uint64_t item_size, size_t alignment) {
+            return offset % alignment == 0 && offset <= size_ && count <= (size_ - offset) / item_size;
+        };
 
-        for (const string& word : SplitIntoWords(text)) {
-            const optional<QueryWord> query_word = ParseQueryWord(word);
-            if (!query_word.has_value()) {
-                return nullopt;
+        if (memcmp(header.magic, MAPPED_INDEX_MAGIC, sizeof(header.magic)) != 0
+            || header.file_size != size_
+            || !fits(header.documents_offset, header.document_count, sizeof(MappedDocument), alignof(MappedDocument))
+            || !fits(header.words_offset, header.word_count, sizeof(MappedWord), alignof(MappedWord))
+            || !fits(header.stop_words_offset, header.stop_word_count, sizeof(MappedString), alignof(MappedString))
+            || !fits(header.postings_offset, header.posting_count, sizeof(MappedPosting), alignof(MappedPosting))
+            || !fits(header.strings_offset, header.strings_size, 1, 1)) {
+            return false;
+        }
+
+        const auto is_valid_string = [&header](const MappedString& text) {
+            return text.offset <= header.strings_size && text.size <= header.strings_size - text.offset;
+        };
+
+        const MappedString* stop_words = Section<MappedString>(header.stop_words_offset);
+        for (uint64_t i = 0; i < header.stop_word_count; ++i) {
+            if (!is_valid_string(stop_words[i]) || (i > 0 && GetString(stop_words[i - 1]) >= GetString(stop_words[i]))) {
+                return false;
             }
+        }
 
-            if (!query_word.value().is_stop) {
-                if (query_word.value().is_minus) {
-                    result.minus_words.insert(query_word.value().data);
-                } else {
-                    result.plus_words.insert(query_word.value().data);
-                }
+        const MappedWord* words = Section<MappedWord>(header.words_offset);
+        for (uint64_t i = 0; i < header.word_count; ++i) {
+            const MappedWord& word = words[i];
+            if (!is_valid_string(word.text) || (i > 0 && GetString(words[i - 1].text) >= GetString(word.text))
+                || word.postings_begin > header.posting_count || word.postings_count > header.posting_count - word.postings_begin
+                || word.document_count == 0) {
+                return false;
             }
         }
 
-        return result;
+        const MappedPosting* postings = Section<MappedPosting>(header.postings_offset);
+        for (uint64_t i = 0; i < header.posting_count; ++i) {
+            if (postings[i].document_index >= header.document_count) {
+                return false;
+            }
+        }
+
+        return true;
     }
 
-    double ComputeWordInverseDocumentFreq(const string& word) const {
-        return log(GetDocumentCount() * 1.0 / word_to_document_freqs_.at(word).size());
+    string_view GetString(const MappedString& text) const {
+        return string_view(Section<char>(Header().strings_offset) + text.offset, text.size);
     }
 
-    template <typename KeyMapper>
-    vector<Document> FindAllDocuments(const Query& query, KeyMapper key_mapper) const {
-        map<int, double> document_to_relevance;
+    template <typename Entry, typename Projection>
+    const Entry* FindEntry(const Entry* begin, uint64_t count, string_view word, Projection projection) const {
+        const Entry* end = begin + count;
+        const Entry* it = lower_bound(begin, end, word, [this, &projection](const Entry& entry, string_view value) {
+            return GetString(projection(entry)) < value;
+        });
+
+        return it != end && GetString(projection(*it)) == word ? it : nullptr;
+    }
+
+    const MappedWord* FindWord(string_view word) const {
+        return FindEntry(Section<MappedWord>(Header().words_offset), Header().word_count, word,
+                         [](const MappedWord& entry) -> const MappedString& { return entry.text; });
+    }
+
+    bool IsStopWord(string_view word) const {
+        return FindEntry(Section<MappedString>(Header().stop_words_offset), Header().stop_word_count, word,
+                         [](const MappedString& entry) -> const MappedString& { return entry; }) != nullptr;
+    }
+
+    optional<SearchServer::Query> ParseQuery(const string& text) const {
+        return SearchServer::ParseQuery(text, [this](const string& word) {
+            return IsStopWord(word);
+        });
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindAllDocuments(const SearchServer::Query& query, DocumentPredicate document_predicate) const {
+        const MappedDocument* documents = Section<MappedDocument>(Header().documents_offset);
+        const MappedPosting* postings = Section<MappedPosting>(Header().postings_offset);
+        map<uint32_t, double> document_to_relevance;
 
         for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
+            const MappedWord* entry = FindWord(word);
+            if (entry == nullptr) {
                 continue;
             }
 
-            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-            for (const auto &[document_id, term_freq] : word_to_document_freqs_.at(word)) {
-                if (key_mapper(document_id, documents_.at(document_id).status, documents_.at(document_id).rating)) {
-                    document_to_relevance[document_id] += term_freq * inverse_document_freq;
+            const double inverse_document_freq = log(GetDocumentCount() * 1.0 / entry->document_count);
+            for (uint64_t i = 0; i < entry->postings_count; ++i) {
+                const MappedPosting& posting = postings[entry->postings_begin + i];
+                const MappedDocument& document = documents[posting.document_index];
+                if (document_predicate(document.id, static_cast<DocumentStatus>(document.status), document.rating)) {
+                    document_to_relevance[posting.document_index] += posting.term_freq * inverse_document_freq;
                 }
             }
         }
 
         for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
+            const MappedWord* entry = FindWord(word);
+            if (entry == nullptr) {
                 continue;
             }
 
-            for (const auto &[document_id, _] : word_to_document_freqs_.at(word)) {
-                document_to_relevance.erase(document_id);
+            for (uint64_t i = 0; i < entry->postings_count; ++i) {
+                document_to_relevance.erase(postings[entry->postings_begin + i].document_index);
             }
         }
 
         vector<Document> matched_documents;
-        for (const auto &[document_id, relevance] : document_to_relevance) {
-            matched_documents.push_back(
-                {document_id, relevance, documents_.at(document_id).rating});
+        for (const auto &[document_index, relevance] : document_to_relevance) {
+            matched_documents.push_back({documents[document_index].id, relevance, documents[document_index].rating});
         }
 
         return matched_documents;
     }
-
-    static bool IsValidWord(const string& word) {
-        if (word == "-"s) {
-            return false;
-        }
-        
-        return none_of(word.begin(), word.end(), [](char c) {
-            return c >= '\0' && c < ' ';
-        });
-    }
 };
 
 void PrintDocument(const Document& document) {
@@ -363,4 +6768,6 @@ int main() {
     } else {
         cout << "Ошибка в поисковом запросе"s << endl;
     }
-} 
+
+    return 0;
+}
@@ -0,0 +1,1433 @@
+// Регрессионные тесты поискового сервера.
+// Сборка: g++ -std=c++17 -O2 -pthread tests/search_server_tests.cpp -o search_server_tests
+#define main search_server_demo_main
+#include "../main.cpp"
+#undef main
+
+#include <numeric>
+#include <random>
+
+#define ASSERT_EQUAL(a, b) AssertEqual((a), (b), #a, #b, __FILE__, __LINE__)
+#define ASSERT(expr) AssertEqual(static_cast<bool>(expr), true, #expr, "true", __FILE__, __LINE__)
+
+template <typename T, typename U>
+void AssertEqual(const T& t, const U& u, const string& t_str, const string& u_str, const string& file, int line) {
+    if (t != u) {
+        cerr << file << "("s << line << "): ASSERT_EQUAL("s << t_str << ", "s << u_str << ") failed: "s
+             << t << " != "s << u << endl;
+        abort();
+    }
+}
+
+template <typename TestFunc>
+void RunTest(TestFunc func, const string& func_name) {
+    func();
+    cerr << func_name << " OK"s << endl;
+}
+
+#define RUN_TEST(func) RunTest((func), #func)
+
+size_t CountMatches(const SearchServer& search_server, const string& query) {
+    const auto documents = search_server.FindTopDocuments(query);
+    ASSERT(documents.has_value());
+    return documents->size();
+}
+
+// Одинаковые документы в одинаковом порядке с релевантностью в пределах DELTA
+void AssertSameDocuments(const optional<vector<Document>>& actual, const optional<vector<Document>>& expected) {
+    ASSERT_EQUAL(actual.has_value(), expected.has_value());
+    if (!expected.has_value()) {
+        return;
+    }
+    ASSERT_EQUAL(actual->size(), expected->size());
+    for (size_t i = 0; i < expected->size(); ++i) {
+        ASSERT_EQUAL((*actual)[i].id, (*expected)[i].id);
+        ASSERT_EQUAL((*actual)[i].rating, (*expected)[i].rating);
+        ASSERT(abs((*actual)[i].relevance - (*expected)[i].relevance) < DELTA);
+    }
+}
+
+string GetTempPath(const string& name) {
+    return "/tmp/search_server_tests_"s + to_string(getpid()) + "_"s + name;
+}
+
+string ReadFile(const string& path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+void WriteFile(const string& path, const string& data) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(data.data(), data.size());
+}
+
+// Документ тестового корпуса: рейтинг у всех разный, поэтому порядок результатов однозначен
+struct TestDocument {
+    string text;
+    DocumentStatus status;
+    int rating;
+};
+
+TestDocument GetTestCorpusDocument(int document_id) {
+    return {"кот w"s + to_string(document_id % 17) + " v"s + to_string(document_id % 29) + (document_id % 3 == 0 ? " пёс пёс"s : " скворец"s),
+            document_id % 11 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL, document_id};
+}
+
+const vector<string> TEST_CORPUS_QUERIES = {"кот"s, "пёс"s, "w3 v1"s, "w3 -пёс"s, "пёс w5 v7 -v8"s, "скворец -кот"s, "нет"s,
+                                            "w1 w2 w4 v0"s, "w1 w2 w4 v0 v1 v2 пёс"s, "v3 v4 -w5 -w6"s};
+
+// Документы begin, begin + step, ... до end
+void AddTestCorpus(SearchServer& search_server, int begin, int end, int step = 1) {
+    for (int document_id = begin; document_id < end; document_id += step) {
+        const TestDocument document = GetTestCorpusDocument(document_id);
+        (void) search_server.AddDocument(document_id, document.text, document.status, {document.rating});
+    }
+}
+
+// Поиск перебором всех документов по определению tf-idf, с которым сверяются ускоренные пути сервера
+class ReferenceIndex {
+public:
+    explicit ReferenceIndex(const string& stop_words) {
+        for (const string& word : SplitIntoWords(stop_words)) {
+            stop_words_.insert(word);
+        }
+    }
+
+    void Add(int document_id, const TestDocument& document) {
+        documents_.emplace(document_id, document);
+    }
+
+    void SetStatus(int document_id, DocumentStatus status) {
+        documents_.at(document_id).status = status;
+    }
+
+    void AddTestCorpus(int begin, int end, int step = 1) {
+        for (int document_id = begin; document_id < end; document_id += step) {
+            Add(document_id, GetTestCorpusDocument(document_id));
+        }
+    }
+
+    // Все подходящие документы, от лучших к худшим
+    template <typename DocumentPredicate>
+    vector<Document> FindAll(const string& raw_query, DocumentPredicate document_predicate) const {
+        set<string> plus_words;
+        set<string> minus_words;
+        for (const string& word : SplitIntoWords(raw_query)) {
+            const bool is_minus = word[0] == '-';
+            const string text = is_minus ? word.substr(1) : word;
+            if (stop_words_.count(text) == 0) {
+                (is_minus ? minus_words : plus_words).insert(text);
+            }
+        }
+
+        map<string, size_t> document_counts;
+        for (const auto& [_, document] : documents_) {
+            const vector<string> words = SplitIntoWords(document.text);
+            for (const string& word : set<string>(words.begin(), words.end())) {
+                ++document_counts[word];
+            }
+        }
+
+        vector<Document> result;
+        for (const auto& [document_id, document] : documents_) {
+            if (!document_predicate(document_id, document.status, document.rating)) {
+                continue;
+            }
+
+            map<string, double> term_freqs;
+            size_t word_count = 0;
+            for (const string& word : SplitIntoWords(document.text)) {
+                if (stop_words_.count(word) == 0) {
+                    term_freqs[word] += 1.0;
+                    ++word_count;
+                }
+            }
+
+            double relevance = 0.0;
+            bool matched = false;
+            for (const string& word : plus_words) {
+                if (term_freqs.count(word) > 0) {
+                    relevance += term_freqs.at(word) / word_count * log(documents_.size() * 1.0 / document_counts.at(word));
+                    matched = true;
+                }
+            }
+            if (matched && none_of(minus_words.begin(), minus_words.end(), [&term_freqs](const string& word) { return term_freqs.count(word) > 0; })) {
+                result.push_back({document_id, relevance, document.rating});
+            }
+        }
+
+        sort(result.begin(), result.end(), [](const Document& lhs, const Document& rhs) {
+            if (abs(lhs.relevance - rhs.relevance) < DELTA) {
+                return lhs.rating > rhs.rating;
+            }
+            return lhs.relevance > rhs.relevance;
+        });
+        return result;
+    }
+
+    vector<Document> FindTop(const string& raw_query, DocumentStatus status) const {
+        vector<Document> result = FindAll(raw_query, [status](int, DocumentStatus document_status, int) { return document_status == status; });
+        result.resize(min<size_t>(result.size(), MAX_RESULT_DOCUMENT_COUNT));
+        return result;
+    }
+
+    const map<int, TestDocument>& GetDocuments() const {
+        return documents_;
+    }
+
+private:
+    set<string> stop_words_;
+    map<int, TestDocument> documents_;
+};
+
+// Прореживание по вкладу и по числу posting-ов слова; отчёт считает байты индекса и пересечение
+// результатов, а пробные запросы не попадают в журнал запросов
+void TestPruneIndexPolicies() {
+    const auto make_server = [] {
+        auto search_server = make_unique<SearchServer>(""s);
+        (void) search_server->AddDocument(1, "пёс пёс"s, DocumentStatus::ACTUAL, {1});
+        (void) search_server->AddDocument(2, "пёс скворец"s, DocumentStatus::ACTUAL, {2});
+        (void) search_server->AddDocument(3, "пёс кот модный ошейник"s, DocumentStatus::ACTUAL, {3});
+        (void) search_server->AddDocument(4, "кот"s, DocumentStatus::ACTUAL, {4});
+        (void) search_server->AddDocument(5, "скворец"s, DocumentStatus::ACTUAL, {5});
+        return search_server;
+    };
+
+    // Вклад tf * idf у пёс в документе 3 — 0.25 * log(5 / 3) ≈ 0.13, у остальных posting-ов не меньше 0.22
+    const auto by_contribution = make_server();
+    PruningPolicy contribution_policy;
+    contribution_policy.min_contribution = 0.2;
+    const optional<PruningReport> contribution_report = by_contribution->PruneIndex(contribution_policy, {"пёс"s, "кот"s});
+    ASSERT(contribution_report.has_value());
+    ASSERT_EQUAL(contribution_report->words_before, 5u);
+    ASSERT_EQUAL(contribution_report->postings_before, 9u);
+    ASSERT_EQUAL(contribution_report->words_after, 5u);
+    ASSERT_EQUAL(contribution_report->postings_after, 8u);
+    ASSERT(abs(contribution_report->average_overlap - (2.0 / 3 + 1.0) / 2) < 1e-9);
+    ASSERT(by_contribution->GetRecentQueries().empty());
+
+    const auto pruned = by_contribution->FindTopDocuments("пёс"s);
+    ASSERT(pruned.has_value());
+    ASSERT_EQUAL(pruned->size(), 2u);
+    ASSERT_EQUAL(pruned->front().id, 1);
+    ASSERT_EQUAL(pruned->back().id, 2);
+    // idf не меняется: релевантность оставшихся документов та же, что до прореживания
+    ASSERT(abs(pruned->front().relevance - log(5.0 / 3)) < 1e-9);
+
+    // Слово сохраняет posting-и документов с наибольшим tf
+    const auto by_count = make_server();
+    PruningPolicy count_policy;
+    count_policy.max_postings_per_word = 1;
+    const optional<PruningReport> count_report = by_count->PruneIndex(count_policy, {"пёс"s, "скворец"s});
+    ASSERT(count_report.has_value());
+    ASSERT_EQUAL(count_report->postings_after, 5u);
+    ASSERT(abs(count_report->average_overlap - (1.0 / 3 + 1.0 / 2) / 2) < 1e-9);
+    ASSERT_EQUAL(by_count->FindTopDocuments("пёс"s)->front().id, 1);
+    ASSERT_EQUAL(by_count->FindTopDocuments("кот"s)->front().id, 4);
+    ASSERT_EQUAL(by_count->FindTopDocuments("скворец"s)->front().id, 5);
+
+    // Размер индекса в байтах совпадает с оценкой бюджета памяти и уменьшается
+    SearchServer large_server(""s);
+    for (int document_id = 0; document_id < 1000; ++document_id) {
+        (void) large_server.AddDocument(document_id, "пёс w"s + to_string(document_id % 10), DocumentStatus::ACTUAL, {1});
+    }
+    const size_t posting_bytes = large_server.GetMemoryUsage().GetBytes(MemorySubsystem::POSTINGS);
+    PruningPolicy large_policy;
+    large_policy.max_postings_per_word = 10;
+    const optional<PruningReport> large_report = large_server.PruneIndex(large_policy, {});
+    ASSERT(large_report.has_value());
+    ASSERT_EQUAL(large_report->bytes_before, posting_bytes);
+    ASSERT_EQUAL(large_report->bytes_after, large_server.GetMemoryUsage().GetBytes(MemorySubsystem::POSTINGS));
+    ASSERT(large_report->bytes_after * 10 < large_report->bytes_before);
+    ASSERT_EQUAL(large_report->postings_after, 110u);
+}
+
+// Найденные стоп-слова пересчитывают tf уже проиндексированных документов, а после
+// сброса слово снова находится во всех документах, в том числе добавленных в промежутке
+void TestDetectAndClearAutoStopWords() {
+    for (const bool keep_cold_postings : {false, true}) {
+        SearchServer search_server(""s);
+        (void) search_server.AddDocument(1, "кот пёс"s, DocumentStatus::ACTUAL, {1});
+        (void) search_server.AddDocument(2, "кот скворец"s, DocumentStatus::ACTUAL, {2});
+        (void) search_server.AddDocument(3, "кот ошейник"s, DocumentStatus::ACTUAL, {3});
+        (void) search_server.AddDocument(4, "пёс модный"s, DocumentStatus::ACTUAL, {4});
+
+        StopWordPolicy policy;
+        policy.max_document_ratio = 0.5;
+        policy.keep_cold_postings = keep_cold_postings;
+        ASSERT(search_server.DetectStopWords(policy) == vector<string>{"кот"s});
+        ASSERT(search_server.GetAutoStopWords() == set<string>{"кот"s});
+        search_server.WaitForReindex();
+        ASSERT_EQUAL(CountMatches(search_server, "кот"s), 0u);
+
+        (void) search_server.AddDocument(5, "кот пёс"s, DocumentStatus::ACTUAL, {5});
+        const auto detected = search_server.FindTopDocuments("пёс"s);
+        ASSERT(detected.has_value());
+        ASSERT_EQUAL(detected->size(), 3u);
+        for (const Document& document : *detected) {
+            ASSERT(abs(document.relevance - (document.id == 4 ? 0.5 : 1.0) * log(5.0 / 3)) < 1e-9);
+        }
+
+        search_server.ClearAutoStopWords();
+        search_server.WaitForReindex();
+        ASSERT(search_server.GetAutoStopWords().empty());
+        ASSERT_EQUAL(CountMatches(search_server, "кот"s), 4u);
+        const auto cleared = search_server.FindTopDocuments("пёс"s);
+        ASSERT(cleared.has_value());
+        ASSERT_EQUAL(cleared->size(), 3u);
+        for (const Document& document : *cleared) {
+            ASSERT(abs(document.relevance - 0.5 * log(5.0 / 3)) < 1e-9);
+        }
+    }
+}
+
+// Смена стоп-слов не должна возвращать posting-и, удалённые прореживанием
+void TestReindexKeepsPrunedPostings() {
+    SearchServer search_server(""s);
+    (void) search_server.AddDocument(1, "пёс пёс"s, DocumentStatus::ACTUAL, {1});
+    (void) search_server.AddDocument(2, "пёс скворец"s, DocumentStatus::ACTUAL, {2});
+    (void) search_server.AddDocument(3, "пёс кот модный ошейник"s, DocumentStatus::ACTUAL, {3});
+    (void) search_server.AddDocument(4, "пёс кот большой модный ошейник"s, DocumentStatus::ACTUAL, {4});
+    (void) search_server.AddDocument(5, "скворец"s, DocumentStatus::ACTUAL, {5});
+
+    PruningPolicy policy;
+    policy.max_postings_per_word = 2;
+    ASSERT(search_server.PruneIndex(policy, {"пёс"s}).has_value());
+    ASSERT_EQUAL(CountMatches(search_server, "пёс"s), 2u);
+
+    search_server.SetStopWords("кот"s);
+    search_server.WaitForReindex();
+    ASSERT_EQUAL(CountMatches(search_server, "пёс"s), 2u);
+    ASSERT_EQUAL(CountMatches(search_server, "кот"s), 0u);
+}
+
+// Слово, переставшее быть стоп-словом, индексируется заново во всех документах
+void TestRemovedStopWordIsReindexed() {
+    SearchServer search_server("кот"s);
+    (void) search_server.AddDocument(1, "пёс кот"s, DocumentStatus::ACTUAL, {1});
+    (void) search_server.AddDocument(2, "кот пушистый"s, DocumentStatus::ACTUAL, {2});
+    ASSERT_EQUAL(CountMatches(search_server, "кот"s), 0u);
+
+    search_server.RemoveStopWords("кот"s);
+    search_server.WaitForReindex();
+    ASSERT_EQUAL(CountMatches(search_server, "кот"s), 2u);
+    ASSERT_EQUAL(CountMatches(search_server, "пёс"s), 1u);
+}
+
+// Журнал хранит последние QUERY_LOG_SIZE запросов всех потоков; сервер, которому нужен прогрев,
+// не готов до его окончания
+void TestQueryLogAndReadiness() {
+    SearchServer search_server(""s);
+    ASSERT(search_server.IsReady());
+    search_server.RequireWarmUp();
+    (void) search_server.AddDocument(1, "пушистый кот"s, DocumentStatus::ACTUAL, {1});
+    ASSERT(!search_server.IsReady());
+
+    vector<thread> threads;
+    for (int thread_index = 0; thread_index < 4; ++thread_index) {
+        threads.emplace_back([&search_server, thread_index] {
+            for (size_t i = 0; i < QUERY_LOG_SIZE; ++i) {
+                (void) search_server.FindTopDocuments("кот"s + to_string(thread_index));
+            }
+        });
+    }
+    for (thread& worker : threads) {
+        worker.join();
+    }
+    (void) search_server.FindTopDocuments("пушистый"s);
+
+    const vector<string> recent_queries = search_server.GetRecentQueries();
+    ASSERT_EQUAL(recent_queries.size(), QUERY_LOG_SIZE);
+    ASSERT_EQUAL(recent_queries.back(), "пушистый"s);
+
+    search_server.WarmUpFromRecentQueries();
+    ASSERT(search_server.IsReady());
+
+    SearchServer cold_server(""s);
+    cold_server.RequireWarmUp();
+    ASSERT(!cold_server.IsReady());
+    cold_server.SkipWarmUp();
+    ASSERT(cold_server.IsReady());
+}
+
+// Смена режима при живых выделениях: каждый блок освобождается тем путём, которым выделен
+void TestHugePageModeSwitchWithLiveAllocations() {
+    HugePageArena& arena = HugePageArena::Instance();
+    const HugePageMode initial_mode = arena.GetMode();
+
+    vector<vector<int, HugePageAllocator<int>>> pooled;
+    arena.SetMode(HugePageMode::TRANSPARENT);
+    for (size_t size : {1, 100, 10000, 300000}) {
+        pooled.emplace_back(size, 1);
+    }
+
+    arena.SetMode(HugePageMode::DISABLED);
+    vector<vector<int, HugePageAllocator<int>>> plain;
+    for (size_t size : {1, 100, 10000, 300000}) {
+        plain.emplace_back(size, 2);
+    }
+
+    arena.SetMode(HugePageMode::TRANSPARENT);
+    pooled.clear();
+    plain.clear();
+
+    vector<thread> threads;
+    for (int thread_index = 0; thread_index < 4; ++thread_index) {
+        threads.emplace_back([thread_index] {
+            vector<vector<int, HugePageAllocator<int>>> blocks;
+            for (int i = 0; i < 20000; ++i) {
+                blocks.emplace_back(1 + (i * 7 + thread_index) % 300, i);
+                if (blocks.size() > 100) {
+                    blocks.erase(blocks.begin(), blocks.begin() + 50);
+                }
+            }
+        });
+    }
+    for (thread& worker : threads) {
+        worker.join();
+    }
+
+    arena.SetMode(initial_mode);
+}
+
+// Поразрядная сортировка даёт тот же порядок, что сравнение по (корзина, рейтинг) со стабильными равными,
+// в том числе для почти равных релевантностей и релевантностей выше предела 32-битной корзины
+void TestRelevanceOrderMatchesComparator() {
+    const vector<double> base_relevances = {0.0, DELTA, 0.5, 0.5 + DELTA * 0.3, 0.5 + DELTA * 0.999, 0.5 + DELTA,
+                                            4294.967294, 4294.967295, 4294.967296, 4295.5, 5000.0, 5000.0 + DELTA * 3, 1e9};
+    mt19937 generator(42);
+    vector<Document> documents;
+    for (int i = 0; i < 200000; ++i) {
+        double relevance = base_relevances[generator() % base_relevances.size()];
+        if (generator() % 4 == 0) {
+            relevance += uniform_real_distribution<double>(0.0, 10.0)(generator);
+        }
+        const int rating = static_cast<int>(generator() % 7) - 3 + (generator() % 50 == 0 ? INT_MIN / 2 : 0);
+        documents.emplace_back(i, relevance, rating);
+    }
+
+    vector<uint32_t> expected(documents.size());
+    iota(expected.begin(), expected.end(), 0);
+    stable_sort(expected.begin(), expected.end(), [&documents](uint32_t lhs, uint32_t rhs) {
+        const double lhs_bucket = floor(documents[lhs].relevance / DELTA);
+        const double rhs_bucket = floor(documents[rhs].relevance / DELTA);
+        if (lhs_bucket != rhs_bucket) {
+            return lhs_bucket > rhs_bucket;
+        }
+        return documents[lhs].rating > documents[rhs].rating;
+    });
+
+    const vector<uint32_t> order = OrderByRelevance(documents);
+    ASSERT(order == expected);
+
+    // Соседи, различающиеся больше чем на DELTA, упорядочены как в FindTopDocuments
+    for (size_t i = 1; i < order.size(); ++i) {
+        const Document& lhs = documents[order[i - 1]];
+        const Document& rhs = documents[order[i]];
+        ASSERT(abs(lhs.relevance - rhs.relevance) < DELTA || lhs.relevance > rhs.relevance);
+    }
+}
+
+// Снимки, которые читают и отпускают другие потоки, не меняются от параллельной записи в сервер,
+// а запись после освобождения снимка не портит данные
+void TestSnapshotsWithConcurrentIngest() {
+    SearchServer search_server(""s);
+    for (int document_id = 0; document_id < 1000; ++document_id) {
+        (void) search_server.AddDocument(document_id, "кот w"s + to_string(document_id % 10), DocumentStatus::ACTUAL, {document_id % 5});
+    }
+
+    atomic<bool> stop = false;
+    vector<thread> readers;
+    for (int thread_index = 0; thread_index < 3; ++thread_index) {
+        readers.emplace_back([&search_server, &stop] {
+            while (!stop) {
+                const shared_ptr<const SearchServer> snapshot = search_server.Snapshot();
+                const size_t document_count = snapshot->GetDocumentCount();
+                const auto before = snapshot->ExportAllDocuments("кот w3"s);
+                this_thread::yield();
+                const auto after = snapshot->ExportAllDocuments("кот w3"s);
+                ASSERT(before.has_value() && after.has_value());
+                ASSERT_EQUAL(before->size(), document_count);
+                ASSERT_EQUAL(after->size(), document_count);
+                for (size_t i = 0; i < before->size(); ++i) {
+                    ASSERT_EQUAL((*before)[i].id, (*after)[i].id);
+                    ASSERT_EQUAL((*before)[i].rating, (*after)[i].rating);
+                }
+            }
+        });
+    }
+
+    for (int document_id = 1000; document_id < 6000; ++document_id) {
+        (void) search_server.AddDocument(document_id, "кот w"s + to_string(document_id % 10), DocumentStatus::ACTUAL, {document_id % 5});
+        if (document_id % 7 == 0) {
+            (void) search_server.SetDocumentStatus(document_id - 500, DocumentStatus::ACTUAL);
+        }
+    }
+    stop = true;
+    for (thread& reader : readers) {
+        reader.join();
+    }
+
+    ASSERT_EQUAL(search_server.GetDocumentCount(), 6000);
+    const auto documents = search_server.ExportAllDocuments("w3"s);
+    ASSERT(documents.has_value());
+    ASSERT_EQUAL(documents->size(), 600u);
+}
+
+// Неположительный half_life — ошибка запроса; редкое слово находится, даже если совпадений меньше пяти
+void TestFreshnessDecay() {
+    SearchServer search_server(""s);
+    for (int document_id = 0; document_id < 20000; ++document_id) {
+        (void) search_server.AddDocument(document_id, "кот w"s + to_string(document_id % 100), DocumentStatus::ACTUAL, {1});
+        (void) search_server.SetDocumentTimestamp(document_id, document_id);
+    }
+    (void) search_server.AddDocument(20000, "пёс"s, DocumentStatus::ACTUAL, {1});
+    (void) search_server.SetDocumentTimestamp(20000, 20000);
+
+    ASSERT(!search_server.FindTopDocuments("кот"s, DocumentStatus::ACTUAL, FreshnessDecay{20000, 0}).has_value());
+    ASSERT(!search_server.FindTopDocuments("кот"s, DocumentStatus::ACTUAL, FreshnessDecay{20000, -5}).has_value());
+
+    const auto documents = search_server.FindTopDocuments("пёс"s, DocumentStatus::ACTUAL, FreshnessDecay{20000, 100});
+    ASSERT(documents.has_value());
+    ASSERT_EQUAL(documents->size(), 1u);
+    ASSERT_EQUAL(documents->front().id, 20000);
+
+    const auto fresh = search_server.FindTopDocuments("кот w7"s, DocumentStatus::ACTUAL, FreshnessDecay{20000, 100});
+    ASSERT(fresh.has_value());
+    ASSERT_EQUAL(fresh->size(), static_cast<size_t>(MAX_RESULT_DOCUMENT_COUNT));
+    ASSERT_EQUAL(fresh->front().id, 19907);
+}
+
+// Все варианты ядра накопления дают те же суммы, что скалярный, включая неполный хвост блока
+void TestAccumulateScoresKernelsAgree() {
+    vector<AccumulateScoresKernel> kernels = {AccumulateScoresScalar, GetAccumulateScoresKernel()};
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(AccumulateScoresAvx2);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back(AccumulateScoresAvx512);
+    }
+#endif
+
+    vector<int> document_ids;
+    vector<double> term_freqs;
+    for (int document_id = 3; document_id < 5000; document_id += 1 + document_id % 5) {
+        document_ids.push_back(document_id);
+        term_freqs.push_back(1.0 / (1 + document_id % 11));
+    }
+
+    vector<double> reference;
+    for (const AccumulateScoresKernel kernel : kernels) {
+        vector<double> scores(5000, -0.0);
+        for (const double inverse_document_freq : {0.3, 1.7}) {
+            for (size_t begin = 0; begin < document_ids.size(); begin += 13) {
+                kernel(scores.data(), document_ids.data() + begin, term_freqs.data() + begin,
+                       min<size_t>(13, document_ids.size() - begin), inverse_document_freq);
+            }
+        }
+        if (reference.empty()) {
+            reference = scores;
+        }
+        ASSERT(memcmp(reference.data(), scores.data(), scores.size() * sizeof(double)) == 0);
+    }
+}
+
+// Слова документа с занятым id не попадают в общий словарь
+void TestRejectedDocumentDoesNotGrowDictionary() {
+    const auto terms = make_shared<TermDictionary>();
+    SearchServer search_server(terms, ""s);
+    ASSERT(search_server.AddDocument(1, "пушистый кот"s, DocumentStatus::ACTUAL, {1}));
+    ASSERT(!search_server.AddDocument(1, "скворец ошейник"s, DocumentStatus::ACTUAL, {1}));
+    ASSERT(terms->Find("пушистый"s).has_value());
+    ASSERT(!terms->Find("скворец"s).has_value());
+    ASSERT(!terms->Find("ошейник"s).has_value());
+}
+
+// Пачка запросов не зависит от диапазона id: документ с id около 2^31 не требует памяти под весь диапазон
+void TestQueryBatchWithLargeDocumentIds() {
+    SearchServer search_server("и в"s);
+    (void) search_server.AddDocument(2000000000, "пушистый кот"s, DocumentStatus::ACTUAL, {5});
+    (void) search_server.AddDocument(7, "пушистый пёс"s, DocumentStatus::ACTUAL, {1});
+    (void) search_server.AddDocument(1999999999, "кот и пёс"s, DocumentStatus::BANNED, {2});
+    search_server.EnableQueryBatching({});
+
+    const vector<string> raw_queries = {"пушистый кот"s, "пёс -кот"s, "кот"s, "--кот"s};
+    vector<future<optional<vector<Document>>>> futures;
+    for (const string& raw_query : raw_queries) {
+        futures.push_back(search_server.FindTopDocumentsAsync(raw_query));
+    }
+    futures.push_back(search_server.FindTopDocumentsAsync("кот"s, DocumentStatus::BANNED));
+
+    for (size_t i = 0; i < raw_queries.size(); ++i) {
+        const optional<vector<Document>> batched = futures[i].get();
+        const optional<vector<Document>> direct = search_server.FindTopDocuments(raw_queries[i]);
+        ASSERT_EQUAL(batched.has_value(), direct.has_value());
+        if (!direct.has_value()) {
+            continue;
+        }
+        ASSERT_EQUAL(batched->size(), direct->size());
+        for (size_t j = 0; j < direct->size(); ++j) {
+            ASSERT_EQUAL((*batched)[j].id, (*direct)[j].id);
+            ASSERT_EQUAL((*batched)[j].relevance, (*direct)[j].relevance);
+        }
+    }
+    const optional<vector<Document>> banned = futures.back().get();
+    ASSERT(banned.has_value());
+    ASSERT_EQUAL(banned->size(), 1u);
+    ASSERT_EQUAL(banned->front().id, 1999999999);
+
+    search_server.DisableQueryBatching();
+}
+
+// Массив оценок плотного поиска учитывается в бюджете и вытесняется им; без холодного
+// уровня posting-листы остаются на месте
+void TestMemoryBudgetEvictsScoreBuffers() {
+    SearchServer search_server(""s);
+    for (int document_id = 0; document_id < 1000; ++document_id) {
+        (void) search_server.AddDocument(document_id, document_id % 2 == 0 ? "пушистый кот"s : "пёс"s, DocumentStatus::ACTUAL, {1});
+    }
+    const optional<vector<Document>> before = search_server.FindTopDocuments("кот -скворец"s);
+    ASSERT(before.has_value());
+
+    const MemoryUsage usage = search_server.GetMemoryUsage();
+    ASSERT(usage.GetBytes(MemorySubsystem::QUERY_SCRATCH) >= 1000 * sizeof(double));
+
+    search_server.EnableMemoryBudget(make_shared<MemoryBudget>(1));
+    ASSERT(search_server.EnforceMemoryBudget() > 0);
+    const MemoryUsage evicted = search_server.GetMemoryUsage();
+    search_server.DisableMemoryBudget();
+    ASSERT_EQUAL(evicted.GetBytes(MemorySubsystem::QUERY_SCRATCH), 0u);
+    ASSERT_EQUAL(evicted.evicted_bytes[static_cast<size_t>(MemorySubsystem::QUERY_SCRATCH)],
+                 usage.GetBytes(MemorySubsystem::QUERY_SCRATCH));
+    ASSERT_EQUAL(evicted.GetBytes(MemorySubsystem::POSTINGS), usage.GetBytes(MemorySubsystem::POSTINGS));
+
+    const optional<vector<Document>> after = search_server.FindTopDocuments("кот -скворец"s);
+    ASSERT(after.has_value());
+    ASSERT_EQUAL(after->size(), before->size());
+}
+
+// Экспортированный индекс отвечает так же, как сервер; файл со ссылками за пределы секций
+// или с неупорядоченными словами не открывается
+void TestMappedIndexRoundTrip() {
+    SearchServer search_server("и в на"s);
+    for (int document_id = 0; document_id < 300; ++document_id) {
+        const DocumentStatus status = document_id % 7 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+        (void) search_server.AddDocument(document_id, "кот и w"s + to_string(document_id % 13) + " v"s + to_string(document_id % 5),
+                                         status, {document_id % 9 - 4});
+    }
+
+    const string path = GetTempPath("mapped_index"s);
+    ASSERT(search_server.ExportIndex(path));
+    {
+        const optional<MappedIndex> index = MappedIndex::Open(path);
+        ASSERT(index.has_value());
+        ASSERT_EQUAL(index->GetDocumentCount(), search_server.GetDocumentCount());
+        for (const string& raw_query : {"кот"s, "w3 v1"s, "w3 -v3"s, "и"s, "нет"s, "--кот"s, "кот w1 w2 w4 v0"s}) {
+            AssertSameDocuments(index->FindTopDocuments(raw_query), search_server.FindTopDocuments(raw_query));
+            AssertSameDocuments(index->FindTopDocuments(raw_query, DocumentStatus::BANNED),
+                                search_server.FindTopDocuments(raw_query, DocumentStatus::BANNED));
+        }
+    }
+
+    const string data = ReadFile(path);
+    MappedIndexHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    const auto word_at = [&header](uint64_t index) {
+        return header.words_offset + index * sizeof(MappedWord);
+    };
+
+    const auto assert_rejected = [&path](string corrupted, uint64_t offset, const void* value, size_t size) {
+        memcpy(corrupted.data() + offset, value, size);
+        WriteFile(path, corrupted);
+        ASSERT(!MappedIndex::Open(path).has_value());
+    };
+
+    const uint64_t past_postings = header.posting_count;
+    assert_rejected(data, word_at(1) + offsetof(MappedWord, postings_begin), &past_postings, sizeof(past_postings));
+    const uint64_t too_many_postings = header.posting_count + 1;
+    assert_rejected(data, word_at(0) + offsetof(MappedWord, postings_count), &too_many_postings, sizeof(too_many_postings));
+    const uint32_t past_documents = static_cast<uint32_t>(header.document_count);
+    assert_rejected(data, header.postings_offset + 5 * sizeof(MappedPosting) + offsetof(MappedPosting, document_index),
+                    &past_documents, sizeof(past_documents));
+    const uint64_t past_strings = header.strings_size;
+    assert_rejected(data, word_at(2) + offsetof(MappedWord, text) + offsetof(MappedString, size), &past_strings, sizeof(past_strings));
+    assert_rejected(data, header.stop_words_offset + offsetof(MappedString, offset), &past_strings, sizeof(past_strings));
+    MappedWord swapped[2];
+    memcpy(swapped, data.data() + word_at(0), sizeof(swapped));
+    swap(swapped[0], swapped[1]);
+    assert_rejected(data, word_at(0), swapped, sizeof(swapped));
+
+    WriteFile(path, data.substr(0, data.size() - 1));
+    ASSERT(!MappedIndex::Open(path).has_value());
+    WriteFile(path, data);
+    ASSERT(MappedIndex::Open(path).has_value());
+    remove(path.c_str());
+}
+
+// Поиск по холодным posting-ам в файле даёт те же результаты, что и по индексу в памяти,
+// в том числе после записи в сервер и после возврата всех слов в память
+void TestTieredStorageMatchesInMemoryIndex() {
+    SearchServer reference(""s);
+    SearchServer tiered(""s);
+    AddTestCorpus(reference, 0, 2000);
+    AddTestCorpus(tiered, 0, 2000);
+
+    const auto assert_same = [&reference, &tiered] {
+        for (const string& raw_query : TEST_CORPUS_QUERIES) {
+            AssertSameDocuments(tiered.FindTopDocuments(raw_query), reference.FindTopDocuments(raw_query));
+            AssertSameDocuments(tiered.FindTopDocuments(raw_query, DocumentStatus::BANNED),
+                                reference.FindTopDocuments(raw_query, DocumentStatus::BANNED));
+            AssertSameDocuments(tiered.ExportAllDocuments(raw_query), reference.ExportAllDocuments(raw_query));
+        }
+    };
+
+    const string path = GetTempPath("cold_postings"s);
+    TieredStorageOptions options;
+    options.path = path;
+    options.max_hot_postings = 300;
+    options.rebalance_interval = chrono::milliseconds(5);
+    ASSERT(tiered.EnableTieredStorage(options));
+    ASSERT(tiered.GetTieredStorageStats().cold_words > 0);
+    assert_same();
+    ASSERT(tiered.GetTieredStorageStats().cold_lookups > 0);
+
+    // Прореживание переписывает файл по одному слову и не поднимает холодный уровень в память;
+    // автоматические стоп-слова поднимают только свои posting-листы
+    PruningPolicy pruning_policy;
+    pruning_policy.min_contribution = 0.05;
+    pruning_policy.max_postings_per_word = 100;
+    const optional<PruningReport> reference_report = reference.PruneIndex(pruning_policy, {"пёс"s});
+    const optional<PruningReport> tiered_report = tiered.PruneIndex(pruning_policy, {"пёс"s});
+    ASSERT(reference_report.has_value() && tiered_report.has_value());
+    ASSERT_EQUAL(tiered_report->words_before, reference_report->words_before);
+    ASSERT_EQUAL(tiered_report->postings_before, reference_report->postings_before);
+    ASSERT_EQUAL(tiered_report->words_after, reference_report->words_after);
+    ASSERT_EQUAL(tiered_report->postings_after, reference_report->postings_after);
+    ASSERT(tiered_report->postings_after < tiered_report->postings_before);
+    ASSERT(tiered_report->bytes_before < reference_report->bytes_before / 2);
+    ASSERT(tiered_report->bytes_after < reference_report->bytes_after / 2);
+    ASSERT(tiered.GetTieredStorageStats().cold_words > 0);
+    assert_same();
+
+    StopWordPolicy stop_word_policy;
+    stop_word_policy.max_document_ratio = 0.9;
+    ASSERT(tiered.DetectStopWords(stop_word_policy) == reference.DetectStopWords(stop_word_policy));
+    reference.WaitForReindex();
+    tiered.WaitForReindex();
+    assert_same();
+    reference.ClearAutoStopWords();
+    tiered.ClearAutoStopWords();
+    reference.WaitForReindex();
+    tiered.WaitForReindex();
+    assert_same();
+
+    this_thread::sleep_for(chrono::milliseconds(20));
+    AddTestCorpus(reference, 2000, 2500);
+    AddTestCorpus(tiered, 2000, 2500);
+    reference.SetStopWords("скворец"s);
+    tiered.SetStopWords("скворец"s);
+    reference.WaitForReindex();
+    tiered.WaitForReindex();
+    assert_same();
+
+    tiered.DisableTieredStorage();
+    ASSERT_EQUAL(tiered.GetTieredStorageStats().cold_words, 0u);
+    assert_same();
+    remove(path.c_str());
+}
+
+// Поблочный обход posting-ов с предвыборкой метаданных даёт результаты полного перебора —
+// и при плотном массиве оценок, и при разреженных id документов, и с порогом релевантности
+void TestPrefetchedScoringMatchesReference() {
+    for (const int step : {1, 997}) {
+        SearchServer search_server("v7"s);
+        ReferenceIndex reference("v7"s);
+        AddTestCorpus(search_server, 0, 3000 * step, step);
+        reference.AddTestCorpus(0, 3000 * step, step);
+
+        for (const string& raw_query : TEST_CORPUS_QUERIES) {
+            for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED, DocumentStatus::REMOVED}) {
+                AssertSameDocuments(search_server.FindTopDocuments(raw_query, status), reference.FindTop(raw_query, status));
+            }
+
+            const auto is_even = [](int document_id, DocumentStatus, int) { return document_id % 2 == 0; };
+            vector<Document> expected = reference.FindAll(raw_query, is_even);
+            expected.resize(min<size_t>(expected.size(), MAX_RESULT_DOCUMENT_COUNT));
+            AssertSameDocuments(search_server.FindTopDocuments(raw_query, is_even), expected);
+
+            for (const double min_relevance : {1e-9, 0.3}) {
+                vector<Document> relevant = reference.FindAll(raw_query, [](int, DocumentStatus status, int) {
+                    return status == DocumentStatus::ACTUAL;
+                });
+                relevant.erase(remove_if(relevant.begin(), relevant.end(), [min_relevance](const Document& document) {
+                    return document.relevance < min_relevance;
+                }), relevant.end());
+                relevant.resize(min<size_t>(relevant.size(), MAX_RESULT_DOCUMENT_COUNT));
+                AssertSameDocuments(search_server.FindTopDocuments(raw_query, DocumentStatus::ACTUAL, min_relevance), relevant);
+            }
+        }
+    }
+}
+
+// Ядра коротких запросов дают те же результаты, что общий путь и полный перебор,
+// в том числе когда posting-листы читаются из холодного файла
+void TestShortQueryKernelsMatchGeneralPath() {
+    SearchServer search_server("v7"s);
+    ReferenceIndex reference("v7"s);
+    AddTestCorpus(search_server, 0, 3000);
+    reference.AddTestCorpus(0, 3000);
+    // Наибольший допустимый id не должен теряться при слиянии posting-листов
+    for (const auto& [document_id, document] : {pair{INT_MAX, TestDocument{"хвост пёс"s, DocumentStatus::ACTUAL, -1}},
+                                                pair{INT_MAX - 1, TestDocument{"хвост w3"s, DocumentStatus::ACTUAL, -2}}}) {
+        ASSERT(search_server.AddDocument(document_id, document.text, document.status, {document.rating}));
+        reference.Add(document_id, document);
+    }
+
+    const vector<string> short_queries = {"пёс"s, "w3"s, "w3 v1"s, "пёс скворец"s, "w3 v1 пёс"s, "w3 w3 v7"s, "нет w2"s, "v7"s, "нет"s,
+                                          "хвост"s, "хвост пёс"s, "пёс хвост w3"s};
+    const auto check = [&] {
+        for (const string& raw_query : short_queries) {
+            for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+                // Минус-слово, которого нет в индексе, уводит запрос на общий путь
+                const optional<vector<Document>> general = search_server.FindTopDocuments(raw_query + " -нет"s, status);
+                AssertSameDocuments(search_server.FindTopDocuments(raw_query, status), general);
+                AssertSameDocuments(general, reference.FindTop(raw_query, status));
+            }
+        }
+    };
+
+    check();
+    const optional<vector<Document>> max_id = search_server.FindTopDocuments("хвост пёс"s);
+    ASSERT(max_id.has_value() && !max_id->empty());
+    ASSERT_EQUAL(max_id->front().id, INT_MAX);
+
+    const string path = GetTempPath("short_query_cold"s);
+    TieredStorageOptions options;
+    options.path = path;
+    options.max_hot_postings = 100;
+    ASSERT(search_server.EnableTieredStorage(options));
+    check();
+    search_server.DisableTieredStorage();
+    remove(path.c_str());
+}
+
+// Порядок по рейтингу (равные по id) и по id совпадает с сортировкой всех совпадений —
+// и для редких слов, где совпадения сортируются, и для частых, где идёт обход перестановки
+void TestSortModesMatchReference() {
+    SearchServer search_server("v7"s);
+    ReferenceIndex reference("v7"s);
+    const auto add_document = [&](int document_id, int rating, const string& extra_words = ""s) {
+        TestDocument document = GetTestCorpusDocument(document_id);
+        document.rating = rating;
+        document.text += extra_words;
+        if (document_id % 40 == 0) {
+            document.text += " редкий"s;
+        }
+        (void) search_server.AddDocument(document_id, document.text, document.status, {document.rating});
+        reference.Add(document_id, document);
+    };
+    for (int document_id = 0; document_id < 2000; ++document_id) {
+        add_document(document_id, document_id % 7 - 3);
+    }
+    // Наибольший допустимый id тоже доходит до конца слияния по id
+    add_document(2000, 3, " хвост"s);
+    add_document(2040, 3, " хвост"s);
+    add_document(INT_MAX, 3, " хвост"s);
+
+    const auto check = [&] {
+        for (const string& raw_query : {"кот"s, "пёс"s, "редкий"s, "редкий -пёс"s, "w3 v1"s, "пёс w5 -v8"s, "нет"s, "v7"s, "хвост"s, "хвост редкий"s}) {
+            for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+                vector<Document> matches = reference.FindAll(raw_query, [status](int, DocumentStatus document_status, int) {
+                    return document_status == status;
+                });
+                const size_t result_size = min<size_t>(matches.size(), MAX_RESULT_DOCUMENT_COUNT);
+
+                sort(matches.begin(), matches.end(), [](const Document& lhs, const Document& rhs) {
+                    return lhs.rating > rhs.rating || (lhs.rating == rhs.rating && lhs.id < rhs.id);
+                });
+                AssertSameDocuments(search_server.FindTopDocuments(raw_query, status, SortMode::RATING),
+                                    vector<Document>(matches.begin(), matches.begin() + result_size));
+
+                sort(matches.begin(), matches.end(), [](const Document& lhs, const Document& rhs) {
+                    return lhs.id < rhs.id;
+                });
+                AssertSameDocuments(search_server.FindTopDocuments(raw_query, status, SortMode::ID),
+                                    vector<Document>(matches.begin(), matches.begin() + result_size));
+
+                AssertSameDocuments(search_server.FindTopDocuments(raw_query, status, SortMode::RELEVANCE),
+                                    search_server.FindTopDocuments(raw_query, status));
+            }
+        }
+    };
+
+    check();
+
+    // Перестановка по рейтингу пересчитывается после новых документов и смены статуса
+    add_document(5000, 100);
+    add_document(4000, 100);
+    ASSERT_EQUAL(search_server.FindTopDocuments("кот"s, DocumentStatus::ACTUAL, SortMode::RATING)->front().id, 4000);
+    (void) search_server.SetDocumentStatus(4000, DocumentStatus::IRRELEVANT);
+    reference.SetStatus(4000, DocumentStatus::IRRELEVANT);
+    ASSERT_EQUAL(search_server.FindTopDocuments("кот"s, DocumentStatus::ACTUAL, SortMode::RATING)->front().id, 5000);
+    check();
+}
+
+// Буферизованные документы не видны до обновления, а после него сервер отвечает так же,
+// как сервер с немедленной записью; повтор id отвергается и пока документ в буфере
+void TestBufferedIngestMatchesDirectIngest() {
+    SearchServer direct("v7"s);
+    SearchServer buffered("v7"s);
+    AddTestCorpus(direct, 0, 1000);
+    AddTestCorpus(buffered, 0, 1000);
+
+    BufferedIngestOptions options;
+    options.refresh_interval = chrono::hours(1);
+    options.max_buffered_documents = 1000000;
+    buffered.EnableBufferedIngest(options);
+    const size_t visible_before = direct.ExportAllDocuments("кот"s)->size();
+
+    AddTestCorpus(direct, 1000, 3000);
+    AddTestCorpus(buffered, 1000, 3000);
+    ASSERT(!buffered.AddDocument(1500, "кот"s, DocumentStatus::ACTUAL, {1}));
+    ASSERT(!buffered.AddDocument(500, "кот"s, DocumentStatus::ACTUAL, {1}));
+    ASSERT_EQUAL(buffered.GetDocumentCount(), 1000);
+    ASSERT_EQUAL(buffered.GetIngestStats().documents_pending, 2000u);
+    ASSERT_EQUAL(buffered.ExportAllDocuments("кот"s)->size(), visible_before);
+
+    ASSERT_EQUAL(buffered.Refresh(), 2000u);
+    ASSERT_EQUAL(buffered.GetDocumentCount(), 3000);
+    ASSERT_EQUAL(buffered.GetIngestStats().documents_refreshed, 2000u);
+    for (const string& raw_query : TEST_CORPUS_QUERIES) {
+        AssertSameDocuments(buffered.FindTopDocuments(raw_query), direct.FindTopDocuments(raw_query));
+        AssertSameDocuments(buffered.ExportAllDocuments(raw_query, DocumentStatus::BANNED),
+                            direct.ExportAllDocuments(raw_query, DocumentStatus::BANNED));
+    }
+
+    // Заполненный буфер обновляется фоновым потоком, не дожидаясь интервала
+    options.max_buffered_documents = 100;
+    buffered.EnableBufferedIngest(options);
+    AddTestCorpus(direct, 3000, 3100);
+    AddTestCorpus(buffered, 3000, 3100);
+    for (int attempt = 0; attempt < 1000 && buffered.GetDocumentCount() < 3100; ++attempt) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    ASSERT_EQUAL(buffered.GetDocumentCount(), 3100);
+
+    AddTestCorpus(direct, 3100, 3150);
+    AddTestCorpus(buffered, 3100, 3150);
+    buffered.DisableBufferedIngest();
+    ASSERT_EQUAL(buffered.GetDocumentCount(), 3150);
+    for (const string& raw_query : TEST_CORPUS_QUERIES) {
+        AssertSameDocuments(buffered.FindTopDocuments(raw_query), direct.FindTopDocuments(raw_query));
+    }
+}
+
+// Реплика читает журнал по кускам, как если бы основной сервер дописывал его между опросами:
+// недописанная запись ждёт следующего опроса, а повреждённая останавливает реплику
+void TestChangeLogFollowerTailsPrimary() {
+    const string primary_log = GetTempPath("primary_log"s);
+    const string replica_log = GetTempPath("replica_log"s);
+    remove(primary_log.c_str());
+
+    SearchServer primary("v7"s);
+    ASSERT(primary.EnableChangeLog(primary_log));
+    AddTestCorpus(primary, 0, 600);
+    (void) primary.SetDocumentStatus(5, DocumentStatus::BANNED);
+    (void) primary.SetDocumentTimestamp(6, 100);
+    primary.SetStopWords("v3"s);
+    primary.WaitForReindex();
+    StopWordPolicy stop_word_policy;
+    stop_word_policy.max_document_ratio = 0.9;
+    ASSERT(primary.DetectStopWords(stop_word_policy) == vector<string>{"кот"s});
+    primary.WaitForReindex();
+    PruningPolicy pruning_policy;
+    pruning_policy.max_postings_per_word = 50;
+    ASSERT(primary.PruneIndex(pruning_policy, {"пёс"s}).has_value());
+    AddTestCorpus(primary, 600, 700);
+    primary.ClearAutoStopWords();
+    primary.WaitForReindex();
+    primary.RemoveStopWords("v3"s);
+    primary.WaitForReindex();
+    primary.DisableChangeLog();
+
+    const string log = ReadFile(primary_log);
+    SearchServer replica("v7"s);
+    ChangeLogFollower follower(replica, replica_log);
+    uint64_t applied_sequence = 0;
+    for (size_t size = 0; size < log.size(); size += 997) {
+        WriteFile(replica_log, log.substr(0, size));
+        (void) follower.Poll();
+        const ReplicationStats stats = follower.GetStats();
+        ASSERT_EQUAL(stats.corrupt_offset, 0u);
+        ASSERT(stats.applied_sequence >= applied_sequence);
+        applied_sequence = stats.applied_sequence;
+    }
+    WriteFile(replica_log, log);
+    (void) follower.Poll();
+    replica.WaitForReindex();
+
+    ASSERT_EQUAL(follower.GetStats().applied_sequence, primary.GetChangeLogSequence());
+    ASSERT_EQUAL(follower.GetStats().bytes_behind, 0u);
+    ASSERT_EQUAL(replica.GetDocumentCount(), primary.GetDocumentCount());
+    ASSERT(replica.GetAutoStopWords().empty());
+    for (const string& raw_query : TEST_CORPUS_QUERIES) {
+        AssertSameDocuments(replica.FindTopDocuments(raw_query), primary.FindTopDocuments(raw_query));
+        AssertSameDocuments(replica.ExportAllDocuments(raw_query, DocumentStatus::BANNED), primary.ExportAllDocuments(raw_query, DocumentStatus::BANNED));
+    }
+
+    // Порча первой записи: неизвестный тип, огромный размер слов или неверная контрольная сумма
+    const size_t first_record = sizeof(CHANGE_LOG_MAGIC);
+    const auto assert_stops_at_first_record = [&](size_t field_offset, uint32_t value) {
+        string corrupted = log;
+        memcpy(corrupted.data() + first_record + field_offset, &value, sizeof(value));
+        WriteFile(replica_log, corrupted);
+        SearchServer stopped_replica("v7"s);
+        ChangeLogFollower stopped_follower(stopped_replica, replica_log);
+        ASSERT_EQUAL(stopped_follower.Poll(), 0u);
+        ASSERT_EQUAL(stopped_follower.GetStats().corrupt_offset, first_record);
+        ASSERT_EQUAL(stopped_replica.GetDocumentCount(), 0);
+    };
+    assert_stops_at_first_record(offsetof(ChangeRecordHeader, type), 99);
+    assert_stops_at_first_record(offsetof(ChangeRecordHeader, words_size), 0xFFFFFFF0u);
+    assert_stops_at_first_record(offsetof(ChangeRecordHeader, rating), 12345);
+    assert_stops_at_first_record(sizeof(ChangeRecordHeader), 0x20202020);
+
+    remove(primary_log.c_str());
+    remove(replica_log.c_str());
+}
+
+// Повреждённый снимок и снимок для непустого сервера отклоняются, не добавляя слов
+// в общий словарь; целый снимок в пустой сервер даёт тот же индекс
+void TestLoadSnapshotValidatesBeforeInterning() {
+    SearchServer source("v7"s);
+    AddTestCorpus(source, 0, 300);
+    const string path = GetTempPath("snapshot"s);
+    ASSERT(source.SaveSnapshot(path));
+    const string data = ReadFile(path);
+
+    const auto terms = make_shared<TermDictionary>();
+    const auto assert_rejected = [&](const string& snapshot) {
+        WriteFile(path, snapshot);
+        SearchServer target(terms, "v7"s);
+        const size_t dictionary_size = terms->GetSize();
+        ASSERT(!target.LoadSnapshot(path));
+        ASSERT_EQUAL(target.GetDocumentCount(), 0);
+        ASSERT_EQUAL(terms->GetSize(), dictionary_size);
+        ASSERT(!terms->Find("скворец"s).has_value());
+    };
+
+    string flipped = data;
+    flipped.back() ^= 1;
+    assert_rejected(flipped);
+
+    // Секция документов обрезана, но контрольные суммы пересчитаны: ошибку видно только при разборе
+    SnapshotHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    vector<SnapshotSectionEntry> sections(header.section_count);
+    memcpy(sections.data(), data.data() + sizeof(header), sections.size() * sizeof(SnapshotSectionEntry));
+    bool truncated = false;
+    for (SnapshotSectionEntry& section : sections) {
+        if (section.type == static_cast<uint32_t>(SnapshotSectionType::DOCUMENTS) && section.size > 1 && !truncated) {
+            --section.size;
+            section.crc = ComputeCrc32c(data.data() + section.offset, section.size);
+            truncated = true;
+        }
+    }
+    ASSERT(truncated);
+    string inconsistent = data;
+    memcpy(inconsistent.data() + sizeof(header), sections.data(), sections.size() * sizeof(SnapshotSectionEntry));
+    header.table_crc = ComputeCrc32c(inconsistent.data() + sizeof(header), sections.size() * sizeof(SnapshotSectionEntry));
+    memcpy(inconsistent.data(), &header, sizeof(header));
+    assert_rejected(inconsistent);
+
+    {
+        SearchServer non_empty(terms, "v7"s);
+        ASSERT(non_empty.AddDocument(1000, "кот"s, DocumentStatus::ACTUAL, {1}));
+        WriteFile(path, data);
+        const size_t dictionary_size = terms->GetSize();
+        ASSERT(!non_empty.LoadSnapshot(path));
+        ASSERT_EQUAL(non_empty.GetDocumentCount(), 1);
+        ASSERT_EQUAL(terms->GetSize(), dictionary_size);
+        ASSERT(!terms->Find("скворец"s).has_value());
+    }
+
+    SearchServer target(terms, "v7"s);
+    ASSERT(target.LoadSnapshot(path));
+    ASSERT(terms->Find("скворец"s).has_value());
+    ASSERT_EQUAL(target.GetDocumentCount(), source.GetDocumentCount());
+    ASSERT_EQUAL(target.GetChangeLogSequence(), source.GetChangeLogSequence());
+    for (const string& raw_query : TEST_CORPUS_QUERIES) {
+        AssertSameDocuments(target.FindTopDocuments(raw_query), source.FindTopDocuments(raw_query));
+        AssertSameDocuments(target.FindTopDocuments(raw_query, DocumentStatus::BANNED),
+                            source.FindTopDocuments(raw_query, DocumentStatus::BANNED));
+    }
+    remove(path.c_str());
+}
+
+// Серверы с общим словарём наполняются из разных потоков: пока слова добавляются,
+// поиск по словарю не находит чужих номеров, а каждый сервер отвечает так же,
+// как сервер с собственным словарём
+void TestSharedDictionaryUnderConcurrentInserts() {
+    const int server_count = 6;
+    const int words_per_server = 400;
+    const auto terms = make_shared<TermDictionary>();
+    vector<unique_ptr<SearchServer>> servers;
+    for (int i = 0; i < server_count; ++i) {
+        servers.push_back(make_unique<SearchServer>(terms, "v7"s));
+    }
+    const auto get_word = [](int server, int i) {
+        return "u"s + to_string(i) + "_"s + to_string(server % 2 == 0 ? i % 3 : server);
+    };
+
+    atomic<bool> done = false;
+    thread reader([&] {
+        map<string, TermId> seen;
+        while (!done) {
+            for (int server = 0; server < server_count; ++server) {
+                for (int i = 0; i < words_per_server; i += 37) {
+                    const string word = get_word(server, i);
+                    if (const optional<TermId> id = terms->Find(word)) {
+                        ASSERT_EQUAL(terms->GetTerm(*id), word);
+                        ASSERT_EQUAL(seen.emplace(word, *id).first->second, *id);
+                    }
+                }
+            }
+        }
+    });
+
+    vector<thread> writers;
+    for (int server = 0; server < server_count; ++server) {
+        writers.emplace_back([&, server] {
+            AddTestCorpus(*servers[server], server, 600, server_count);
+            for (int i = 0; i < words_per_server; ++i) {
+                (void) servers[server]->AddDocument(1000 + i, "кот "s + get_word(server, i), DocumentStatus::ACTUAL, {i});
+            }
+        });
+    }
+    for (thread& writer : writers) {
+        writer.join();
+    }
+    done = true;
+    reader.join();
+
+    for (TermId id = 0; id < terms->GetSize(); ++id) {
+        ASSERT_EQUAL(terms->Find(terms->GetTerm(id)).value(), id);
+    }
+    for (int server = 0; server < server_count; ++server) {
+        SearchServer expected("v7"s);
+        AddTestCorpus(expected, server, 600, server_count);
+        for (int i = 0; i < words_per_server; ++i) {
+            (void) expected.AddDocument(1000 + i, "кот "s + get_word(server, i), DocumentStatus::ACTUAL, {i});
+        }
+        ASSERT_EQUAL(servers[server]->GetDocumentCount(), expected.GetDocumentCount());
+        for (const string& raw_query : TEST_CORPUS_QUERIES) {
+            AssertSameDocuments(servers[server]->FindTopDocuments(raw_query), expected.FindTopDocuments(raw_query));
+        }
+        for (int i = 0; i < words_per_server; i += 37) {
+            const string raw_query = get_word(server, i) + " "s + get_word(server, i + 1);
+            AssertSameDocuments(servers[server]->FindTopDocuments(raw_query), expected.FindTopDocuments(raw_query));
+        }
+    }
+}
+
+// Поиск по арендатору совпадает с перебором его документов: у небольшого арендатора
+// через список его id или через битовую карту, если запрос редкий, у крупного — через карту
+void TestTenantSearchMatchesReference() {
+    SearchServer search_server("v7"s);
+    ReferenceIndex reference("v7"s);
+    map<uint32_t, set<int>> tenant_documents;
+    const auto get_tenant = [](int document_id) -> uint32_t {
+        if (document_id < 60 || (document_id >= 5900 && document_id < 5920)) {
+            return 1;
+        }
+        return document_id < 5160 ? 2 : 0;
+    };
+    for (int document_id = 0; document_id < 6000; ++document_id) {
+        TestDocument document = GetTestCorpusDocument(document_id);
+        if (document_id % 400 == 0) {
+            document.text += " редкий"s;
+        }
+        const uint32_t tenant = get_tenant(document_id);
+        ASSERT(search_server.AddDocument(document_id, document.text, document.status, {document.rating}, tenant));
+        reference.Add(document_id, document);
+        tenant_documents[tenant].insert(document_id);
+    }
+    // Редкие огромные id: битовая карта хранит куски только занятых диапазонов
+    for (const auto& [document_id, tenant] : {pair{INT_MAX, 2u}, pair{2000000000, 2u}, pair{1 << 30, 4u},
+                                              pair{INT_MAX - TenantDocuments::CHUNK_SIZE, 4u}, pair{INT_MAX - 1, 4u}}) {
+        const TestDocument document = GetTestCorpusDocument(document_id);
+        ASSERT(search_server.AddDocument(document_id, document.text, document.status, {document.rating}, tenant));
+        reference.Add(document_id, document);
+        tenant_documents[tenant].insert(document_id);
+    }
+    ASSERT_EQUAL(search_server.GetTenantDocumentCount(1), 80u);
+    ASSERT_EQUAL(search_server.GetTenantDocumentCount(2), 5102u);
+    ASSERT_EQUAL(search_server.GetTenantDocumentCount(3), 0u);
+    ASSERT_EQUAL(search_server.GetTenantDocumentCount(4), 3u);
+
+    for (const string& raw_query : {"кот"s, "редкий"s, "редкий -пёс"s, "пёс w5 v7 -v8"s, "w3 v1"s, "нет"s, "скворец -кот"s}) {
+        for (const uint32_t tenant : {0u, 1u, 2u, 3u, 4u}) {
+            const set<int>& documents = tenant_documents[tenant];
+            for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+                vector<Document> expected = reference.FindAll(raw_query, [&documents, status](int document_id, DocumentStatus document_status, int) {
+                    return document_status == status && documents.count(document_id) > 0;
+                });
+                expected.resize(min<size_t>(expected.size(), MAX_RESULT_DOCUMENT_COUNT));
+                AssertSameDocuments(search_server.FindTenantDocuments(tenant, raw_query, status), expected);
+            }
+
+            vector<Document> expected = reference.FindAll(raw_query, [&documents](int document_id, DocumentStatus, int rating) {
+                return rating % 2 == 0 && documents.count(document_id) > 0;
+            });
+            expected.resize(min<size_t>(expected.size(), MAX_RESULT_DOCUMENT_COUNT));
+            AssertSameDocuments(search_server.FindTenantDocuments(tenant, raw_query, [](int, DocumentStatus, int rating) {
+                return rating % 2 == 0;
+            }), expected);
+        }
+    }
+    ASSERT(!search_server.FindTenantDocuments(1, "кот --пёс"s).has_value());
+
+    // Снимок делит куски с сервером; запись в сервер после снимка его не меняет
+    const shared_ptr<const SearchServer> snapshot = search_server.Snapshot();
+    const TestDocument document = GetTestCorpusDocument(INT_MAX - 2);
+    ASSERT(search_server.AddDocument(INT_MAX - 2, document.text, document.status, {document.rating}, 4));
+    ASSERT_EQUAL(snapshot->GetTenantDocumentCount(4), 3u);
+    ASSERT_EQUAL(search_server.GetTenantDocumentCount(4), 4u);
+    const optional<vector<Document>> before = snapshot->FindTenantDocuments(4, "кот"s);
+    const optional<vector<Document>> after = search_server.FindTenantDocuments(4, "кот"s);
+    ASSERT(before.has_value() && after.has_value());
+    ASSERT_EQUAL(after->size(), before->size() + (document.status == DocumentStatus::ACTUAL ? 1u : 0u));
+}
+
+// Хеш-таблица словаря при одновременном добавлении одних и тех же слов из многих потоков
+// и нескольких расширениях: каждое слово получает ровно один номер, а поиск по заранее
+// посчитанному хешу, идущий параллельно, не находит ни чужих номеров, ни отсутствующих слов
+void TestSwissTableDictionaryUnderConcurrentInterning() {
+    const int word_count = 20000;
+    const int thread_count = 8;
+    TermDictionary terms;
+    const auto get_word = [](int i) {
+        return "t"s + to_string(i);
+    };
+
+    atomic<bool> done = false;
+    thread reader([&] {
+        mt19937 generator(1);
+        while (!done) {
+            const int i = static_cast<int>(generator() % word_count);
+            const string word = get_word(i);
+            if (const optional<TermId> id = terms.Find(word, TermDictionary::Hash(word))) {
+                ASSERT_EQUAL(terms.GetTerm(*id), word);
+            }
+            const string absent = "absent"s + to_string(i);
+            ASSERT(!terms.Find(absent, TermDictionary::Hash(absent)).has_value());
+        }
+    });
+
+    vector<vector<TermId>> ids(thread_count, vector<TermId>(word_count));
+    vector<thread> writers;
+    for (int t = 0; t < thread_count; ++t) {
+        writers.emplace_back([&, t] {
+            vector<int> order(word_count);
+            iota(order.begin(), order.end(), 0);
+            shuffle(order.begin(), order.end(), mt19937(t));
+            for (const int i : order) {
+                ids[t][i] = terms.Intern(get_word(i));
+            }
+        });
+    }
+    for (thread& writer : writers) {
+        writer.join();
+    }
+    done = true;
+    reader.join();
+
+    ASSERT_EQUAL(terms.GetSize(), static_cast<size_t>(word_count));
+    vector<bool> used(word_count);
+    for (int i = 0; i < word_count; ++i) {
+        const string word = get_word(i);
+        const TermId id = ids[0][i];
+        for (int t = 1; t < thread_count; ++t) {
+            ASSERT_EQUAL(ids[t][i], id);
+        }
+        ASSERT(id < static_cast<TermId>(word_count) && !used[id]);
+        used[id] = true;
+        ASSERT_EQUAL(terms.GetTerm(id), word);
+        ASSERT_EQUAL(terms.Find(word, TermDictionary::Hash(word)).value(), id);
+        ASSERT_EQUAL(terms.Find(word).value(), id);
+    }
+    ASSERT(!terms.Find(""s).has_value());
+    ASSERT_EQUAL(terms.Intern(""s), static_cast<TermId>(word_count));
+    ASSERT_EQUAL(terms.Find(""s).value(), static_cast<TermId>(word_count));
+}
+
+// Точный поиск, обход по порядку и перебор по префиксу в TermTree совпадают с std::map —
+// на словах с общими префиксами, байтами UTF-8 и узлами на все 256 потомков
+void TestTermTreeMatchesMap() {
+    mt19937 generator(7);
+    vector<string> terms;
+    map<string, TermId> expected;
+    const auto add_term = [&](string term) {
+        if (expected.emplace(term, static_cast<TermId>(terms.size())).second) {
+            terms.push_back(move(term));
+        }
+    };
+    const string alphabet = "абвxyz"s;
+    for (int i = 0; i < 20000; ++i) {
+        string term;
+        for (int length = 1 + generator() % 10; length > 0; --length) {
+            term += alphabet[generator() % alphabet.size()];
+        }
+        add_term(move(term));
+    }
+    for (int byte = 1; byte < 256; ++byte) {
+        add_term("q"s + static_cast<char>(byte));
+        add_term("q"s + static_cast<char>(byte) + "q"s);
+    }
+
+    TermTree tree([&terms](TermId term) {
+        return string_view(terms[term]);
+    });
+    for (TermId term = 0; term < terms.size(); ++term) {
+        ASSERT(tree.Insert(term));
+    }
+    ASSERT_EQUAL(tree.GetSize(), expected.size());
+
+    vector<TermId> ordered;
+    for (const auto& [_, term] : expected) {
+        ordered.push_back(term);
+    }
+    vector<TermId> visited;
+    (void) tree.ForEach([&visited](TermId term) {
+        visited.push_back(term);
+        return true;
+    });
+    ASSERT(visited == ordered);
+
+    vector<string> prefixes = {""s, "q"s, "qq"s, "а"s, "абв"s, "zzzzzzzzzzzz"s, "\xd0"s, "нет"s};
+    for (int i = 0; i < 2000; ++i) {
+        const string& term = terms[generator() % terms.size()];
+        prefixes.push_back(term.substr(0, generator() % (term.size() + 1)));
+        prefixes.push_back(term + "z"s);
+    }
+    for (const string& prefix : prefixes) {
+        vector<TermId> expected_terms;
+        for (auto it = expected.lower_bound(prefix); it != expected.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            expected_terms.push_back(it->second);
+        }
+        vector<TermId> found;
+        (void) tree.ForEachWithPrefix(prefix, [&found](TermId term) {
+            found.push_back(term);
+            return true;
+        });
+        ASSERT(found == expected_terms);
+
+        const size_t limit = expected_terms.size() / 2;
+        found.clear();
+        (void) tree.ForEachWithPrefix(prefix, [&found, limit](TermId term) {
+            found.push_back(term);
+            return found.size() < limit;
+        });
+        ASSERT_EQUAL(found.size(), limit == 0 ? min<size_t>(expected_terms.size(), 1) : limit);
+        ASSERT(equal(found.begin(), found.end(), expected_terms.begin()));
+
+        const auto it = expected.find(prefix);
+        const optional<TermId> term = tree.Find(prefix);
+        ASSERT_EQUAL(term.has_value(), it != expected.end());
+        ASSERT(!term.has_value() || *term == it->second);
+    }
+    ASSERT(!tree.Insert(0));
+
+    // Сервер перечисляет по префиксу только свои слова, хотя словарь общий
+    const auto dictionary = make_shared<TermDictionary>();
+    SearchServer search_server(dictionary, "кот"s);
+    SearchServer other(dictionary, ""s);
+    (void) other.AddDocument(1, "котёнок котлета скворец"s, DocumentStatus::ACTUAL, {1});
+    (void) search_server.AddDocument(1, "кот котик котёл пёс"s, DocumentStatus::ACTUAL, {1});
+    ASSERT(search_server.GetWordsWithPrefix("кот"s) == vector<string>({"котик"s, "котёл"s}));
+    ASSERT(search_server.GetWordsWithPrefix(""s) == vector<string>({"котик"s, "котёл"s, "пёс"s}));
+    ASSERT(other.GetWordsWithPrefix("кот"s) == vector<string>({"котлета"s, "котёнок"s}));
+    ASSERT(search_server.GetWordsWithPrefix("скв"s).empty());
+}
+
+// Много потоков добавляют одни и те же id вперемешку, с буферизацией и без: каждый id
+// принимается ровно один раз, а индекс совпадает с последовательно заполненным
+void TestConcurrentIngestWithDuplicateIds() {
+    const int document_count = 3000;
+    const int thread_count = 8;
+    SearchServer expected("v7"s);
+    AddTestCorpus(expected, 0, document_count);
+
+    for (const bool buffered : {false, true}) {
+        SearchServer search_server("v7"s);
+        if (buffered) {
+            BufferedIngestOptions options;
+            options.refresh_interval = chrono::milliseconds(1);
+            options.max_buffered_documents = 64;
+            search_server.EnableBufferedIngest(options);
+        }
+
+        vector<atomic<int>> accepted(document_count);
+        vector<thread> writers;
+        for (int t = 0; t < thread_count; ++t) {
+            writers.emplace_back([&, t] {
+                vector<int> order(document_count);
+                iota(order.begin(), order.end(), 0);
+                shuffle(order.begin(), order.end(), mt19937(t));
+                for (const int document_id : order) {
+                    const TestDocument document = GetTestCorpusDocument(document_id);
+                    if (search_server.AddDocument(document_id, document.text, document.status, {document.rating})) {
+                        ++accepted[document_id];
+                    }
+                }
+            });
+        }
+        for (thread& writer : writers) {
+            writer.join();
+        }
+        if (buffered) {
+            search_server.DisableBufferedIngest();
+        }
+
+        for (const atomic<int>& count : accepted) {
+            ASSERT_EQUAL(count.load(), 1);
+        }
+        ASSERT_EQUAL(search_server.GetDocumentCount(), document_count);
+        for (const string& raw_query : TEST_CORPUS_QUERIES) {
+            AssertSameDocuments(search_server.FindTopDocuments(raw_query), expected.FindTopDocuments(raw_query));
+            AssertSameDocuments(search_server.ExportAllDocuments(raw_query, DocumentStatus::BANNED),
+                                expected.ExportAllDocuments(raw_query, DocumentStatus::BANNED));
+        }
+    }
+}
+
+int main() {
+    RUN_TEST(TestPruneIndexPolicies);
+    RUN_TEST(TestDetectAndClearAutoStopWords);
+    RUN_TEST(TestReindexKeepsPrunedPostings);
+    RUN_TEST(TestRemovedStopWordIsReindexed);
+    RUN_TEST(TestQueryLogAndReadiness);
+    RUN_TEST(TestHugePageModeSwitchWithLiveAllocations);
+    RUN_TEST(TestRelevanceOrderMatchesComparator);
+    RUN_TEST(TestSnapshotsWithConcurrentIngest);
+    RUN_TEST(TestFreshnessDecay);
+    RUN_TEST(TestAccumulateScoresKernelsAgree);
+    RUN_TEST(TestRejectedDocumentDoesNotGrowDictionary);
+    RUN_TEST(TestQueryBatchWithLargeDocumentIds);
+    RUN_TEST(TestMemoryBudgetEvictsScoreBuffers);
+    RUN_TEST(TestMappedIndexRoundTrip);
+    RUN_TEST(TestTieredStorageMatchesInMemoryIndex);
+    RUN_TEST(TestPrefetchedScoringMatchesReference);
+    RUN_TEST(TestShortQueryKernelsMatchGeneralPath);
+    RUN_TEST(TestSortModesMatchReference);
+    RUN_TEST(TestBufferedIngestMatchesDirectIngest);
+    RUN_TEST(TestChangeLogFollowerTailsPrimary);
+    RUN_TEST(TestLoadSnapshotValidatesBeforeInterning);
+    RUN_TEST(TestSharedDictionaryUnderConcurrentInserts);
+    RUN_TEST(TestTenantSearchMatchesReference);
+    RUN_TEST(TestSwissTableDictionaryUnderConcurrentInterning);
+    RUN_TEST(TestTermTreeMatchesMap);
+    RUN_TEST(TestConcurrentIngestWithDuplicateIds);
+    cerr << "All tests passed"s << endl;
+}